@@ -29,6 +29,22 @@ macro(build_libcurl)
 
     set(LIBCURL "${CMAKE_CURRENT_BINARY_DIR}/third_party/curl-out")
 
+    # HTTP/2 needs nghttp2
+    if(WITH_NGHTTP2)
+        find_package(NGHTTP2 REQUIRED)
+        set(NGHTTP2_ARG "-DUSE_NGHTTP2=ON")
+    else()
+        set(NGHTTP2_ARG "-DUSE_NGHTTP2=OFF")
+        set(NGHTTP2_LIBRARIES "")
+    endif()
+
+    # Content-Encoding of responses needs zlib
+    if(ZLIB_FOUND)
+        set(ZLIB_ARG "-DCURL_ZLIB=ON")
+    else()
+        set(ZLIB_ARG "-DCURL_ZLIB=OFF")
+    endif()
+
     ExternalProject_Add(libcurl_project
         PREFIX     "${CMAKE_CURRENT_BINARY_DIR}/third_party/.curl.tmp"
         SOURCE_DIR "${CMAKE_CURRENT_SOURCE_DIR}/third_party/curl"
@@ -40,6 +56,8 @@ macro(build_libcurl)
                    -DBUILD_CURL_EXE=OFF
                    -DBUILD_TESTING=OFF
                    -DENABLE_ARES=ON
+                   ${NGHTTP2_ARG}
+                   ${ZLIB_ARG}
                    -DCMAKE_POSITION_INDEPENDENT_CODE=ON)
 
     add_library(libcurl STATIC IMPORTED)
@@ -49,7 +67,8 @@ macro(build_libcurl)
     find_package(CARES REQUIRED)
 
     # finally, set paths
-    set(CURL_LIBRARIES    libcurl ${CARES_LIBRARY})
+    set(CURL_LIBRARIES    libcurl ${CARES_LIBRARY} ${NGHTTP2_LIBRARIES}
+                          ${ZLIB_LIBRARIES})
     set(CURL_INCLUDE_DIRS "${LIBCURL}/include")
 endmacro()
 
@@ -0,0 +1,46 @@
+# - Find nghttp2
+# Find the nghttp2 includes and library
+# This module defines
+#  NGHTTP2_INCLUDE_DIR, where to find nghttp2/nghttp2.h, etc.
+#  NGHTTP2_LIBRARIES, the libraries needed to use nghttp2.
+#  NGHTTP2_FOUND, If false, do not try to use nghttp2.
+# also defined, but not for general use are
+# NGHTTP2_LIBRARY, where to find the nghttp2 library.
+
+# find_path(NGHTTP2_INCLUDE_DIR nghttp2/nghttp2.h
+#           HINTS ENV )
+
+FIND_PATH(NGHTTP2_INCLUDE_DIR nghttp2/nghttp2.h
+  /usr/local/include
+  /usr/include
+)
+
+SET(NGHTTP2_NAMES ${NGHTTP2_NAMES} nghttp2)
+FIND_LIBRARY(NGHTTP2_LIBRARY
+  NAMES ${NGHTTP2_NAMES}
+  PATHS /usr/lib /usr/local/lib
+)
+
+IF (NGHTTP2_LIBRARY AND NGHTTP2_INCLUDE_DIR)
+  SET(NGHTTP2_LIBRARIES ${NGHTTP2_LIBRARY})
+  SET(NGHTTP2_FOUND "YES")
+ELSE (NGHTTP2_LIBRARY AND NGHTTP2_INCLUDE_DIR)
+  SET(NGHTTP2_FOUND "NO")
+ENDIF (NGHTTP2_LIBRARY AND NGHTTP2_INCLUDE_DIR)
+
+
+IF (NGHTTP2_FOUND)
+  IF (NOT NGHTTP2_FIND_QUIETLY)
+    MESSAGE(STATUS "Found nghttp2: ${NGHTTP2_LIBRARIES}")
+  ENDIF (NOT NGHTTP2_FIND_QUIETLY)
+ELSE (NGHTTP2_FOUND)
+  IF (NGHTTP2_FIND_REQUIRED)
+    MESSAGE(FATAL_ERROR "Could not find nghttp2 library")
+  ENDIF (NGHTTP2_FIND_REQUIRED)
+ENDIF (NGHTTP2_FOUND)
+
+MARK_AS_ADVANCED(
+  NGHTTP2_FOUND
+  NGHTTP2_LIBRARY
+  NGHTTP2_INCLUDE_DIR
+)
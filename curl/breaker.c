@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "breaker.h"
+
+
+static inline
+uint64_t
+now_slot(const breaker_config_t *c, double now)
+{
+    return (uint64_t) (now / (c->window / BREAKER_BUCKETS));
+}
+
+
+static
+breaker_bucket_t*
+current_bucket(breaker_t *b, const breaker_config_t *c, double now)
+{
+    const uint64_t slot = now_slot(c, now);
+    breaker_bucket_t *k = &b->buckets[slot % BREAKER_BUCKETS];
+    if (k->slot != slot) {
+        memset(k, 0, sizeof(breaker_bucket_t));
+        k->slot = slot;
+    }
+    return k;
+}
+
+
+static
+void
+set_state(breaker_t *b, breaker_state_t state, double now)
+{
+    b->state = state;
+    b->probes_running = 0;
+    b->probes_passed = 0;
+
+    switch (state) {
+    case BREAKER_OPEN:
+        b->opened_at = now;
+        ++b->stat.opened;
+        break;
+    case BREAKER_HALF_OPEN:
+        ++b->stat.half_opened;
+        break;
+    case BREAKER_CLOSED:
+        /* The failures before the incident don't count anymore */
+        memset(b->buckets, 0, sizeof(b->buckets));
+        ++b->stat.closed;
+        break;
+    }
+}
+
+
+/** Check the rates of the window, the buckets which are older than the
+ *  window are skipped
+ */
+static
+bool
+window_tripped(const breaker_t *b, const breaker_config_t *c, double now)
+{
+    const uint64_t slot = now_slot(c, now);
+    uint64_t requests = 0, errors = 0, timeouts = 0;
+
+    for (size_t i = 0; i < BREAKER_BUCKETS; ++i) {
+        const breaker_bucket_t *k = &b->buckets[i];
+        if (k->slot + BREAKER_BUCKETS <= slot || k->slot > slot)
+            continue;
+        requests += k->requests;
+        errors += k->errors;
+        timeouts += k->timeouts;
+    }
+
+    if (requests == 0 || requests < c->min_requests)
+        return false;
+
+    return (c->error_rate > 0 &&
+            (double) errors >= c->error_rate * (double) requests) ||
+           (c->timeout_rate > 0 &&
+            (double) timeouts >= c->timeout_rate * (double) requests);
+}
+
+
+bool
+breaker_allow(breaker_t *b, const breaker_config_t *c, double now,
+              bool *probe)
+{
+    assert(b);
+    assert(c);
+
+    *probe = false;
+
+    if (!breaker_enabled(c))
+        return true;
+
+    if (b->state == BREAKER_OPEN && now >= b->opened_at + c->open_time)
+        set_state(b, BREAKER_HALF_OPEN, now);
+
+    switch (b->state) {
+    case BREAKER_CLOSED:
+        return true;
+    case BREAKER_HALF_OPEN:
+        if (b->probes_running < (c->probes > 0 ? c->probes : 1)) {
+            ++b->probes_running;
+            *probe = true;
+            return true;
+        }
+        break;
+    case BREAKER_OPEN:
+        break;
+    }
+
+    ++b->stat.rejected;
+    return false;
+}
+
+
+void
+breaker_report(breaker_t *b, const breaker_config_t *c, bool probe,
+               bool ok, bool timeout, double now)
+{
+    assert(b);
+    assert(c);
+
+    if (!breaker_enabled(c))
+        return;
+
+    if (probe) {
+        if (b->state != BREAKER_HALF_OPEN)
+            return;
+        --b->probes_running;
+        if (!ok)
+            set_state(b, BREAKER_OPEN, now);
+        else if (++b->probes_passed >= (c->probes > 0 ? c->probes : 1))
+            set_state(b, BREAKER_CLOSED, now);
+        return;
+    }
+
+    /* The requests which have been started before the breaker opened
+     * don't change its state */
+    if (b->state != BREAKER_CLOSED)
+        return;
+
+    breaker_bucket_t *k = current_bucket(b, c, now);
+    ++k->requests;
+    if (!ok)
+        ++k->errors;
+    if (timeout)
+        ++k->timeouts;
+
+    if (!ok && window_tripped(b, c, now))
+        set_state(b, BREAKER_OPEN, now);
+}
+
+
+void
+breaker_cancel_probe(breaker_t *b)
+{
+    assert(b);
+
+    if (b->state == BREAKER_HALF_OPEN && b->probes_running > 0)
+        --b->probes_running;
+}
+
+
+bool
+breaker_is_open(const breaker_t *b, const breaker_config_t *c, double now)
+{
+    assert(b);
+    assert(c);
+
+    return breaker_enabled(c) && b->state == BREAKER_OPEN &&
+           now < b->opened_at + c->open_time;
+}
+
+
+const char*
+breaker_state_name(breaker_state_t state)
+{
+    switch (state) {
+    case BREAKER_CLOSED:
+        return "closed";
+    case BREAKER_OPEN:
+        return "open";
+    case BREAKER_HALF_OPEN:
+        return "half_open";
+    }
+    return "unknown";
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef BREAKER_H_INCLUDED
+#define BREAKER_H_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* The sliding window is split into this number of buckets */
+#define BREAKER_BUCKETS 10
+
+typedef enum {
+  /* Requests pass, their results are counted */
+  BREAKER_CLOSED,
+  /* Requests are rejected until open_time has passed */
+  BREAKER_OPEN,
+  /* A few probes pass, the breaker is closed if all of them succeed */
+  BREAKER_HALF_OPEN
+} breaker_state_t;
+
+typedef struct {
+  /* The sliding window, seconds */
+  double window;
+  /* The rates aren't checked until the window has so many requests */
+  size_t min_requests;
+  /* Shares of failed and timed out requests which open the breaker,
+   * 0 - the rate isn't checked */
+  double error_rate;
+  double timeout_rate;
+  /* How long the breaker stays open, seconds */
+  double open_time;
+  /* Max number of running probes in the half-open state */
+  size_t probes;
+} breaker_config_t;
+
+typedef struct {
+  uint64_t slot;
+  uint32_t requests;
+  uint32_t errors;
+  uint32_t timeouts;
+} breaker_bucket_t;
+
+/** A circuit breaker of an upstream, it fails requests at once while the
+ *  upstream is down instead of letting them wait for timeouts
+ */
+typedef struct {
+  /* The config of the upstream, otherwise the default one is used */
+  bool             set;
+  breaker_config_t config;
+
+  breaker_state_t  state;
+  double           opened_at;
+  size_t           probes_running;
+  size_t           probes_passed;
+
+  breaker_bucket_t buckets[BREAKER_BUCKETS];
+
+  struct {
+    uint64_t opened;
+    uint64_t half_opened;
+    uint64_t closed;
+    uint64_t rejected;
+  } stat;
+} breaker_t;
+
+static inline
+bool
+breaker_enabled(const breaker_config_t *c)
+{
+  return c->window > 0 && (c->error_rate > 0 || c->timeout_rate > 0);
+}
+
+/* Whether a request may be sent now, *probe is set if it's a probe of the
+ * half-open state, it has to be reported or cancelled */
+bool breaker_allow(breaker_t *b, const breaker_config_t *c, double now,
+                   bool *probe);
+
+/* Count the result of a request */
+void breaker_report(breaker_t *b, const breaker_config_t *c, bool probe,
+                    bool ok, bool timeout, double now);
+
+/* A probe has been given up without a result */
+void breaker_cancel_probe(breaker_t *b);
+
+/* Requests would be rejected now, the state isn't changed */
+bool breaker_is_open(const breaker_t *b, const breaker_config_t *c,
+                     double now);
+
+const char *breaker_state_name(breaker_state_t state);
+
+#endif /* BREAKER_H_INCLUDED */
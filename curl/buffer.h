@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef BUFFER_H_INCLUDED
+#define BUFFER_H_INCLUDED 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/** A growable memory buffer
+ */
+typedef struct {
+  char   *data;
+  size_t size;
+  size_t capacity;
+} buffer_t;
+
+
+static inline
+void
+buffer_init(buffer_t *b)
+{
+  b->data = NULL;
+  b->size = 0;
+  b->capacity = 0;
+}
+
+static inline
+void
+buffer_free(buffer_t *b)
+{
+  free(b->data);
+  buffer_init(b);
+}
+
+/* Drop the content, memory is kept if it isn't bigger than 'keep' */
+static inline
+void
+buffer_reset(buffer_t *b, size_t keep)
+{
+  if (b->capacity > keep)
+    buffer_free(b);
+  b->size = 0;
+}
+
+/* Make room for at least 'size' more bytes */
+static inline
+bool
+buffer_reserve(buffer_t *b, size_t size)
+{
+  if (b->capacity - b->size >= size)
+    return true;
+
+  size_t capacity = b->capacity > 0 ? b->capacity : 1024;
+  while (capacity - b->size < size)
+    capacity *= 2;
+
+  char *data = (char *) realloc(b->data, capacity);
+  if (data == NULL)
+    return false;
+
+  b->data = data;
+  b->capacity = capacity;
+  return true;
+}
+
+static inline
+bool
+buffer_append(buffer_t *b, const void *data, size_t size)
+{
+  if (!buffer_reserve(b, size))
+    return false;
+  memcpy(b->data + b->size, data, size);
+  b->size += size;
+  return true;
+}
+
+#endif /* BUFFER_H_INCLUDED */
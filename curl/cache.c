@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cache.h"
+#include "headers.h"
+
+#define CACHE_MIN_BUCKETS 64
+
+
+cache_t*
+cache_new(size_t limit)
+{
+    cache_t *c = (cache_t *) calloc(1, sizeof(cache_t));
+    if (c == NULL)
+        return NULL;
+
+    c->buckets = (hash_link_t **)
+            calloc(CACHE_MIN_BUCKETS, sizeof(hash_link_t *));
+    if (c->buckets == NULL) {
+        free(c);
+        return NULL;
+    }
+
+    c->nbuckets = CACHE_MIN_BUCKETS;
+    c->limit = limit;
+
+    return c;
+}
+
+
+void
+cache_delete(cache_t *c)
+{
+    if (c == NULL)
+        return;
+
+    while (c->lru_head != NULL)
+        cache_remove(c, c->lru_head);
+
+    free(c->buckets);
+    free(c);
+}
+
+
+static inline
+void
+lru_unlink(cache_t *c, cache_entry_t *e)
+{
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+
+static inline
+void
+lru_push(cache_t *c, cache_entry_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head != NULL)
+        c->lru_head->lru_prev = e;
+    else
+        c->lru_tail = e;
+    c->lru_head = e;
+}
+
+
+cache_entry_t*
+cache_find(cache_t *c, const char *key, size_t key_size)
+{
+    assert(c);
+
+    const size_t hash = (size_t) fnv1a(key, key_size);
+
+    hash_link_t *l = c->buckets[hash & (c->nbuckets - 1)];
+    for (; l != NULL; l = l->next) {
+        cache_entry_t *e = (cache_entry_t *) l;
+        if (l->hash == hash && e->key_size == key_size &&
+            memcmp(e->key, key, key_size) == 0)
+        {
+            lru_unlink(c, e);
+            lru_push(c, e);
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+
+void
+cache_remove(cache_t *c, cache_entry_t *e)
+{
+    assert(c);
+    assert(e);
+
+    hash_link_remove(c->buckets, c->nbuckets, &e->link);
+
+    lru_unlink(c, e);
+
+    --c->count;
+    c->size -= e->charge;
+
+    free(e);
+}
+
+
+cache_entry_t*
+cache_store(cache_t *c, const char *key, size_t key_size, long http_code,
+            const char *body, size_t body_size,
+            const char *headers, size_t headers_size)
+{
+    assert(c);
+
+    const size_t charge = sizeof(cache_entry_t) + key_size + 1 +
+                          body_size + headers_size;
+    if (charge > c->limit)
+        return NULL;
+
+    cache_entry_t *old = cache_find(c, key, key_size);
+    if (old != NULL)
+        cache_remove(c, old);
+
+    while (c->size + charge > c->limit && c->lru_tail != NULL) {
+        cache_remove(c, c->lru_tail);
+        ++c->stat.evictions;
+    }
+
+    cache_entry_t *e = (cache_entry_t *) malloc(charge);
+    if (e == NULL)
+        return NULL;
+
+    memset(e, 0, sizeof(cache_entry_t));
+
+    e->link.hash = (size_t) fnv1a(key, key_size);
+    e->http_code = http_code;
+    e->charge = charge;
+
+    e->key_size = key_size;
+    memcpy(e->key, key, key_size);
+    e->key[key_size] = '\0';
+
+    char *p = e->key + key_size + 1;
+    if (body_size > 0)
+        memcpy(p, body, body_size);
+    e->body = p;
+    e->body_size = body_size;
+
+    p += body_size;
+    if (headers_size > 0)
+        memcpy(p, headers, headers_size);
+    e->headers = p;
+    e->headers_size = headers_size;
+
+    hash_buckets_grow(&c->buckets, &c->nbuckets, c->count);
+    hash_link_insert(c->buckets, c->nbuckets, &e->link);
+    lru_push(c, e);
+
+    ++c->count;
+    c->size += charge;
+    ++c->stat.stores;
+
+    return e;
+}
+
+
+/** Find "name" or "name=N" directive in the Cache-Control value, -1 if it's
+ *  absent, 0 if it has no value
+ */
+static
+long
+directive(const char *v, size_t size, const char *name)
+{
+    const size_t name_len = strlen(name);
+    const char *end = v + size;
+
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == ','))
+            ++v;
+        const char *token = v;
+        while (v < end && *v != ',')
+            ++v;
+        const size_t token_len = (size_t) (v - token);
+
+        if (token_len < name_len ||
+            strncasecmp(token, name, name_len) != 0)
+            continue;
+
+        const char *rest = token + name_len;
+        if (rest == v || *rest == ' ')
+            return 0;
+        if (*rest != '=')
+            continue;
+
+        long value = 0;
+        for (++rest; rest < v && isdigit((unsigned char) *rest); ++rest)
+            value = value * 10 + (*rest - '0');
+        return value;
+    }
+
+    return -1;
+}
+
+
+bool
+cache_freshness(const char *headers, size_t headers_size, double now,
+                double *expires, double *stale_until)
+{
+    const char *v;
+    size_t size;
+
+    /* Variants aren't told apart by the key */
+    if (headers_find(headers, headers_size, "Vary", &v, &size))
+        return false;
+
+    long max_age = -1, swr = 0;
+    if (headers_find(headers, headers_size, "Cache-Control", &v, &size)) {
+        /* A private response belongs to the user who has asked for it */
+        if (directive(v, size, "no-store") >= 0 ||
+            directive(v, size, "private") >= 0)
+            return false;
+        if (directive(v, size, "no-cache") >= 0)
+            max_age = 0;
+        else
+            max_age = directive(v, size, "max-age");
+        swr = directive(v, size, "stale-while-revalidate");
+        if (swr < 0)
+            swr = 0;
+    }
+
+    if (max_age <= 0 &&
+        !headers_find(headers, headers_size, "ETag", &v, &size) &&
+        !headers_find(headers, headers_size, "Last-Modified", &v, &size))
+        return false;
+
+    if (max_age < 0)
+        max_age = 0;
+
+    *expires = now + (double) max_age;
+    *stale_until = *expires + (double) swr;
+
+    return true;
+}
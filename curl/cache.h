@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "utils.h"
+
+/** An in-memory cache of responses to GET requests, it's keyed by the url.
+ *  The memory is limited, the least recently used entries are evicted.
+ */
+typedef struct cache_entry_s {
+  /* It's the first member, see hash_link_t */
+  hash_link_t          link;
+  struct cache_entry_s *lru_prev;
+  struct cache_entry_s *lru_next;
+
+  /* The entry is fresh until 'expires' and it may be served until
+   * 'stale_until' while it's revalidated */
+  double               expires;
+  double               stale_until;
+  bool                 revalidating;
+
+  long                 http_code;
+  const char           *body;
+  size_t               body_size;
+  /* All the response headers, "Name: value\r\n" lines */
+  const char           *headers;
+  size_t               headers_size;
+  /* Memory which is taken by the entry */
+  size_t               charge;
+  size_t               key_size;
+  char                 key[];
+} cache_entry_t;
+
+typedef struct {
+  hash_link_t   **buckets;
+  size_t        nbuckets;
+  size_t        count;
+
+  /* Bytes which are taken by the entries, and the limit */
+  size_t        size;
+  size_t        limit;
+
+  /* The head is the most recently used */
+  cache_entry_t *lru_head;
+  cache_entry_t *lru_tail;
+
+  struct {
+    uint64_t    hits;
+    uint64_t    stale_hits;
+    uint64_t    misses;
+    uint64_t    revalidations;
+    uint64_t    stores;
+    uint64_t    evictions;
+  } stat;
+} cache_t;
+
+cache_t *cache_new(size_t limit);
+void cache_delete(cache_t *c);
+
+/* Find the entry and mark it as recently used */
+cache_entry_t *cache_find(cache_t *c, const char *key, size_t key_size);
+
+/* Add the entry, it replaces the one with the same key. It returns NULL if
+ * the entry is bigger than the limit or memory is out */
+cache_entry_t *cache_store(cache_t *c, const char *key, size_t key_size,
+                           long http_code,
+                           const char *body, size_t body_size,
+                           const char *headers, size_t headers_size);
+
+void cache_remove(cache_t *c, cache_entry_t *e);
+
+/* Get the freshness of a response from its Cache-Control, it returns false
+ * if the response can't be stored. A response without max-age is stored
+ * if it has a validator, it's revalidated each time */
+bool cache_freshness(const char *headers, size_t headers_size, double now,
+                     double *expires, double *stale_until);
+
+#endif /* CACHE_H_INCLUDED */
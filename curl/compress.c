@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#if defined (HAVE_ZLIB)
+#  include <zlib.h>
+#endif
+
+#include "compress.h"
+
+
+const char*
+compress_encoding(compress_format_t format)
+{
+    switch (format) {
+    case COMPRESS_GZIP:
+        return "gzip";
+    case COMPRESS_DEFLATE:
+        return "deflate";
+    }
+    return NULL;
+}
+
+
+bool
+compress_format_from_str(const char *name, compress_format_t *format)
+{
+    assert(name);
+    assert(format);
+
+    if (strcmp(name, "gzip") == 0)
+        *format = COMPRESS_GZIP;
+    else if (strcmp(name, "deflate") == 0)
+        *format = COMPRESS_DEFLATE;
+    else
+        return false;
+
+    return true;
+}
+
+
+#if defined (HAVE_ZLIB)
+
+bool
+compress_available(void)
+{
+    return true;
+}
+
+
+bool
+compress_body(buffer_t *out, compress_format_t format, const char *data,
+              size_t size)
+{
+    assert(out);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    /* 16 more bits of the window select the gzip wrapper */
+    const int window_bits = format == COMPRESS_GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    /* The bound counts the wrapper too, so one deflate() call is enough */
+    const size_t bound = deflateBound(&z, (uLong) size);
+
+    out->size = 0;
+    if (!buffer_reserve(out, bound)) {
+        deflateEnd(&z);
+        return false;
+    }
+
+    z.next_in   = (Bytef *) data;
+    z.avail_in  = (uInt) size;
+    z.next_out  = (Bytef *) out->data;
+    z.avail_out = (uInt) bound;
+
+    const int rc = deflate(&z, Z_FINISH);
+    out->size = bound - z.avail_out;
+    deflateEnd(&z);
+
+    return rc == Z_STREAM_END;
+}
+
+#else /* HAVE_ZLIB */
+
+bool
+compress_available(void)
+{
+    return false;
+}
+
+
+bool
+compress_body(buffer_t *out __attribute__((unused)),
+              compress_format_t format __attribute__((unused)),
+              const char *data __attribute__((unused)),
+              size_t size __attribute__((unused)))
+{
+    /* zlib isn't found */
+    return false;
+}
+
+#endif /* HAVE_ZLIB */
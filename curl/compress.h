@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef COMPRESS_H_INCLUDED
+#define COMPRESS_H_INCLUDED 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "buffer.h"
+
+/* HAVE_ZLIB is defined by the build when zlib is found */
+
+typedef enum {
+  COMPRESS_GZIP,
+  /* zlib format, it's what HTTP calls "deflate" */
+  COMPRESS_DEFLATE
+} compress_format_t;
+
+/* The value of Content-Encoding, NULL if the name is unknown */
+const char *compress_encoding(compress_format_t format);
+
+/* 'gzip' or 'deflate', false if the name is unknown */
+bool compress_format_from_str(const char *name, compress_format_t *format);
+
+/* Whether compress_body() could work in this build */
+bool compress_available(void);
+
+/* Compress 'data' into 'out' (it's overwritten), false if memory is out or
+ * zlib isn't available */
+bool compress_body(buffer_t *out, compress_format_t format,
+                   const char *data, size_t size);
+
+#endif /* COMPRESS_H_INCLUDED */
@@ -31,27 +31,44 @@
 
 #include "debug.h"
 #include "curl_wrapper.h"
+#include "worker.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 /** Information associated with a specific socket
  */
-typedef struct {
-  CURL          *easy;
+struct sock_s {
   curl_ctx_t    *curl_ctx;
-  struct ev_io  ev;
+
+  /* Fiber which waits for events on the socket */
+  struct fiber  *fiber;
 
   curl_socket_t sockfd;
 
   int           action;
-  long          timeout;
-  int           evset;
-} sock_t;
+  bool          removed;
+
+  /* curl has closed the socket while coio_wait() could still watch it,
+   * the fiber closes it once the wait is over */
+  bool          close_fd;
+
+  /* Sockets are linked into 'socks' */
+  sock_t        *prev;
+  sock_t        *next;
+};
+
+
+/** Sockets of all instances, close_cb() looks for its fd here.
+ *  It's used by TX only, workers poll their sockets themselves
+ */
+static sock_t *socks = NULL;
 
 
 #define is_mcode_good(mcode) is_mcode_good_(__FUNCTION__, (mcode))
-static void timer_cb(EV_P_ struct ev_timer *w, int revents);
 
 
 static inline
@@ -115,281 +132,1540 @@ multi_timer_cb(CURLM *multi __attribute__((unused)),
 
     curl_ctx_t *l = (curl_ctx_t *) ctx;
 
-    ev_timer_stop(l->loop, &l->timer_event);
-    if (timeout_ms > 0) {
-        ev_timer_init(&l->timer_event, timer_cb,
-                      (double) (timeout_ms / 1000), 0.);
-        ev_timer_start(l->loop, &l->timer_event);
-    }
-    else if (timeout_ms == 0) {
-        ev_set_cb(&l->timer_event, timer_cb);
-	ev_feed_event(l->loop, &l->timer_event, 0);
-    }
+    /* timer_f() re-arms itself, it must not be called from here,
+     * since curl_multi_socket_action() isn't reentrant */
+    l->timeout_ms = timeout_ms;
+    fiber_cond_signal(l->timer_cond);
 
     return 0;
 }
 
 
-/** Check for completed transfers, and remove their easy handles
+/** Get the time of a phase of a finished transfer in microseconds
  */
+static inline
+uint64_t
+get_phase_time(CURL *easy, CURLINFO info)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t us = 0;
+    curl_easy_getinfo(easy, info, &us);
+    return us > 0 ? (uint64_t) us : 0;
+#else
+    double s = 0;
+    curl_easy_getinfo(easy, info, &s);
+    return s > 0 ? (uint64_t) (s * 1000000) : 0;
+#endif
+}
+
+
 static
 void
-check_multi_info(curl_ctx_t *l)
+add_timings(curl_ctx_t *l, CURL *easy)
 {
-    char       *eff_url;
-    CURLMsg    *msg;
-    int        msgs_left;
-    request_t  *r;
-    long       http_code;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    histogram_add(&l->stat.timing.namelookup,
+                  get_phase_time(easy, CURLINFO_NAMELOOKUP_TIME_T));
+    histogram_add(&l->stat.timing.connect,
+                  get_phase_time(easy, CURLINFO_CONNECT_TIME_T));
+    histogram_add(&l->stat.timing.appconnect,
+                  get_phase_time(easy, CURLINFO_APPCONNECT_TIME_T));
+    histogram_add(&l->stat.timing.starttransfer,
+                  get_phase_time(easy, CURLINFO_STARTTRANSFER_TIME_T));
+    histogram_add(&l->stat.timing.total,
+                  get_phase_time(easy, CURLINFO_TOTAL_TIME_T));
+#else
+    histogram_add(&l->stat.timing.namelookup,
+                  get_phase_time(easy, CURLINFO_NAMELOOKUP_TIME));
+    histogram_add(&l->stat.timing.connect,
+                  get_phase_time(easy, CURLINFO_CONNECT_TIME));
+    histogram_add(&l->stat.timing.appconnect,
+                  get_phase_time(easy, CURLINFO_APPCONNECT_TIME));
+    histogram_add(&l->stat.timing.starttransfer,
+                  get_phase_time(easy, CURLINFO_STARTTRANSFER_TIME));
+    histogram_add(&l->stat.timing.total,
+                  get_phase_time(easy, CURLINFO_TOTAL_TIME));
+#endif
+}
 
-    dd("REMAINING: still_running = %d", l->still_running);
 
-    while ((msg = curl_multi_info_read(l->multi, &msgs_left))) {
+static
+void
+add_host_stat(host_stat_t *h, CURL *easy, CURLcode curl_code)
+{
+    if (curl_code != CURLE_OK) {
+        ++h->errors;
+        return;
+    }
 
-        if (msg->msg != CURLMSG_DONE)
-            continue;
+    long num_connects = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &num_connects);
+    if (num_connects > 0)
+        ++h->connections_new;
+    else
+        ++h->connections_reused;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t in = 0, out = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &in);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &out);
+#else
+    double in = 0, out = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD, &in);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD, &out);
+#endif
+    h->bytes_in += in > 0 ? (uint64_t) in : 0;
+    h->bytes_out += out > 0 ? (uint64_t) out : 0;
+
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    const uint64_t total = get_phase_time(easy, CURLINFO_TOTAL_TIME_T);
+#else
+    const uint64_t total = get_phase_time(easy, CURLINFO_TOTAL_TIME);
+#endif
+    histogram_add(&h->latency, total);
+
+    if (h->recent_latency.count >= HOST_STAT_RECENT_REQUESTS)
+        histogram_decay(&h->recent_latency);
+    histogram_add(&h->recent_latency, total);
+}
 
-        CURL     *easy     = msg->easy_handle;
-        CURLcode curl_code = msg->data.result;
 
-        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (void *) &r);
-        curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &eff_url);
-        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &http_code);
+void
+request_flight_done(request_t *r, CURLcode curl_code, long http_code)
+{
+    flight_t *f = r->flight;
+    if (f == NULL)
+        return;
+    r->flight = NULL;
+
+    f->http_code = http_code;
+    f->attempts  = r->retry.enabled ? r->retry.attempt : 0;
+
+    /* The leader's reference is the only one if nobody has joined, the
+     * response isn't copied then */
+    if (curl_code == CURLE_OK && f->refs > 1) {
+        f->has_headers = r->capture_headers;
+        if (!buffer_append(&f->body, r->response.data, r->response.size) ||
+            (f->has_headers &&
+             !buffer_append(&f->headers, r->response_headers.data,
+                            r->response_headers.size)))
+            curl_code = CURLE_OUT_OF_MEMORY;
+    }
 
-        dd("DONE: url = %s, curl_code = %d, http_code = %d",
-                eff_url, curl_code, (int) http_code);
+    flight_done(&r->curl_ctx->flights, f, curl_code);
+}
 
-        if (curl_code != CURLE_OK)
-            ++l->stat.failed_requests;
 
-        if (http_code == 200)
-            ++l->stat.http_200_responses;
-        else
-            ++l->stat.http_other_responses;
-
-        if (r->lua_ctx.done_fn != LUA_REFNIL) {
-            /*
-              Signature:
-                function (curl_code, http_code, error_message, ctx)
-            */
-            lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.done_fn);
-            lua_pushinteger(r->lua_ctx.L, (int) curl_code);
-            lua_pushinteger(r->lua_ctx.L, (int) http_code);
-            lua_pushstring(r->lua_ctx.L, curl_easy_strerror(curl_code));
-            lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
-            lua_pcall(r->lua_ctx.L, 4, 0 ,0);
+/** Pass the result to the waiter or to the 'done' callback
+ */
+static
+void
+request_deliver(curl_ctx_t *l, request_t *r, CURLcode curl_code,
+                long http_code)
+{
+    request_flight_done(r, curl_code, http_code);
+
+    if (r->sync.fiber != NULL || r->sync.batch != NULL) {
+        r->sync.done      = true;
+        r->sync.curl_code = curl_code;
+        r->sync.http_code = http_code;
+        if (r->sync.batch != NULL) {
+            r->sync.next = r->sync.batch->done;
+            r->sync.batch->done = r;
+            fiber_cond_broadcast(r->sync.batch->cond);
+        } else
+            fiber_wakeup(r->sync.fiber);
+        return;
+    }
+
+    if (r->lua_ctx.done_fn != LUA_REFNIL) {
+        /*
+          Signature:
+            function (curl_code, http_code, error_message, ctx
+                      [, body [, headers]])
+
+          The body is passed if the request has buffer_response, the
+          headers are passed if the request has response_headers
+        */
+        int nargs = 4;
+        lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.done_fn);
+        lua_pushinteger(r->lua_ctx.L, (int) curl_code);
+        lua_pushinteger(r->lua_ctx.L, (int) http_code);
+        lua_pushstring(r->lua_ctx.L, curl_easy_strerror(curl_code));
+        lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
+        if (r->buffer_response || r->capture_headers) {
+            if (r->buffer_response)
+                lua_pushlstring(r->lua_ctx.L, r->response.data,
+                                r->response.size);
+            else
+                lua_pushnil(r->lua_ctx.L);
+            ++nargs;
+        }
+        if (r->capture_headers) {
+            headers_push(r->lua_ctx.L, r->response_headers.data,
+                         r->response_headers.size);
+            ++nargs;
         }
+        lua_pcall(r->lua_ctx.L, nargs, 0 ,0);
+    }
 
-        free_request(l, r);
-    } /* while */
+    free_request(l, r);
 }
 
 
-/** Called by libevent when we get action on a multi socket
+/** Response cache {{{
  */
+
+/* Append the header lines to 'dst', the allow-list is applied */
 static
 void
-event_cb(EV_P_ struct ev_io *w, int revents)
+copy_headers(buffer_t *dst, const buffer_t *allow,
+             const char *data, size_t size)
 {
-    (void) loop;
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t) (end - p));
+        const char *next = eol != NULL ? eol + 1 : end;
+        headers_add_line(dst, allow, p, (size_t) (next - p));
+        p = next;
+    }
+}
 
-    dd("w = %p, revents = %d", (void *) w, revents);
 
-    curl_ctx_t *l = (curl_ctx_t*) w->data;
+/* Put the cached response into the request, the response which has come
+ * (a 304) is replaced */
+static
+bool
+set_cached_response(request_t *r, const cache_entry_t *e)
+{
+    r->response.size = 0;
+    if (!buffer_append(&r->response, e->body, e->body_size))
+        return false;
 
-    const int action = ( (revents & EV_READ ? CURL_POLL_IN : 0) |
-                         (revents & EV_WRITE ? CURL_POLL_OUT : 0) );
-    CURLMcode rc = curl_multi_socket_action(l->multi,
-                                            w->fd, action, &l->still_running);
-    if (!is_mcode_good(rc))
-        ++l->stat.failed_requests;
+    if (r->capture_headers) {
+        r->response_headers.size = 0;
+        copy_headers(&r->response_headers, &r->headers_allow,
+                     e->headers, e->headers_size);
+    }
 
-    check_multi_info(l);
+    return true;
+}
 
-    if (l->still_running <= 0) {
-        dd("last transfer done, kill timeout");
-        ev_timer_stop(l->loop, &l->timer_event);
+
+/* Add If-None-Match/If-Modified-Since of the cached response */
+static
+bool
+add_validators(request_t *r, const cache_entry_t *e)
+{
+    const char *v;
+    size_t size;
+    char header[1024];
+    bool added = false;
+
+    if (headers_find(e->headers, e->headers_size, "ETag", &v, &size) &&
+        size < sizeof(header) - 32)
+    {
+        snprintf(header, sizeof(header), "If-None-Match: %.*s",
+                 (int) size, v);
+        added = request_add_header(r, header);
+    }
+
+    if (headers_find(e->headers, e->headers_size, "Last-Modified", &v,
+                     &size) &&
+        size < sizeof(header) - 32)
+    {
+        snprintf(header, sizeof(header), "If-Modified-Since: %.*s",
+                 (int) size, v);
+        added = request_add_header(r, header) || added;
+    }
+
+    return added;
+}
+
+
+/* Revalidate the stale response by a request of its own, the request is
+ * freed when it's done */
+static
+bool
+revalidate_in_background(request_t *r, const cache_entry_t *e,
+                         const request_start_args_t *a)
+{
+    curl_ctx_t *l = r->curl_ctx;
+
+    request_t *bg = new_request(l);
+    if (bg == NULL)
+        return false;
+
+    for (struct curl_slist *h = r->headers; h != NULL; h = h->next) {
+        if (!request_add_header(bg, h->data))
+            goto error_exit;
+    }
+
+    if (!add_validators(bg, e) ||
+        !buffer_append(&bg->cache.key, e->key, e->key_size))
+        goto error_exit;
+
+    bg->buffer_response  = true;
+    bg->cache.enabled    = true;
+    bg->cache.revalidate = true;
+
+    if (request_start(bg, a) != CURLM_OK)
+        goto error_exit;
+
+    return true;
+
+error_exit:
+    free_request(l, bg);
+    return false;
+}
+
+
+/* Request headers which select a representation of the response, they are
+ * a part of the cache key */
+static const char *const cache_key_headers[] = {
+    "Accept", "Accept-Encoding", "Accept-Language", NULL
+};
+
+
+static inline
+bool
+is_header(const char *line, const char *name)
+{
+    const size_t size = strlen(name);
+    return strncasecmp(line, name, size) == 0 && line[size] == ':';
+}
+
+
+/** Append the representation headers to the key in a fixed order, false if
+ *  the request carries credentials, its response is the caller's own
+ */
+static
+bool
+add_key_headers(request_t *r)
+{
+    for (struct curl_slist *h = r->headers; h != NULL; h = h->next) {
+        if (is_header(h->data, "Authorization") ||
+            is_header(h->data, "Cookie"))
+            return false;
+    }
+
+    for (size_t i = 0; cache_key_headers[i] != NULL; ++i) {
+        for (struct curl_slist *h = r->headers; h != NULL; h = h->next) {
+            if (!is_header(h->data, cache_key_headers[i]))
+                continue;
+            if (!buffer_append(&r->cache.key, "\n", 1) ||
+                !buffer_append(&r->cache.key, h->data, strlen(h->data)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool
+request_from_cache(request_t *r, const request_start_args_t *a)
+{
+    curl_ctx_t *l = r->curl_ctx;
+
+    /* Only whole responses to GET without a body are cached */
+    if (l->cache == NULL || !r->cache.enabled || a->url == NULL ||
+        !r->buffer_response || r->stream.limit > 0)
+    {
+        r->cache.enabled = false;
+        return false;
+    }
+
+    if (!buffer_append(&r->cache.key, a->url, strlen(a->url)) ||
+        !add_key_headers(r))
+    {
+        r->cache.enabled = false;
+        return false;
+    }
+
+    cache_entry_t *e = cache_find(l->cache, r->cache.key.data,
+                                  r->cache.key.size);
+    if (e == NULL) {
+        ++l->cache->stat.misses;
+        return false;
+    }
+
+    const double now = fiber_time();
+
+    if (now < e->expires) {
+        if (!set_cached_response(r, e))
+            return false;
+        ++l->cache->stat.hits;
+        request_deliver(l, r, CURLE_OK, e->http_code);
+        return true;
     }
+
+    if (now < e->stale_until) {
+        if (!e->revalidating)
+            e->revalidating = revalidate_in_background(r, e, a);
+        if (!set_cached_response(r, e))
+            return false;
+        ++l->cache->stat.stale_hits;
+        request_deliver(l, r, CURLE_OK, e->http_code);
+        return true;
+    }
+
+    /* A 304 is served from the cache */
+    ++l->cache->stat.misses;
+    r->cache.revalidate = add_validators(r, e);
+
+    return false;
+}
+
+
+static inline
+bool
+is_validator(const char *line)
+{
+    return is_header(line, "If-None-Match") ||
+           is_header(line, "If-Modified-Since");
 }
 
 
-/** Called by libevent when our timeout expires
+/** The entry has been evicted while it was revalidated, the caller hasn't
+ *  sent the validators and mustn't get the 304, so the request is sent
+ *  again without them
  */
 static
+bool
+cache_reissue(curl_ctx_t *l, request_t *r, CURLcode *curl_code,
+              long http_code)
+{
+    if (*curl_code != CURLE_OK || http_code != 304 || !r->cache.revalidate ||
+        cache_find(l->cache, r->cache.key.data, r->cache.key.size) != NULL)
+        return false;
+
+    struct curl_slist *headers = NULL;
+    for (struct curl_slist *h = r->headers; h != NULL; h = h->next) {
+        if (is_validator(h->data))
+            continue;
+        struct curl_slist *t = curl_slist_append(headers, h->data);
+        if (t == NULL) {
+            /* The bare 304 isn't delivered */
+            curl_slist_free_all(headers);
+            *curl_code = CURLE_OUT_OF_MEMORY;
+            return false;
+        }
+        headers = t;
+    }
+
+    curl_slist_free_all(r->headers);
+    r->headers = headers;
+    curl_easy_setopt(r->easy, CURLOPT_HTTPHEADER, r->headers);
+    r->cache.revalidate = false;
+
+    request_reissue(l, r, 0);
+
+    return true;
+}
+
+
+/* Store a cacheable response, or serve a 304 of a revalidation from the
+ * cache */
+static
 void
-timer_cb(EV_P_ struct ev_timer *w, int revents __attribute__((unused)))
+cache_update(curl_ctx_t *l, request_t *r, CURLcode curl_code,
+             long *http_code)
 {
-    (void) loop;
+    cache_t *c = l->cache;
 
-    dd("w = %p, revents = %i", (void *) w, revents);
+    cache_entry_t *e = cache_find(c, r->cache.key.data, r->cache.key.size);
+    if (e != NULL && r->cache.revalidate)
+        e->revalidating = false;
 
-    curl_ctx_t *l = (curl_ctx_t *) w->data;
-    CURLMcode rc = curl_multi_socket_action(l->multi, CURL_SOCKET_TIMEOUT, 0,
-                                            &l->still_running);
-    if (!is_mcode_good(rc))
-        ++l->stat.failed_requests;
+    if (curl_code != CURLE_OK)
+        return;
 
-    check_multi_info(l);
+    const double now = fiber_time();
+    double expires, stale_until;
+
+    if (*http_code == 304 && r->cache.revalidate && e != NULL) {
+        ++c->stat.revalidations;
+        /* The 304 has the new freshness, otherwise it's revalidated
+         * next time again */
+        if (cache_freshness(r->cache.headers.data, r->cache.headers.size,
+                            now, &expires, &stale_until))
+        {
+            e->expires = expires;
+            e->stale_until = stale_until;
+        }
+        if (set_cached_response(r, e))
+            *http_code = e->http_code;
+        return;
+    }
+
+    if (*http_code != 200)
+        return;
+
+    if (cache_freshness(r->cache.headers.data, r->cache.headers.size, now,
+                        &expires, &stale_until))
+    {
+        e = cache_store(c, r->cache.key.data, r->cache.key.size, *http_code,
+                        r->response.data, r->response.size,
+                        r->cache.headers.data, r->cache.headers.size);
+        if (e != NULL) {
+            e->expires = expires;
+            e->stale_until = stale_until;
+        }
+    } else if (e != NULL)
+        cache_remove(c, e);
 }
+/* }}} */
+
 
-/** Clean up the sock_t structure
+/** Retries {{{
  */
+
+/* Wake up limiter_f(), it may be running the callbacks */
 static inline
 void
-remsock(sock_t *f, curl_ctx_t *l)
+limiter_signal(curl_ctx_t *l)
 {
-    dd("removing socket");
+    l->limiter.signaled = true;
+    fiber_cond_signal(l->limiter.cond);
+}
 
-    if (f == NULL)
+
+static inline
+uint64_t
+next_random(curl_ctx_t *l)
+{
+    uint64_t x = l->retry_budget.seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    l->retry_budget.seed = x;
+    return x;
+}
+
+
+/* The result is retryable and the request could be sent again */
+static
+bool
+retry_wanted(const request_t *r, CURLcode curl_code, long http_code)
+{
+    if (!r->retry.enabled || r->retry.attempt >= r->retry.max_attempts)
+        return false;
+
+    /* The response has been passed to Lua, or the body can't be sent
+     * again */
+    if (!r->buffer_response || r->stream.limit > 0 ||
+        r->body_stream.limit > 0 ||
+        (r->upload.data == NULL && r->lua_ctx.read_fn != LUA_REFNIL))
+        return false;
+
+    if (curl_code != CURLE_OK) {
+        const unsigned c = (unsigned) curl_code;
+        return c < 128 && ((r->retry.curl_codes[c / 64] >> (c % 64)) & 1);
+    }
+
+    for (size_t i = 0; i < r->retry.nstatuses; ++i) {
+        if (r->retry.statuses[i] == http_code)
+            return true;
+    }
+
+    return false;
+}
+
+
+/* Schedule the request again if its result is retryable, false if the
+ * result has to be delivered */
+static
+bool
+request_retry(curl_ctx_t *l, request_t *r, CURLcode curl_code,
+              long http_code)
+{
+    if (!retry_wanted(r, curl_code, http_code))
+        return false;
+
+    /* Full jitter: a random delay up to the exponential backoff */
+    const int shift = r->retry.attempt - 1 < 30 ? r->retry.attempt - 1 : 30;
+    double delay = r->retry.base_delay * (double) (1u << shift);
+    if (delay > r->retry.max_delay)
+        delay = r->retry.max_delay;
+    delay *= (double) (next_random(l) >> 11) / 9007199254740992.0;
+
+    if (r->retry.use_after && r->retry.has_after) {
+        /* The server wants more than the request could wait */
+        if (r->retry.after > r->retry.max_delay)
+            return false;
+        if (r->retry.after > delay)
+            delay = r->retry.after;
+    }
+
+    if (l->retry_budget.ratio > 0) {
+        if (l->retry_budget.tokens < 1) {
+            ++l->stat.retries_throttled;
+            return false;
+        }
+        l->retry_budget.tokens -= 1;
+    }
+
+    ++l->stat.retries;
+    ++r->retry.attempt;
+
+    request_reissue(l, r, delay);
+
+    return true;
+}
+
+
+void
+request_reissue(curl_ctx_t *l, request_t *r, double delay)
+{
+    if (l->workers == NULL)
+        curl_multi_remove_handle(l->multi, r->easy);
+
+    /* The next attempt starts from scratch */
+    r->response.size = 0;
+    r->response_headers.size = 0;
+    r->cache.headers.size = 0;
+    r->upload.offset = 0;
+    r->retry.has_after = false;
+
+    /* limiter_f() starts it again */
+    r->retry.at = fiber_clock() + delay;
+    request_t **p = &l->limiter.retries;
+    while (*p != NULL && (*p)->retry.at <= r->retry.at)
+        p = &(*p)->retry.next;
+    r->retry.next = *p;
+    *p = r;
+    r->retry.scheduled = true;
+
+    limiter_signal(l);
+}
+
+
+/* Take Retry-After of the response, it's seconds or an HTTP date */
+static
+void
+retry_header(request_t *r, const char *line, size_t size)
+{
+    static const char name[] = "retry-after:";
+    const size_t name_size = sizeof(name) - 1;
+
+    /* A status line starts a new response */
+    if (size >= 5 && memcmp(line, "HTTP/", 5) == 0) {
+        r->retry.has_after = false;
         return;
+    }
 
-    if (f->evset)
-        ev_io_stop(l->loop, &f->ev);
+    if (size <= name_size || strncasecmp(line, name, name_size) != 0)
+        return;
 
-    ++l->stat.sockets_deleted;
+    char value[64];
+    size_t n = 0;
+    for (size_t i = name_size; i < size && n < sizeof(value) - 1; ++i) {
+        if (line[i] == '\r' || line[i] == '\n')
+            break;
+        if (n == 0 && (line[i] == ' ' || line[i] == '\t'))
+            continue;
+        value[n++] = line[i];
+    }
+    value[n] = 0;
 
-    free(f);
+    if (n == 0)
+        return;
+
+    if (value[0] >= '0' && value[0] <= '9') {
+        r->retry.after = strtod(value, NULL);
+        r->retry.has_after = true;
+        return;
+    }
+
+    const time_t t = curl_getdate(value, NULL);
+    if (t > 0) {
+        const double after = difftime(t, time(NULL));
+        r->retry.after = after > 0 ? after : 0;
+        r->retry.has_after = true;
+    }
 }
+/* }}} */
 
 
-/** Assign information to a sock_t structure
+/** Circuit breakers {{{
  */
 static inline
-void
-setsock(sock_t *f,
-        curl_socket_t s,
-        CURL *e,
-        int act,
-        curl_ctx_t *l)
+const breaker_config_t*
+host_breaker(curl_ctx_t *l, host_stat_t *h)
 {
-    dd("set new socket");
+    return h->breaker.set ? &h->breaker.config : &l->breaker;
+}
+
+
+bool
+curl_set_breaker(curl_ctx_t *l, const char *url,
+                 const breaker_config_t *config)
+{
+    assert(l);
+    assert(config);
+
+    host_stat_t *h = host_stat_get(&l->hosts, url);
+    if (h == NULL)
+        return false;
+
+    h->breaker.set = true;
+    h->breaker.config = *config;
 
-    const int kind = ( (act & CURL_POLL_IN ? EV_READ : 0) |
-                       (act & CURL_POLL_OUT ? EV_WRITE : 0) );
+    return true;
+}
 
-    f->sockfd  = s;
-    f->action  = act;
-    f->easy    = e;
-    f->ev.data = l;
-    f->evset   = 1;
 
-    if (f->evset)
-        ev_io_stop(l->loop, &f->ev);
+bool
+request_breaker_allow(request_t *r, const char *url)
+{
+    assert(r);
+    assert(url);
+
+    curl_ctx_t *l = r->curl_ctx;
+
+    /* Memory is out, the request will find it out itself */
+    host_stat_t *h = host_stat_get(&l->hosts, url);
+    if (h == NULL)
+        return true;
+
+    bool probe;
+    if (breaker_allow(&h->breaker, host_breaker(l, h), fiber_clock(),
+                      &probe))
+    {
+        r->breaker_probe = probe ? h : NULL;
+        return true;
+    }
+
+    ++l->stat.breaker_rejections;
+    return false;
+}
+
+
+/** 5xx responses and errors of curl are failures, a timeout is counted by
+ *  the timeout rate too
+ */
+static
+void
+breaker_request_done(request_t *r, CURLcode curl_code, long http_code)
+{
+    host_stat_t *h = r->host;
+
+    const bool ok = curl_code == CURLE_OK && http_code < 500;
+    const bool timeout = curl_code == CURLE_OPERATION_TIMEDOUT;
+
+    breaker_report(&h->breaker, host_breaker(r->curl_ctx, h),
+                   r->breaker_probe == h, ok, timeout, fiber_clock());
+    r->breaker_probe = NULL;
+}
+/* }}} */
+
+
+/** Upstream groups {{{
+ */
+bool
+curl_add_upstream(curl_ctx_t *l, upstream_t *u)
+{
+    assert(l);
+    assert(u);
+
+    /* Least requests uses the active requests of the peers' hosts */
+    for (size_t i = 0; i < u->npeers; ++i) {
+        u->peers[i].host = host_stat_get(&l->hosts, u->peers[i].url);
+        if (u->peers[i].host == NULL)
+            return false;
+    }
+
+    u->breaker = &l->breaker;
+    u->next = l->upstreams;
+    l->upstreams = u;
+
+    return true;
+}
+
+
+const char*
+request_set_upstream(request_t *r, upstream_t *u, const char *path,
+                     const char *key, size_t key_size)
+{
+    assert(r);
+    assert(u);
+    assert(path);
+
+    if (key == NULL) {
+        key = path;
+        key_size = strlen(path);
+    }
+
+    upstream_peer_t *p = upstream_pick(u, key, key_size, fiber_clock());
+
+    buffer_t *b = &r->upstream.url;
+    b->size = 0;
+    if (!buffer_append(b, p->url, p->url_size) ||
+        !buffer_append(b, path, strlen(path) + 1))
+        return NULL;
+
+    r->upstream.group = u;
+    r->upstream.peer  = p;
+
+    return b->data;
+}
+
+
+/** Passive health checking, a peer is ejected after max_errors failed or
+ *  slow requests in a row
+ */
+static
+void
+upstream_request_done(request_t *r, CURLcode curl_code, long http_code)
+{
+    upstream_t *u = r->upstream.group;
+
+    bool ok = curl_code == CURLE_OK && http_code < 500;
+    if (ok && u->max_latency > 0) {
+        double total = 0;
+        curl_easy_getinfo(r->easy, CURLINFO_TOTAL_TIME, &total);
+        ok = total <= u->max_latency;
+    }
+
+    upstream_report(u, r->upstream.peer, ok, fiber_clock());
+}
+/* }}} */
+
+
+void
+curl_request_done(curl_ctx_t *l, request_t *r, CURLcode curl_code)
+{
+    char       *eff_url;
+    long       http_code;
+
+    curl_easy_getinfo(r->easy, CURLINFO_EFFECTIVE_URL, &eff_url);
+    curl_easy_getinfo(r->easy, CURLINFO_RESPONSE_CODE, &http_code);
+
+    dd("DONE: url = %s, curl_code = %d, http_code = %d",
+            eff_url, curl_code, (int) http_code);
+
+    if (r->host != NULL)
+        breaker_request_done(r, curl_code, http_code);
+
+    request_limiter_release(r);
+
+    if (curl_code != CURLE_OK)
+        ++l->stat.failed_requests;
+
+    if (http_code == 200)
+        ++l->stat.http_200_responses;
+    else
+        ++l->stat.http_other_responses;
+
+    if (curl_code == CURLE_OK)
+        add_timings(l, r->easy);
+
+    if (r->host != NULL)
+        add_host_stat(r->host, r->easy, curl_code);
+
+    if (l->share != NULL && curl_code == CURLE_OK) {
+        long num_connects = 0;
+        curl_easy_getinfo(r->easy, CURLINFO_NUM_CONNECTS, &num_connects);
+        if (num_connects > 0)
+            ++l->share->stat.connections_new;
+        else
+            ++l->share->stat.connections_reused;
+    }
+
+    if (r->upstream.peer != NULL)
+        upstream_request_done(r, curl_code, http_code);
+
+    /* limiter_f() starts it again */
+    if (request_retry(l, r, curl_code, http_code))
+        return;
+
+    if (r->cache.enabled && l->cache != NULL) {
+        /* limiter_f() starts it again without validators */
+        if (cache_reissue(l, r, &curl_code, http_code))
+            return;
+        cache_update(l, r, curl_code, &http_code);
+    }
+
+    request_deliver(l, r, curl_code, http_code);
+}
+
+
+/** Check for completed transfers, and remove their easy handles
+ */
+static
+void
+check_multi_info(curl_ctx_t *l)
+{
+    CURLMsg    *msg;
+    int        msgs_left;
+    request_t  *r;
+
+    dd("REMAINING: still_running = %d", l->still_running);
+
+    while ((msg = curl_multi_info_read(l->multi, &msgs_left))) {
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (void *) &r);
+
+        curl_request_done(l, r, msg->data.result);
+    } /* while */
+}
+
+
+/** Tell curl about an action on a socket or a timeout, then
+ *  dispatch all completed transfers
+ */
+static
+void
+socket_action(curl_ctx_t *l, curl_socket_t s, int action)
+{
+    ++l->stat.loop_calls;
+
+    CURLMcode rc = curl_multi_socket_action(l->multi, s, action,
+                                            &l->still_running);
+    if (!is_mcode_good(rc))
+        ++l->stat.failed_requests;
+
+    check_multi_info(l);
+
+    if (l->still_running <= 0) {
+        dd("last transfer done, kill timeout");
+        l->timeout_ms = -1;
+    }
+}
+
+
+/** The socket's fiber, it sleeps in Tarantool's event loop until
+ *  the socket becomes ready or curl changes the action
+ */
+static
+int
+sock_f(va_list ap)
+{
+    sock_t     *f = va_arg(ap, sock_t *);
+    curl_ctx_t *l = f->curl_ctx;
+
+    while (!f->removed) {
+
+        const int events = ( (f->action & CURL_POLL_IN ? COIO_READ : 0) |
+                             (f->action & CURL_POLL_OUT ? COIO_WRITE : 0) );
+        if (events == 0) {
+            /* Nothing to wait for, sock_cb() will wake us up */
+            fiber_yield();
+            continue;
+        }
+
+        const int revents = coio_wait(f->sockfd, events, TIMEOUT_INFINITY);
+
+        dd("f = %p, revents = %d", (void *) f, revents);
+
+        /* sock_cb() has woken us up, the socket has been removed or
+         * the action has been changed */
+        if (f->removed || revents == 0)
+            continue;
+
+        socket_action(l, f->sockfd,
+                      (revents & COIO_READ ? CURL_POLL_IN : 0) |
+                      (revents & COIO_WRITE ? CURL_POLL_OUT : 0));
+    }
+
+    if (f->prev != NULL)
+        f->prev->next = f->next;
+    else
+        socks = f->next;
+    if (f->next != NULL)
+        f->next->prev = f->prev;
+
+    --l->socks;
+    ++l->stat.sockets_deleted;
+
+    /* The fd number can't be reused while another fiber still waits
+     * on it, the last one closes it */
+    if (f->close_fd) {
+        sock_t *o = socks;
+        while (o != NULL && !(o->close_fd && o->sockfd == f->sockfd))
+            o = o->next;
+        if (o == NULL)
+            close(f->sockfd);
+    }
+
+    free(f);
+
+    return 0;
+}
+
+
+/** The timer's fiber, it fires curl's timeouts
+ */
+static
+int
+timer_f(va_list ap)
+{
+    curl_ctx_t *l = va_arg(ap, curl_ctx_t *);
+
+    while (!l->done) {
+
+        if (l->timeout_ms < 0) {
+            fiber_cond_wait(l->timer_cond);
+            continue;
+        }
+
+        /* multi_timer_cb() has changed the timeout */
+        if (l->timeout_ms > 0 &&
+            fiber_cond_wait_timeout(l->timer_cond,
+                                    (double) l->timeout_ms / 1000.) == 0)
+            continue;
+
+        if (l->done)
+            break;
+
+        l->timeout_ms = -1;
+
+        socket_action(l, CURL_SOCKET_TIMEOUT, 0);
+    }
+
+    return 0;
+}
+
+
+/** Mark the sock_t as removed, the socket's fiber frees it
+ */
+static inline
+void
+remsock(sock_t *f)
+{
+    dd("removing socket");
+
+    if (f == NULL)
+        return;
+
+    f->removed = true;
+
+    if (f->fiber != fiber_self())
+        fiber_wakeup(f->fiber);
+}
+
+
+/** Assign a new action to a sock_t structure
+ */
+static inline
+void
+setsock(sock_t *f,
+        curl_socket_t s,
+        int act)
+{
+    dd("set new socket");
+
+    f->sockfd = s;
+    f->action = act;
+
+    if (f->fiber != fiber_self())
+        fiber_wakeup(f->fiber);
+}
+
+
+/** Initialize a new sock_t structure
+ */
+static
+bool
+addsock(curl_socket_t s, int action, curl_ctx_t *l)
+{
+    sock_t *fdp = (sock_t *) malloc(sizeof(sock_t));
+    if (fdp == NULL)
+        return false;
+
+    memset(fdp, 0, sizeof(sock_t));
+
+    fdp->curl_ctx = l;
+    fdp->sockfd   = s;
+    fdp->action   = action;
+
+    fdp->fiber = fiber_new("__curl_sock_fiber", sock_f);
+    if (fdp->fiber == NULL) {
+        free(fdp);
+        return false;
+    }
+
+    fdp->next = socks;
+    if (socks != NULL)
+        socks->prev = fdp;
+    socks = fdp;
+    ++l->socks;
+
+    curl_multi_assign(l->multi, s, fdp);
+
+    ++fdp->curl_ctx->stat.sockets_added;
+
+    /* The fiber runs until the first coio_wait() */
+    fiber_start(fdp->fiber, fdp);
+
+    return true;
+}
+
+
+/* CURLMOPT_SOCKETFUNCTION */
+static
+int
+sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
+{
+    curl_ctx_t *l = (curl_ctx_t*) cbp;
+    sock_t    *fdp = (sock_t*) sockp;
+
+#if defined(MY_DEBUG)
+    static const char *whatstr[] = {
+        "none", "IN", "OUT", "INOUT", "REMOVE" };
+#endif /* MY_DEBUG */
+
+    dd("e = %p, s = %i, what = %s, cbp = %p, sockp = %p",
+            e, s, whatstr[what], cbp, sockp);
+
+    (void) e;
+
+    if (what == CURL_POLL_REMOVE) {
+        remsock(fdp);
+    } else {
+        if (fdp == NULL) {
+            if (!addsock(s, what, l))
+                return 1;
+        }
+        else {
+            dd("Changing action from = %s, to = %s",
+                    whatstr[fdp->action], whatstr[what]);
+            setsock(fdp, s, what);
+        }
+    }
+
+     return 0;
+}
+
+
+/** CURLOPT_CLOSESOCKETFUNCTION, a fiber wakes up from coio_wait() on
+ *  the next event loop iteration only, so the fd is closed by the fiber
+ *  if it's still watched. Otherwise the fd number could be given to a new
+ *  socket while the old wait is registered on it.
+ */
+static
+int
+close_cb(void *ctx __attribute__((unused)), curl_socket_t s)
+{
+    bool watched = false;
+
+    for (sock_t *f = socks; f != NULL; f = f->next) {
+        if (f->sockfd != s)
+            continue;
+        watched = true;
+        f->close_fd = true;
+        remsock(f);
+    }
+
+    if (!watched)
+        return close(s);
+
+    return 0;
+}
+
+
+/** CURLOPT_WRITEFUNCTION / CURLOPT_READFUNCTION
+ */
+static
+size_t
+read_cb(void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+    dd("size = %zu, nmemb = %zu", size, nmemb);
+
+    request_t    *r         = (request_t *) ctx;
+    const size_t total_size = size * nmemb;
+
+    /* The body is read straight from the Lua string */
+    if (r->upload.data != NULL) {
+        size_t readen = r->upload.size - r->upload.offset;
+        if (readen > total_size)
+            readen = total_size;
+        memcpy(ptr, r->upload.data + r->upload.offset, readen);
+        r->upload.offset += readen;
+        return readen;
+    }
+
+    /* The body is written by a Lua producer, wait for it if it's late */
+    if (r->body_stream.limit > 0) {
+        buffer_t *b = &r->body_stream.buffer;
+        size_t readen = b->size - r->body_stream.offset;
+        if (readen == 0) {
+            if (r->body_stream.finished)
+                return 0;
+            r->body_stream.paused = true;
+            return CURL_READFUNC_PAUSE;
+        }
+        if (readen > total_size)
+            readen = total_size;
+        memcpy(ptr, b->data + r->body_stream.offset, readen);
+        r->body_stream.offset += readen;
+        if (r->body_stream.offset == b->size) {
+            b->size = 0;
+            r->body_stream.offset = 0;
+        }
+        fiber_cond_broadcast(r->sync.batch->cond);
+        return readen;
+    }
+
+    /* Nothing to upload */
+    if (r->lua_ctx.read_fn == LUA_REFNIL)
+        return 0;
+
+    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.read_fn);
+    lua_pushnumber(r->lua_ctx.L, total_size);
+    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
+    lua_pcall(r->lua_ctx.L, 2, 1, 0);
+
+    size_t readen;
+    const char *data = lua_tolstring(r->lua_ctx.L,
+                                     lua_gettop(r->lua_ctx.L), &readen);
+    memcpy(ptr, data, readen);
+    lua_pop(r->lua_ctx.L, 1);
+
+    return readen;
+}
+
+
+static
+size_t
+write_cb(void *ptr, size_t size, size_t nmemb, void *ctx)
+{
+    dd("size = %zu, nmemb = %zu", size, nmemb);
+
+    request_t    *r    = (request_t *) ctx;
+    const size_t bytes = size * nmemb;
+
+    if (r->stream.limit > 0) {
+        /* The reader is behind, curl passes this data again on resume */
+        if (r->response.size > 0 &&
+            r->response.size + bytes > r->stream.limit)
+        {
+            r->stream.paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        if (!buffer_append(&r->response, ptr, bytes))
+            return 0;
+        fiber_cond_broadcast(r->sync.batch->cond);
+        return bytes;
+    }
+
+    if (r->buffer_response) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+        /* Reserve the whole body at once, if its size is known */
+        if (r->response.size == 0) {
+            curl_off_t cl = -1;
+            curl_easy_getinfo(r->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                              &cl);
+            if (cl > 0 && (curl_off_t) bytes < cl)
+                buffer_reserve(&r->response, (size_t) cl);
+        }
+#endif
+        /* Returning less than 'bytes' aborts the transfer */
+        if (!buffer_append(&r->response, ptr, bytes))
+            return 0;
+        return bytes;
+    }
+
+    if (r->lua_ctx.write_fn == LUA_REFNIL)
+        return bytes;
+
+    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.write_fn);
+    lua_pushlstring(r->lua_ctx.L, (const char *) ptr, bytes);
+    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
+    lua_pcall(r->lua_ctx.L, 2, 1, 0);
+    const size_t written = lua_tointeger(r->lua_ctx.L,
+                                         lua_gettop(r->lua_ctx.L));
+    lua_pop(r->lua_ctx.L, 1);
+
+    return written;
+}
+
+
+static
+size_t
+header_cb(char *buffer, size_t size, size_t nitems, void *ctx)
+{
+    request_t    *r    = (request_t *) ctx;
+    const size_t bytes = size * nitems;
+
+    if (r->capture_headers)
+        headers_add_line(&r->response_headers, &r->headers_allow,
+                         buffer, bytes);
+
+    if (r->cache.enabled)
+        headers_add_line(&r->cache.headers, NULL, buffer, bytes);
+
+    if (r->retry.enabled)
+        retry_header(r, buffer, bytes);
+
+    return bytes;
+}
+
+
+/** Hand the request over to curl
+ */
+static
+CURLMcode
+request_launch(request_t *r)
+{
+    if (r->curl_ctx->workers != NULL) {
+        worker_pool_submit(r->curl_ctx->workers, r);
+        return CURLM_OK;
+    }
+
+    CURLMcode rc = curl_multi_add_handle(r->curl_ctx->multi, r->easy);
+    if (!is_mcode_good(rc)) {
+        ++r->curl_ctx->stat.failed_requests;
+        return rc;
+    }
+
+    return rc;
+}
+
+
+/** Upstream limits {{{
+ */
+
+/* Refill the token bucket and return the time until a request could be
+ * started: 0 - now, TIMEOUT_INFINITY - when a running one is done */
+static
+double
+limiter_wait(host_stat_t *h, double now)
+{
+    const host_limit_t *limit = &h->limiter.limit;
+
+    if (limit->max_requests > 0 && h->limiter.running >= limit->max_requests)
+        return TIMEOUT_INFINITY;
+
+    if (limit->rate <= 0)
+        return 0;
+
+    const double burst = limit->burst >= 1 ? limit->burst : 1;
+    h->limiter.tokens += (now - h->limiter.stamp) * limit->rate;
+    if (h->limiter.tokens > burst)
+        h->limiter.tokens = burst;
+    h->limiter.stamp = now;
+
+    if (h->limiter.tokens >= 1)
+        return 0;
+
+    return (1 - h->limiter.tokens) / limit->rate;
+}
+
+
+static inline
+void
+limiter_take(host_stat_t *h, request_t *r)
+{
+    if (h->limiter.limit.rate > 0)
+        h->limiter.tokens -= 1;
+    ++h->limiter.running;
+    r->limiter.running = true;
+}
+
+
+/* Count the request against its upstream's limits, false if it's
+ * delayed */
+static
+bool
+limiter_admit(curl_ctx_t *l, request_t *r)
+{
+    host_stat_t *h = r->host;
+
+    if (!h->limiter.set) {
+        h->limiter.set = true;
+        h->limiter.limit = l->limiter.limit;
+        h->limiter.tokens = h->limiter.limit.burst >= 1 ?
+                            h->limiter.limit.burst : 1;
+        h->limiter.stamp = fiber_clock();
+    }
+
+    /* The delayed ones go first */
+    if (h->limiter.head == NULL && limiter_wait(h, fiber_clock()) == 0) {
+        limiter_take(h, r);
+        return true;
+    }
+
+    r->limiter.delayed = true;
+    r->limiter.prev = h->limiter.tail;
+    r->limiter.next = NULL;
+    if (h->limiter.tail != NULL)
+        h->limiter.tail->limiter.next = r;
+    else
+        h->limiter.head = r;
+    h->limiter.tail = r;
+    ++h->limiter.queued;
+    ++h->limiter.delayed;
+
+    if (!h->limiter.blocked) {
+        h->limiter.blocked = true;
+        h->limiter.next = l->limiter.blocked;
+        l->limiter.blocked = h;
+    }
+    limiter_signal(l);
 
-    ev_io_init(&f->ev, event_cb, f->sockfd, kind);
-    ev_io_start(l->loop, &f->ev);
+    return false;
 }
 
 
-/** Initialize a new sock_t structure
- */
 static
-bool
-addsock(curl_socket_t s, CURL *easy, int action, curl_ctx_t *l)
+void
+limiter_unlink(host_stat_t *h, request_t *r)
 {
-    sock_t *fdp = (sock_t *) malloc(sizeof(sock_t));
-    if (fdp == NULL)
-        return false;
-
-    memset(fdp, 0, sizeof(sock_t));
+    if (r->limiter.prev != NULL)
+        r->limiter.prev->limiter.next = r->limiter.next;
+    else
+        h->limiter.head = r->limiter.next;
+
+    if (r->limiter.next != NULL)
+        r->limiter.next->limiter.prev = r->limiter.prev;
+    else
+        h->limiter.tail = r->limiter.prev;
+
+    r->limiter.prev = r->limiter.next = NULL;
+    r->limiter.delayed = false;
+    --h->limiter.queued;
+}
 
-    fdp->curl_ctx = l;
 
-    setsock(fdp, s, easy, action, l);
+void
+request_limiter_release(request_t *r)
+{
+    host_stat_t *h = r->host;
+
+    if (r->retry.scheduled) {
+        request_t **p = &r->curl_ctx->limiter.retries;
+        while (*p != r)
+            p = &(*p)->retry.next;
+        *p = r->retry.next;
+        r->retry.next = NULL;
+        r->retry.scheduled = false;
+    }
 
-    curl_multi_assign(l->multi, s, fdp);
+    if (r->limiter.delayed)
+        limiter_unlink(h, r);
 
-    ++fdp->curl_ctx->stat.sockets_added;
+    /* A probe which is given up lets the breaker send another one */
+    if (r->breaker_probe != NULL) {
+        breaker_cancel_probe(&r->breaker_probe->breaker);
+        r->breaker_probe = NULL;
+    }
 
-    return true;
+    if (r->limiter.running) {
+        r->limiter.running = false;
+        --h->limiter.running;
+        if (h->limiter.head != NULL)
+            limiter_signal(r->curl_ctx);
+    }
 }
 
 
-/* CURLMOPT_SOCKETFUNCTION */
+/* Start the delayed requests which fit the limits, returns the time until
+ * the next one could be started */
 static
-int
-sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
+double
+limiter_run(curl_ctx_t *l)
 {
-    curl_ctx_t *l = (curl_ctx_t*) cbp;
-    sock_t    *fdp = (sock_t*) sockp;
-
-#if defined(MY_DEBUG)
-    static const char *whatstr[] = {
-        "none", "IN", "OUT", "INOUT", "REMOVE" };
-#endif /* MY_DEBUG */
+    double wait = TIMEOUT_INFINITY;
+    const double now = fiber_clock();
 
-    dd("e = %p, s = %i, what = %s, cbp = %p, sockp = %p",
-            e, s, whatstr[what], cbp, sockp);
+    /* The retries which are due go through the limits again */
+    while (l->limiter.retries != NULL && l->limiter.retries->retry.at <= now) {
+        request_t *r = l->limiter.retries;
+        l->limiter.retries = r->retry.next;
+        r->retry.next = NULL;
+        r->retry.scheduled = false;
 
-    if (what == CURL_POLL_REMOVE) {
-        remsock(fdp, l);
-    } else {
-        if (fdp == NULL) {
-            if (!addsock(s, e, what, l))
-                return 1;
+        if (r->host != NULL && !limiter_admit(l, r))
+            continue;
+        if (request_launch(r) != CURLM_OK)
+            request_deliver(l, r, CURLE_FAILED_INIT, 0);
+    }
+    if (l->limiter.retries != NULL)
+        wait = l->limiter.retries->retry.at - now;
+
+    /* A 'done' callback may delay new requests, so the hosts are taken
+     * off the list while they are processed */
+    host_stat_t *list = l->limiter.blocked;
+    l->limiter.blocked = NULL;
+
+    while (list != NULL) {
+        host_stat_t *h = list;
+        list = h->limiter.next;
+        h->limiter.next = NULL;
+        h->limiter.blocked = false;
+
+        while (h->limiter.head != NULL) {
+            const double w = limiter_wait(h, now);
+            if (w > 0) {
+                if (w < wait)
+                    wait = w;
+                break;
+            }
+
+            request_t *r = h->limiter.head;
+            limiter_unlink(h, r);
+            limiter_take(h, r);
+
+            if (request_launch(r) != CURLM_OK)
+                request_deliver(l, r, CURLE_FAILED_INIT, 0);
         }
-        else {
-            dd("Changing action from = %s, to = %s",
-                    whatstr[fdp->action], whatstr[what]);
-            setsock(fdp, s, e, what, l);
+
+        if (h->limiter.head != NULL && !h->limiter.blocked) {
+            h->limiter.blocked = true;
+            h->limiter.next = l->limiter.blocked;
+            l->limiter.blocked = h;
         }
     }
 
-     return 0;
+    return wait;
 }
 
 
-/** CURLOPT_WRITEFUNCTION / CURLOPT_READFUNCTION
- */
 static
-size_t
-read_cb(void *ptr, size_t size, size_t nmemb, void *ctx)
+int
+limiter_f(va_list ap)
 {
-    dd("size = %zu, nmemb = %zu", size, nmemb);
-
-    request_t    *r         = (request_t *) ctx;
-    const size_t total_size = size * nmemb;
-
-    if (r->lua_ctx.read_fn == LUA_REFNIL)
-        return total_size;
-
-    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.read_fn);
-    lua_pushnumber(r->lua_ctx.L, total_size);
-    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
-    lua_pcall(r->lua_ctx.L, 2, 1, 0);
+    curl_ctx_t *l = va_arg(ap, curl_ctx_t *);
 
-    size_t readen;
-    const char *data = lua_tolstring(r->lua_ctx.L,
-                                     lua_gettop(r->lua_ctx.L), &readen);
-    memcpy(ptr, data, readen);
-    lua_pop(r->lua_ctx.L, 1);
+    while (!l->done) {
+        l->limiter.signaled = false;
+        const double wait = limiter_run(l);
+        if (!l->limiter.signaled)
+            fiber_cond_wait_timeout(l->limiter.cond, wait);
+    }
 
-    return readen;
+    return 0;
 }
 
 
-static
-size_t
-write_cb(void *ptr, size_t size, size_t nmemb, void *ctx)
+bool
+curl_set_host_limit(curl_ctx_t *l, const char *url,
+                    const host_limit_t *limit)
 {
-    dd("size = %zu, nmemb = %zu", size, nmemb);
+    assert(l);
+    assert(limit);
 
-    request_t    *r    = (request_t *) ctx;
-    const size_t bytes = size * nmemb;
+    host_stat_t *h = host_stat_get(&l->hosts, url);
+    if (h == NULL)
+        return false;
 
-    if (r->lua_ctx.write_fn == LUA_REFNIL)
-        return bytes;
+    h->limiter.set = true;
+    h->limiter.limit = *limit;
+    h->limiter.tokens = limit->burst >= 1 ? limit->burst : 1;
+    h->limiter.stamp = fiber_clock();
 
-    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.write_fn);
-    lua_pushlstring(r->lua_ctx.L, (const char *) ptr, bytes);
-    lua_rawgeti(r->lua_ctx.L, LUA_REGISTRYINDEX, r->lua_ctx.fn_ctx);
-    lua_pcall(r->lua_ctx.L, 2, 1, 0);
-    const size_t written = lua_tointeger(r->lua_ctx.L,
-                                         lua_gettop(r->lua_ctx.L));
-    lua_pop(r->lua_ctx.L, 1);
+    /* The delayed requests may fit the new limits */
+    limiter_signal(l);
 
-    return written;
+    return true;
 }
+/* }}} */
 
 
 CURLMcode
@@ -400,8 +1676,20 @@ request_start(request_t *r, const request_start_args_t *a)
     assert(r->easy);
     assert(r->curl_ctx);
 
-    if (a->max_conns > 0)
+    if (a->max_conns > 0) {
         curl_easy_setopt(r->easy, CURLOPT_MAXCONNECTS, a->max_conns);
+        r->easy_dirty = true;
+    }
+
+    if (a->ca_path != NULL) {
+        curl_easy_setopt(r->easy, CURLOPT_CAPATH, a->ca_path);
+        r->easy_dirty = true;
+    }
+
+    if (a->ca_file != NULL) {
+        curl_easy_setopt(r->easy, CURLOPT_CAINFO, a->ca_file);
+        r->easy_dirty = true;
+    }
 
     if (a->keepalive_idle > 0 && a->keepalive_interval > 0) {
 
@@ -415,11 +1703,6 @@ request_start(request_t *r, const request_start_args_t *a)
             ++r->curl_ctx->stat.failed_requests;
             return CURLM_OUT_OF_MEMORY;
         }
-    } else {
-        if (!request_add_header(r, "Connection: close")) {
-            ++r->curl_ctx->stat.failed_requests;
-            return CURLM_OUT_OF_MEMORY;
-        }
     }
 
     if (a->read_timeout > 0)
@@ -435,6 +1718,68 @@ request_start(request_t *r, const request_start_args_t *a)
     if (a->curl_verbose)
         curl_easy_setopt(r->easy, CURLOPT_VERBOSE, 1L);
 
+    if (a->http_version > 0)
+        curl_easy_setopt(r->easy, CURLOPT_HTTP_VERSION, a->http_version);
+
+    if (a->low_speed_time > 0)
+        curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_TIME, a->low_speed_time);
+
+    if (a->low_speed_limit > 0)
+        curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_LIMIT, a->low_speed_limit);
+
+    if (a->max_recv_speed > 0) {
+        curl_easy_setopt(r->easy, CURLOPT_MAX_RECV_SPEED_LARGE,
+                         a->max_recv_speed);
+        r->easy_dirty = true;
+    }
+
+    if (a->max_send_speed > 0) {
+        curl_easy_setopt(r->easy, CURLOPT_MAX_SEND_SPEED_LARGE,
+                         a->max_send_speed);
+        r->easy_dirty = true;
+    }
+
+    /* curl decodes the body before write_cb() */
+    if (a->accept_encoding != NULL)
+        curl_easy_setopt(r->easy, CURLOPT_ACCEPT_ENCODING, a->accept_encoding);
+
+    /* Headers have to seted right before add_handle() */
+    if (r->headers != NULL)
+        curl_easy_setopt(r->easy, CURLOPT_HTTPHEADER, r->headers);
+
+    ++r->curl_ctx->stat.total_requests;
+
+    /* Each request earns a share of a retry */
+    curl_ctx_t *l = r->curl_ctx;
+    if (l->retry_budget.ratio > 0) {
+        l->retry_budget.tokens += l->retry_budget.ratio;
+        if (l->retry_budget.tokens > RETRY_BUDGET_BURST)
+            l->retry_budget.tokens = RETRY_BUDGET_BURST;
+    }
+
+    if (a->url != NULL) {
+        curl_easy_setopt(r->easy, CURLOPT_URL, a->url);
+        r->host = host_stat_get(&r->curl_ctx->hosts, a->url);
+        if (r->host != NULL) {
+            ++r->host->requests;
+            ++r->host->active_requests;
+        }
+    }
+
+    /* limiter_f() starts it later */
+    if (r->host != NULL && !limiter_admit(r->curl_ctx, r))
+        return CURLM_OK;
+
+    return request_launch(r);
+}
+
+
+void
+request_set_defaults(request_t *r)
+{
+    assert(r);
+    assert(r->easy);
+
     curl_easy_setopt(r->easy, CURLOPT_PRIVATE, (void *) r);
 
     curl_easy_setopt(r->easy, CURLOPT_READFUNCTION, read_cb);
@@ -443,29 +1788,64 @@ request_start(request_t *r, const request_start_args_t *a)
     curl_easy_setopt(r->easy, CURLOPT_WRITEFUNCTION, write_cb);
     curl_easy_setopt(r->easy, CURLOPT_WRITEDATA, (void *) r);
 
+    curl_easy_setopt(r->easy, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(r->easy, CURLOPT_HEADERDATA, (void *) r);
+
     curl_easy_setopt(r->easy, CURLOPT_NOPROGRESS, 1L);
 
     curl_easy_setopt(r->easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
 
-    if (a->low_speed_time > 0)
-        curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_TIME, a->low_speed_time);
+    curl_easy_setopt(r->easy, CURLOPT_FOLLOWLOCATION, 1L);
 
-    if (a->low_speed_limit > 0)
-        curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_LIMIT, a->low_speed_limit);
+    curl_easy_setopt(r->easy, CURLOPT_SSL_VERIFYPEER, 1L);
 
-    /* Headers have to seted right before add_handle() */
-    if (r->headers != NULL)
-        curl_easy_setopt(r->easy, CURLOPT_HTTPHEADER, r->headers);
+    if (r->curl_ctx->share != NULL)
+        curl_easy_setopt(r->easy, CURLOPT_SHARE, r->curl_ctx->share->share);
 
-    ++r->curl_ctx->stat.total_requests;
+    /* Connections could outlive the instance in a shared cache, so the
+     * callback doesn't get a context */
+    if (r->curl_ctx->workers == NULL)
+        curl_easy_setopt(r->easy, CURLOPT_CLOSESOCKETFUNCTION, close_cb);
 
-    CURLMcode rc = curl_multi_add_handle(r->curl_ctx->multi, r->easy);
-    if (!is_mcode_good(rc)) {
-        ++r->curl_ctx->stat.failed_requests;
-        return rc;
-    }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Wait for a connection which could be multiplexed rather than
+     * open a new one */
+    if (r->curl_ctx->multiplex)
+        curl_easy_setopt(r->easy, CURLOPT_PIPEWAIT, 1L);
+#endif
+}
 
-    return rc;
+
+void
+request_reset_options(request_t *r)
+{
+    assert(r);
+    assert(r->easy);
+
+    /* It also turns off CURLOPT_POST and CURLOPT_UPLOAD */
+    curl_easy_setopt(r->easy, CURLOPT_HTTPGET, 1L);
+
+    curl_easy_setopt(r->easy, CURLOPT_HTTPHEADER, NULL);
+
+    /* The body has gone with the previous request */
+    curl_easy_setopt(r->easy, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(r->easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) -1);
+    curl_easy_setopt(r->easy, CURLOPT_INFILESIZE_LARGE, (curl_off_t) -1);
+
+    curl_easy_setopt(r->easy, CURLOPT_TCP_KEEPALIVE, 0L);
+
+    curl_easy_setopt(r->easy, CURLOPT_TIMEOUT_MS, 0L);
+    curl_easy_setopt(r->easy, CURLOPT_CONNECTTIMEOUT_MS, 0L);
+    curl_easy_setopt(r->easy, CURLOPT_DNS_CACHE_TIMEOUT, 60L);
+
+    curl_easy_setopt(r->easy, CURLOPT_VERBOSE, 0L);
+
+    curl_easy_setopt(r->easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+
+    curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_TIME, 0L);
+    curl_easy_setopt(r->easy, CURLOPT_LOW_SPEED_LIMIT, 0L);
+
+    curl_easy_setopt(r->easy, CURLOPT_ACCEPT_ENCODING, NULL);
 }
 
 
@@ -477,11 +1857,11 @@ new_request_test(curl_ctx_t *l, const char *url)
     if (r == NULL)
         return NULL;
 
-    curl_easy_setopt(r->easy, CURLOPT_URL, url);
-
     request_start_args_t a;
     request_start_args_init(&a);
 
+    a.url = url;
+
     a.keepalive_interval = 60;
     a.keepalive_idle = 120;
     a.read_timeout = 2;
@@ -498,6 +1878,38 @@ error_exit:
 #endif /* MY_DEBUG */
 
 
+void
+curl_multi_set_args(CURLM *multi, const curl_args_t *a)
+{
+    long pipelining = a->pipeline ? 1L /* pipline on */ : 0L;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    if (a->multiplex)
+        pipelining |= CURLPIPE_MULTIPLEX;
+#endif
+    if (pipelining != 0)
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, pipelining);
+
+#if LIBCURL_VERSION_NUM >= 0x074300
+    if (a->max_concurrent_streams > 0)
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                          a->max_concurrent_streams);
+#endif
+
+    if (a->max_conns > 0)
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, a->max_conns);
+
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    /* curl keeps the requests which exceed these pending */
+    if (a->max_host_connections > 0)
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                          a->max_host_connections);
+    if (a->max_total_connections > 0)
+        curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          a->max_total_connections);
+#endif
+}
+
+
 curl_ctx_t*
 curl_ctx_new(const curl_args_t *a)
 {
@@ -509,31 +1921,81 @@ curl_ctx_new(const curl_args_t *a)
 
     memset(l, 0, sizeof(curl_ctx_t));
 
+    host_stat_table_init(&l->hosts);
+
+    if (!flight_table_init(&l->flights))
+        goto error_exit;
+
     if (!request_pool_new(&l->cpool, l, a->pool_size))
         goto error_exit;
+    l->cpool.keep_options = a->keep_options;
+    l->cpool.queue.limit = a->queue_size;
+    l->cpool.queue.timeout = a->queue_timeout;
 
-    l->loop = ev_loop_new(0);
-    if (l->loop == NULL)
+    l->timeout_ms = -1;
+
+    l->timer_cond = fiber_cond_new();
+    if (l->timer_cond == NULL)
         goto error_exit;
 
     l->multi = curl_multi_init();
     if (l->multi == NULL)
         goto error_exit;
 
-    ev_timer_init(&l->timer_event, timer_cb, 0., 0.);
-    l->timer_event.data = (void *) l;
-
     curl_multi_setopt(l->multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
     curl_multi_setopt(l->multi, CURLMOPT_SOCKETDATA, (void *) l);
 
     curl_multi_setopt(l->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
     curl_multi_setopt(l->multi, CURLMOPT_TIMERDATA, (void *) l);
 
-    if (a->pipeline)
-        curl_multi_setopt(l->multi, CURLMOPT_PIPELINING, 1L /* pipline on */);
+    curl_multi_set_args(l->multi, a);
 
-    if (a->max_conns > 0)
-        curl_multi_setopt(l->multi, CURLMOPT_MAXCONNECTS, a->max_conns);
+    l->multiplex = a->multiplex;
+
+    l->limiter.limit = a->host_limit;
+
+    l->breaker = a->breaker;
+
+    l->retry_budget.ratio = a->retry_budget;
+    l->retry_budget.tokens = RETRY_BUDGET_BURST;
+    l->retry_budget.seed = fiber_time64() | 1;
+
+    l->hedge_budget.ratio = a->hedge_budget;
+    l->hedge_budget.tokens = HEDGE_BUDGET_BURST;
+    l->limiter.cond = fiber_cond_new();
+    if (l->limiter.cond == NULL)
+        goto error_exit;
+
+    if (a->cache_size > 0) {
+        l->cache = cache_new(a->cache_size);
+        if (l->cache == NULL)
+            goto error_exit;
+    }
+
+    if (a->share != NULL) {
+        l->share = a->share;
+        ++l->share->refs;
+    }
+
+    if (a->threads > 0) {
+        l->workers = worker_pool_new(l, a);
+        if (l->workers == NULL)
+            goto error_exit;
+    }
+
+    l->timer_fiber = fiber_new("__curl_timer_fiber", timer_f);
+    if (l->timer_fiber == NULL)
+        goto error_exit;
+
+    fiber_set_joinable(l->timer_fiber, true);
+    fiber_start(l->timer_fiber, l);
+
+    l->limiter.fiber = fiber_new("__curl_limiter_fiber", limiter_f);
+    if (l->limiter.fiber == NULL)
+        goto error_exit;
+
+    fiber_set_joinable(l->limiter.fiber, true);
+    fiber_start(l->limiter.fiber, l);
 
     return l;
 
@@ -549,34 +2011,162 @@ curl_destroy(curl_ctx_t *l)
     if (l == NULL)
         return;
 
+    l->done = true;
+
+    /* In-flight requests of the workers are freed with the pool */
+    if (l->workers != NULL)
+        worker_pool_free(l->workers);
+
+    if (l->timer_fiber != NULL) {
+        fiber_cond_signal(l->timer_cond);
+        fiber_join(l->timer_fiber);
+    }
+
+    if (l->limiter.fiber != NULL) {
+        fiber_cond_signal(l->limiter.cond);
+        fiber_join(l->limiter.fiber);
+    }
+
     if (l->multi != NULL)
         curl_multi_cleanup(l->multi);
 
-    if (l->loop)
-        ev_loop_destroy(l->loop);
+    /* Sockets' fibers have to be stopped before the curl_ctx_t is gone */
+    for (sock_t *f = socks; f != NULL; f = f->next)
+        if (f->curl_ctx == l)
+            remsock(f);
+    while (l->socks > 0)
+        fiber_sleep(0);
+
+    if (l->timer_cond != NULL)
+        fiber_cond_delete(l->timer_cond);
+
+    if (l->limiter.cond != NULL)
+        fiber_cond_delete(l->limiter.cond);
 
+    /* Easy handles are detached from the share here */
     request_pool_free(&l->cpool);
 
+    host_stat_table_free(&l->hosts);
+
+    flight_table_free(&l->flights);
+
+    while (l->upstreams != NULL) {
+        upstream_t *u = l->upstreams;
+        l->upstreams = u->next;
+        upstream_delete(u);
+    }
+
+    cache_delete(l->cache);
+
+    if (l->share != NULL)
+        --l->share->refs;
+
     free(l);
 }
 
 
+/** CURLSHOPT_LOCKFUNC, all instances live in the same thread, so
+ *  it only counts the lock calls
+ */
+static
 void
-curl_poll_one(curl_ctx_t *l)
+share_lock_cb(CURL *easy __attribute__((unused)),
+              curl_lock_data data,
+              curl_lock_access access __attribute__((unused)),
+              void *ctx)
 {
-    if (l == NULL)
-        return;
+    curl_share_ctx_t *s = (curl_share_ctx_t *) ctx;
+
+    switch (data) {
+    case CURL_LOCK_DATA_DNS:
+        ++s->stat.dns_lock_calls;
+        break;
+    case CURL_LOCK_DATA_SSL_SESSION:
+        ++s->stat.ssl_session_lock_calls;
+        break;
+#if LIBCURL_VERSION_NUM >= 0x073900
+    case CURL_LOCK_DATA_CONNECT:
+        ++s->stat.connect_lock_calls;
+        break;
+#endif
+    default:
+        break;
+    }
+}
 
-    assert(l->loop);
 
-    /*
-        We don't call any curl_multi_socket*()
-        function yet as we have no handles added!
-    */
+static
+void
+share_unlock_cb(CURL *easy __attribute__((unused)),
+                curl_lock_data data __attribute__((unused)),
+                void *ctx __attribute__((unused)))
+{
+}
 
-    ev_loop(l->loop, EVRUN_NOWAIT);
 
-    ++l->stat.loop_calls;
+curl_share_ctx_t*
+curl_share_ctx_new(const curl_share_args_t *a)
+{
+    assert(a);
+
+    curl_share_ctx_t *s = (curl_share_ctx_t *)
+            malloc(sizeof(curl_share_ctx_t));
+    if (s == NULL)
+        return NULL;
+
+    memset(s, 0, sizeof(curl_share_ctx_t));
+
+    s->share = curl_share_init();
+    if (s->share == NULL)
+        goto error_exit;
+
+    curl_share_setopt(s->share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt(s->share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt(s->share, CURLSHOPT_USERDATA, (void *) s);
+
+    if (a->dns &&
+        curl_share_setopt(s->share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_DNS) != CURLSHE_OK)
+        goto error_exit;
+
+    if (a->ssl_session &&
+        curl_share_setopt(s->share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK)
+        goto error_exit;
+
+    if (a->connect) {
+#if LIBCURL_VERSION_NUM >= 0x073900
+        if (curl_share_setopt(s->share, CURLSHOPT_SHARE,
+                              CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+            goto error_exit;
+#else
+        goto error_exit;
+#endif
+    }
+
+    return s;
+
+error_exit:
+    curl_share_ctx_destroy(s);
+    return NULL;
+}
+
+
+bool
+curl_share_ctx_destroy(curl_share_ctx_t *s)
+{
+    if (s == NULL)
+        return true;
+
+    if (s->refs > 0)
+        return false;
+
+    if (s->share != NULL)
+        curl_share_cleanup(s->share);
+
+    free(s);
+
+    return true;
 }
 
 
@@ -37,23 +37,100 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-#include <ev.h>
 #include <curl/curl.h>
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include <tarantool/module.h>
+
 #include "request_pool.h"
+#include "histogram.h"
+#include "host_stat.h"
+#include "headers.h"
+#include "cache.h"
+#include "flight.h"
+#include "upstream.h"
+
+/* The retry budget holds up to this number of retries */
+#define RETRY_BUDGET_BURST 10
+
+/* The hedge budget holds up to this number of hedges */
+#define HEDGE_BUDGET_BURST 10
+
+/** Caches which are shared by several curl_ctx_t
+ */
+typedef struct {
+
+  CURLSH   *share;
+
+  /* Amount of curl_ctx_t which use this share */
+  size_t   refs;
+
+  struct {
+    /* How many times curl has locked the shared caches, a lock is
+     * taken for reads and writes, so these aren't hits or misses */
+    uint64_t dns_lock_calls;
+    uint64_t ssl_session_lock_calls;
+    uint64_t connect_lock_calls;
+
+    /* Finished requests which have reused a connection or opened
+     * a new one */
+    uint64_t connections_reused;
+    uint64_t connections_new;
+  } stat;
+
+} curl_share_ctx_t;
+
+
+typedef struct {
+  /* Set to true to share the DNS cache */
+  bool dns;
+
+  /* Set to true to share the TLS session cache */
+  bool ssl_session;
+
+  /* Set to true to share the connection cache */
+  bool connect;
+} curl_share_args_t;
+
 
 /** curl_ctx information, common to all requestections
  */
 typedef struct curl_ctx_s curl_ctx_t;
+typedef struct sock_s sock_t;
+typedef struct worker_pool_s worker_pool_t;
+
+/** Requests which are waited for by one fiber, curl_request_done() puts
+ *  them to the done list and signals the cond
+ */
+typedef struct request_batch_s {
+    struct fiber_cond *cond;
+    request_t         *done;
+} request_batch_t;
 
 struct curl_ctx_s {
 
-  struct ev_loop  *loop;
-  struct ev_timer timer_event;
+  /* curl's timer is fired by this fiber, timeout_ms < 0 means 'not set' */
+  struct fiber      *timer_fiber;
+  struct fiber_cond *timer_cond;
+  long              timeout_ms;
+
+  /* Sockets which are watched in Tarantool's event loop, the sock_t
+   * of all instances are linked into one list of curl_wrapper.c */
+  size_t            socks;
+
+  /* HTTP/2 requests wait for a connection to multiplex over */
+  bool              multiplex;
+
+  /* Shared caches, NULL if the instance has its own */
+  curl_share_ctx_t  *share;
+
+  /* Transfers run in these threads, NULL if they run in TX */
+  worker_pool_t     *workers;
+
+  bool              done;
 
   request_pool_t     cpool;
 
@@ -68,11 +145,77 @@ struct curl_ctx_s {
     uint64_t      http_other_responses;
     size_t        failed_requests;
     size_t        active_requests;
+    /* Requests which have got the result of an identical one */
+    uint64_t      coalesced_requests;
+    /* Retries which have been done and which the budget hasn't allowed */
+    uint64_t      retries;
+    uint64_t      retries_throttled;
+    /* Second copies of slow requests, the ones which have answered first
+     * and the ones which the budget hasn't allowed */
+    uint64_t      hedges;
+    uint64_t      hedges_won;
+    uint64_t      hedges_throttled;
+    /* Requests which an open circuit breaker has failed at once */
+    uint64_t      breaker_rejections;
     size_t        sockets_added;
     size_t        sockets_deleted;
     size_t        loop_calls;
+
+    /* Durations of the phases of successful requests, they are counted
+     * from the start of a request */
+    struct {
+      histogram_t namelookup;
+      histogram_t connect;
+      histogram_t appconnect;
+      histogram_t starttransfer;
+      histogram_t total;
+    } timing;
   } stat;
 
+  /* Statistics of each upstream */
+  host_stat_table_t hosts;
+
+  /* Responses to GET requests, NULL if it's off */
+  cache_t           *cache;
+
+  /* GET requests which are running on behalf of identical ones */
+  flight_table_t    flights;
+
+  /* Named groups of peers, see upstream.h */
+  upstream_t        *upstreams;
+
+  /* The circuit breaker of the hosts which don't have their own config,
+   * see breaker.h */
+  breaker_config_t  breaker;
+
+  /* Requests which exceed the limits of their upstream are delayed, this
+   * fiber starts them when it's possible, see host_stat_t.limiter */
+  struct {
+    /* The limits of the hosts which don't have their own */
+    host_limit_t      limit;
+    struct fiber      *fiber;
+    struct fiber_cond *cond;
+    bool              signaled;
+    /* Hosts which have delayed requests */
+    host_stat_t       *blocked;
+    /* Requests which wait for a retry, ordered by the time */
+    request_t         *retries;
+  } limiter;
+
+  /* Retries are paid by tokens, each request adds 'ratio' of a token,
+   * 0 - unlimited */
+  struct {
+    double   ratio;
+    double   tokens;
+    /* xorshift64 state for the jitter */
+    uint64_t seed;
+  } retry_budget;
+
+  /* Hedges are paid by tokens the same way, see <hedged_request> */
+  struct {
+    double   ratio;
+    double   tokens;
+  } hedge_budget;
 };
 
 
@@ -106,6 +249,24 @@ typedef struct {
 
   /* Enable/Disable curl verbose mode */
   bool curl_verbose;
+
+  /* A path to ssl certificate dir/file */
+  const char *ca_path;
+  const char *ca_file;
+
+  /* CURL_HTTP_VERSION_*, HTTP/1.1 is used by default */
+  long http_version;
+
+  /* The request's url, statistics of its upstream are kept */
+  const char *url;
+
+  /* Bandwidth caps in bytes per second */
+  curl_off_t max_recv_speed;
+  curl_off_t max_send_speed;
+
+  /* CURLOPT_ACCEPT_ENCODING, "" - all the encodings which curl supports,
+   * NULL - the response isn't compressed */
+  const char *accept_encoding;
 } request_start_args_t;
 
 
@@ -117,6 +278,52 @@ typedef struct {
   long max_conns;
 
   size_t pool_size;
+
+  /* Set to true to keep the easy handles' default options between
+   * requests, only the options which were changed are reverted */
+  bool keep_options;
+
+  /* Set to true to multiplex HTTP/2 requests over the same connection */
+  bool multiplex;
+
+  /* Max amount of concurrent streams per HTTP/2 connection,
+   * 0 means curl's default */
+  long max_concurrent_streams;
+
+  /* Caches shared with other instances, it could be NULL */
+  curl_share_ctx_t *share;
+
+  /* Amount of threads which run the transfers, 0 - run them in TX.
+   * Such requests must have buffer_response and must not have
+   * the Lua read/write callbacks */
+  size_t threads;
+
+  /* Max size of the response cache in bytes, 0 - it's off */
+  size_t cache_size;
+
+  /* Max amount of fibers which wait for a request when the pool is
+   * exhausted, 0 - requests fail at once */
+  size_t queue_size;
+
+  /* Default wait time in the queue in seconds */
+  double queue_timeout;
+
+  /* CURLMOPT_MAX_HOST_CONNECTIONS and CURLMOPT_MAX_TOTAL_CONNECTIONS,
+   * 0 - unlimited */
+  long max_host_connections;
+  long max_total_connections;
+
+  /* Limits of each upstream */
+  host_limit_t host_limit;
+
+  /* Retries are allowed up to this share of requests, 0 - unlimited */
+  double retry_budget;
+
+  /* Hedges are allowed up to this share of hedged requests, 0 - unlimited */
+  double hedge_budget;
+
+  /* The circuit breaker of each upstream, it's off if no rate is set */
+  breaker_config_t breaker;
 } curl_args_t;
 
 
@@ -124,15 +331,38 @@ typedef struct {
  */
 curl_ctx_t* curl_ctx_new(const curl_args_t *a);
 void curl_destroy(curl_ctx_t *l); /* curl_free exists! */
-void curl_poll_one(curl_ctx_t *l);
 void curl_print_stat(curl_ctx_t *l, FILE* out);
 
+/* Apply the options of curl_args_t to a multi handle */
+void curl_multi_set_args(CURLM *multi, const curl_args_t *a);
+
+/* Dispatch a finished request and give it back to the pool */
+void curl_request_done(curl_ctx_t *l, request_t *r, CURLcode curl_code);
+
+curl_share_ctx_t* curl_share_ctx_new(const curl_share_args_t *a);
+/* It fails if the share is still used by a curl_ctx_t */
+bool curl_share_ctx_destroy(curl_share_ctx_t *s);
+
 static inline
 curl_ctx_t*
 curl_ctx_new_easy(void) {
   const curl_args_t a = { .pipeline = false,
                           .max_conns = 5,
-                          .pool_size = 1000 };
+                          .pool_size = 1000,
+                          .keep_options = false,
+                          .multiplex = false,
+                          .max_concurrent_streams = 0,
+                          .share = NULL,
+                          .threads = 0,
+                          .cache_size = 0,
+                          .queue_size = 0,
+                          .queue_timeout = 0,
+                          .max_host_connections = 0,
+                          .max_total_connections = 0,
+                          .host_limit = { 0, 0, 0 },
+                          .retry_budget = 0,
+                          .hedge_budget = 0,
+                          .breaker = { 0, 0, 0, 0, 0, 0 } };
   return curl_ctx_new(&a);
 }
 /* }}} */
@@ -143,12 +373,63 @@ static inline request_t *new_request(curl_ctx_t *ctx) {
   return request_pool_get_request(&ctx->cpool);
 }
 
+/* It yields the fiber if the pool is exhausted, see request_queue_t */
+static inline request_t *wait_request(curl_ctx_t *ctx, int priority,
+                                      double timeout) {
+  return request_pool_wait_request(&ctx->cpool, priority, timeout);
+}
+
 static inline void free_request(curl_ctx_t *ctx, request_t *r) {
     request_pool_free_request(&ctx->cpool, r);
 }
 
 CURLMcode request_start(request_t *c, const request_start_args_t *a);
 
+/* Complete the request from the response cache if it's there, and return
+ * true. Otherwise the request has to be started, it could revalidate the
+ * cached response */
+bool request_from_cache(request_t *r, const request_start_args_t *a);
+
+/* Set the options which are the same for all requests */
+void request_set_defaults(request_t *r);
+
+/* Set the limits of the url's upstream, false if memory is out */
+bool curl_set_host_limit(curl_ctx_t *l, const char *url,
+                         const host_limit_t *limit);
+
+/* Add the group to the context, which owns it after that; false if memory
+ * is out */
+bool curl_add_upstream(curl_ctx_t *l, upstream_t *u);
+
+/* Send the request to a peer of the group, 'path' follows the group's name
+ * in the url. The url of the request is request_upstream_url() then, NULL
+ * if memory is out */
+const char *request_set_upstream(request_t *r, upstream_t *u,
+                                 const char *path, const char *key,
+                                 size_t key_size);
+
+/* Set the circuit breaker of the url's upstream, false if memory is out */
+bool curl_set_breaker(curl_ctx_t *l, const char *url,
+                      const breaker_config_t *config);
+
+/* Check the circuit breaker of the url's upstream, false if the request has
+ * to fail at once */
+bool request_breaker_allow(request_t *r, const char *url);
+
+/* Send the request again after 'delay' seconds, limiter_f() starts it; the
+ * response of the previous attempt is dropped */
+void request_reissue(curl_ctx_t *l, request_t *r, double delay);
+
+/* The request doesn't count against its upstream's limits anymore */
+void request_limiter_release(request_t *r);
+
+/* Pass the result of a request to the followers of its flight, the flight
+ * isn't found after that */
+void request_flight_done(request_t *r, CURLcode curl_code, long http_code);
+
+/* Revert the options which could be changed by request_start() */
+void request_reset_options(request_t *r);
+
 #if defined (MY_DEBUG)
 request_t* new_request_test(curl_ctx_t *l, const char *url);
 #endif /* MY_DEBUG */
@@ -186,6 +467,18 @@ request_add_header_keepaive(request_t *c, const request_start_args_t *a)
   return true;
 }
 
+/* The body is owned by the caller and it has to be alive until the
+ * request is freed, curl doesn't copy it */
+static inline
+void
+request_set_body(request_t *c, const char *body, size_t size)
+{
+  assert(c);
+  c->upload.data   = body;
+  c->upload.size   = size;
+  c->upload.offset = 0;
+}
+
 static inline
 bool
 request_set_post(request_t *c)
@@ -195,6 +488,13 @@ request_set_post(request_t *c)
   if (!request_add_header(c, "Accept: */*"))
     return false;
   curl_easy_setopt(c->easy, CURLOPT_POST, 1L);
+  if (c->upload.data != NULL) {
+    curl_easy_setopt(c->easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t) c->upload.size);
+    curl_easy_setopt(c->easy, CURLOPT_POSTFIELDS, c->upload.data);
+  } else if (c->body_stream.size >= 0)
+    curl_easy_setopt(c->easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                     c->body_stream.size);
   return true;
 }
 
@@ -207,9 +507,27 @@ request_set_put(request_t *c)
   if (!request_add_header(c, "Accept: */*"))
     return false;
   curl_easy_setopt(c->easy, CURLOPT_UPLOAD, 1L);
+  if (c->upload.data != NULL)
+    curl_easy_setopt(c->easy, CURLOPT_INFILESIZE_LARGE,
+                     (curl_off_t) c->upload.size);
+  else if (c->body_stream.size >= 0)
+    curl_easy_setopt(c->easy, CURLOPT_INFILESIZE_LARGE,
+                     c->body_stream.size);
   return true;
 }
 
+/* Apply the pause state of both directions of a streamed request */
+static inline
+void
+request_update_pause(request_t *c)
+{
+  assert(c);
+  assert(c->easy);
+  curl_easy_pause(c->easy,
+                  (c->stream.paused ? CURLPAUSE_RECV : 0) |
+                  (c->body_stream.paused ? CURLPAUSE_SEND : 0));
+}
+
 
 static inline
 void
@@ -225,6 +543,13 @@ request_start_args_init(request_start_args_t *a)
   a->connect_timeout = -1;
   a->dns_cache_timeout = -1;
   a->curl_verbose = false;
+  a->ca_path = NULL;
+  a->ca_file = NULL;
+  a->http_version = -1;
+  a->url = NULL;
+  a->max_recv_speed = -1;
+  a->max_send_speed = -1;
+  a->accept_encoding = NULL;
 }
 
 void request_start_args_print(const request_start_args_t *a, FILE *out);
@@ -0,0 +1,844 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <tarantool/module.h>
+
+#include "buffer.h"
+#include "decode.h"
+
+
+typedef struct {
+  lua_State  *L;
+  const char *start;
+  const char *p;
+  const char *end;
+  int        depth;
+  /* The first error, p points to it */
+  const char *error;
+  /* Strings with escapes and long numbers are copied here */
+  buffer_t   scratch;
+} decoder_t;
+
+
+static inline
+bool
+fail(decoder_t *d, const char *error)
+{
+    if (d->error == NULL)
+        d->error = error;
+    return false;
+}
+
+
+/** json.NULL and msgpack.NULL compare equal to a NULL lightuserdata, and
+ *  the encoders write it back as null
+ */
+static inline
+void
+push_null(lua_State *L)
+{
+    lua_pushlightuserdata(L, NULL);
+}
+
+
+/* Integers which a double can't hold exactly become uint64_t/int64_t cdata,
+ * the same way the json and msgpack modules do it */
+#define EXACT_INTEGER_MAX (1ULL << 53)
+
+static inline
+void
+push_uint(lua_State *L, uint64_t v)
+{
+    if (v <= EXACT_INTEGER_MAX)
+        lua_pushnumber(L, (lua_Number) v);
+    else
+        luaL_pushuint64(L, v);
+}
+
+
+static inline
+void
+push_int(lua_State *L, int64_t v)
+{
+    if (v >= -(int64_t) EXACT_INTEGER_MAX)
+        lua_pushnumber(L, (lua_Number) v);
+    else
+        luaL_pushint64(L, v);
+}
+
+
+/* Nested containers take a level of the C stack and 2 slots of Lua's */
+static inline
+bool
+enter(decoder_t *d)
+{
+    if (++d->depth > DECODE_MAX_DEPTH)
+        return fail(d, "too deep nesting");
+    if (!lua_checkstack(d->L, 3))
+        return fail(d, "Lua stack overflow");
+    return true;
+}
+
+
+/** JSON {{{
+ */
+static bool json_value(decoder_t *d);
+
+
+static inline
+void
+skip_space(decoder_t *d)
+{
+    while (d->p < d->end &&
+           (*d->p == ' ' || *d->p == '\n' || *d->p == '\r' || *d->p == '\t'))
+        ++d->p;
+}
+
+
+static inline
+bool
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+
+static
+int
+hex4(const char *p)
+{
+    int v = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return v;
+}
+
+
+static
+size_t
+utf8_encode(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char) (0xc0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char) (0xe0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char) (0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char) (0xf0 | (cp >> 18));
+    out[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char) (0x80 | (cp & 0x3f));
+    return 4;
+}
+
+
+/** A string without escapes is pushed right from the body, otherwise it's
+ *  unescaped into the scratch buffer
+ */
+static
+bool
+json_string(decoder_t *d)
+{
+    const char *s = ++d->p;
+
+    while (d->p < d->end) {
+        const unsigned char c = (unsigned char) *d->p;
+        if (c == '"') {
+            lua_pushlstring(d->L, s, (size_t) (d->p - s));
+            ++d->p;
+            return true;
+        }
+        if (c == '\\')
+            break;
+        if (c < 0x20)
+            return fail(d, "control character in string");
+        ++d->p;
+    }
+
+    buffer_t *b = &d->scratch;
+    b->size = 0;
+    if (!buffer_append(b, s, (size_t) (d->p - s)))
+        return fail(d, "out of memory");
+
+    while (d->p < d->end) {
+        const unsigned char c = (unsigned char) *d->p;
+
+        if (c == '"') {
+            lua_pushlstring(d->L, b->data, b->size);
+            ++d->p;
+            return true;
+        }
+
+        if (c < 0x20)
+            return fail(d, "control character in string");
+
+        if (c != '\\') {
+            const char *run = d->p;
+            while (d->p < d->end && *d->p != '"' && *d->p != '\\' &&
+                   (unsigned char) *d->p >= 0x20)
+                ++d->p;
+            if (!buffer_append(b, run, (size_t) (d->p - run)))
+                return fail(d, "out of memory");
+            continue;
+        }
+
+        if (d->end - d->p < 2)
+            break;
+
+        char out[4];
+        size_t size = 1;
+
+        switch (d->p[1]) {
+        case '"':  out[0] = '"';  break;
+        case '\\': out[0] = '\\'; break;
+        case '/':  out[0] = '/';  break;
+        case 'b':  out[0] = '\b'; break;
+        case 'f':  out[0] = '\f'; break;
+        case 'n':  out[0] = '\n'; break;
+        case 'r':  out[0] = '\r'; break;
+        case 't':  out[0] = '\t'; break;
+        case 'u': {
+            if (d->end - d->p < 6)
+                return fail(d, "invalid \\u escape");
+            int cp = hex4(d->p + 2);
+            if (cp < 0)
+                return fail(d, "invalid \\u escape");
+            d->p += 4;
+            /* A surrogate pair, a lone surrogate is kept as it is */
+            if (cp >= 0xd800 && cp <= 0xdbff && d->end - d->p >= 8 &&
+                d->p[2] == '\\' && d->p[3] == 'u')
+            {
+                const int low = hex4(d->p + 4);
+                if (low >= 0xdc00 && low <= 0xdfff) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    d->p += 6;
+                }
+            }
+            size = utf8_encode(out, (uint32_t) cp);
+            break;
+        }
+        default:
+            return fail(d, "invalid escape");
+        }
+
+        d->p += 2;
+        if (!buffer_append(b, out, size))
+            return fail(d, "out of memory");
+    }
+
+    return fail(d, "unterminated string");
+}
+
+
+static
+bool
+json_number(decoder_t *d)
+{
+    const char *s = d->p;
+    const bool negative = *d->p == '-';
+    bool integer = true;
+
+    if (negative)
+        ++d->p;
+
+    if (d->p >= d->end || !is_digit(*d->p))
+        return fail(d, "invalid number");
+    if (*d->p == '0')
+        ++d->p;
+    else {
+        while (d->p < d->end && is_digit(*d->p))
+            ++d->p;
+    }
+
+    if (d->p < d->end && *d->p == '.') {
+        integer = false;
+        ++d->p;
+        if (d->p >= d->end || !is_digit(*d->p))
+            return fail(d, "invalid number");
+        while (d->p < d->end && is_digit(*d->p))
+            ++d->p;
+    }
+
+    if (d->p < d->end && (*d->p == 'e' || *d->p == 'E')) {
+        integer = false;
+        ++d->p;
+        if (d->p < d->end && (*d->p == '+' || *d->p == '-'))
+            ++d->p;
+        if (d->p >= d->end || !is_digit(*d->p))
+            return fail(d, "invalid number");
+        while (d->p < d->end && is_digit(*d->p))
+            ++d->p;
+    }
+
+    if (integer) {
+        uint64_t v = 0;
+        const char *q = s + negative;
+        for (; q < d->p; ++q) {
+            const unsigned digit = (unsigned) (*q - '0');
+            if (v > (UINT64_MAX - digit) / 10)
+                break;
+            v = v * 10 + digit;
+        }
+        if (q == d->p) {
+            if (!negative) {
+                push_uint(d->L, v);
+                return true;
+            }
+            if (v <= (uint64_t) INT64_MAX) {
+                push_int(d->L, -(int64_t) v);
+                return true;
+            }
+            if (v == (uint64_t) INT64_MAX + 1) {
+                push_int(d->L, INT64_MIN);
+                return true;
+            }
+        }
+    }
+
+    /* strtod() needs a terminated copy, the body isn't terminated */
+    buffer_t *b = &d->scratch;
+    b->size = 0;
+    if (!buffer_append(b, s, (size_t) (d->p - s)) ||
+        !buffer_append(b, "", 1))
+        return fail(d, "out of memory");
+    lua_pushnumber(d->L, strtod(b->data, NULL));
+    return true;
+}
+
+
+static
+bool
+json_literal(decoder_t *d, const char *word, size_t size)
+{
+    if ((size_t) (d->end - d->p) < size || memcmp(d->p, word, size) != 0)
+        return fail(d, "unexpected character");
+    d->p += size;
+    return true;
+}
+
+
+static
+bool
+json_array(decoder_t *d)
+{
+    ++d->p;
+    lua_newtable(d->L);
+
+    skip_space(d);
+    if (d->p < d->end && *d->p == ']') {
+        ++d->p;
+        return true;
+    }
+
+    for (int i = 1;; ++i) {
+        if (!json_value(d))
+            return false;
+        lua_rawseti(d->L, -2, i);
+
+        skip_space(d);
+        if (d->p >= d->end)
+            return fail(d, "unterminated array");
+        if (*d->p == ']') {
+            ++d->p;
+            return true;
+        }
+        if (*d->p != ',')
+            return fail(d, "expected ',' or ']'");
+        ++d->p;
+    }
+}
+
+
+static
+bool
+json_object(decoder_t *d)
+{
+    ++d->p;
+    lua_newtable(d->L);
+
+    skip_space(d);
+    if (d->p < d->end && *d->p == '}') {
+        ++d->p;
+        return true;
+    }
+
+    for (;;) {
+        skip_space(d);
+        if (d->p >= d->end || *d->p != '"')
+            return fail(d, "expected a string key");
+        if (!json_string(d))
+            return false;
+
+        skip_space(d);
+        if (d->p >= d->end || *d->p != ':')
+            return fail(d, "expected ':'");
+        ++d->p;
+
+        if (!json_value(d))
+            return false;
+        lua_rawset(d->L, -3);
+
+        skip_space(d);
+        if (d->p >= d->end)
+            return fail(d, "unterminated object");
+        if (*d->p == '}') {
+            ++d->p;
+            return true;
+        }
+        if (*d->p != ',')
+            return fail(d, "expected ',' or '}'");
+        ++d->p;
+    }
+}
+
+
+static
+bool
+json_value(decoder_t *d)
+{
+    skip_space(d);
+    if (d->p >= d->end)
+        return fail(d, "unexpected end");
+
+    bool ok;
+
+    switch (*d->p) {
+    case '{':
+        if (!enter(d))
+            return false;
+        ok = json_object(d);
+        --d->depth;
+        return ok;
+    case '[':
+        if (!enter(d))
+            return false;
+        ok = json_array(d);
+        --d->depth;
+        return ok;
+    case '"':
+        return json_string(d);
+    case 't':
+        if (!json_literal(d, "true", 4))
+            return false;
+        lua_pushboolean(d->L, 1);
+        return true;
+    case 'f':
+        if (!json_literal(d, "false", 5))
+            return false;
+        lua_pushboolean(d->L, 0);
+        return true;
+    case 'n':
+        if (!json_literal(d, "null", 4))
+            return false;
+        push_null(d->L);
+        return true;
+    default:
+        if (*d->p == '-' || is_digit(*d->p))
+            return json_number(d);
+        return fail(d, "unexpected character");
+    }
+}
+/* }}} */
+
+
+/** MsgPack {{{
+ */
+typedef enum {
+  MP_NIL,
+  MP_BOOL,
+  MP_UINT,
+  MP_INT,
+  MP_DOUBLE,
+  MP_STR,
+  MP_ARRAY,
+  MP_MAP
+} mp_type_t;
+
+/** A decoded header; a string's payload is skipped, 'size' is the number of
+ *  elements of an array or a map
+ */
+typedef struct {
+  mp_type_t  type;
+  uint64_t   u;
+  int64_t    i;
+  double     f;
+  const char *str;
+  uint32_t   size;
+} mp_token_t;
+
+
+/* Read a big-endian unsigned integer of 'n' bytes */
+static inline
+bool
+mp_load(decoder_t *d, size_t n, uint64_t *v)
+{
+    if ((size_t) (d->end - d->p) < n)
+        return fail(d, "unexpected end");
+    *v = 0;
+    for (size_t k = 0; k < n; ++k)
+        *v = (*v << 8) | (unsigned char) d->p[k];
+    d->p += n;
+    return true;
+}
+
+
+static
+bool
+mp_next(decoder_t *d, mp_token_t *t)
+{
+    uint64_t v;
+    size_t len = 0;
+
+    if (!mp_load(d, 1, &v))
+        return false;
+    const unsigned char c = (unsigned char) v;
+
+    if (c <= 0x7f) {
+        t->type = MP_UINT;
+        t->u = c;
+        return true;
+    }
+    if (c >= 0xe0) {
+        t->type = MP_INT;
+        t->i = (int8_t) c;
+        return true;
+    }
+    if ((c & 0xf0) == 0x80) {
+        t->type = MP_MAP;
+        t->size = c & 0x0f;
+        return true;
+    }
+    if ((c & 0xf0) == 0x90) {
+        t->type = MP_ARRAY;
+        t->size = c & 0x0f;
+        return true;
+    }
+    if ((c & 0xe0) == 0xa0) {
+        len = c & 0x1f;
+        goto str;
+    }
+
+    switch (c) {
+    case 0xc0:
+        t->type = MP_NIL;
+        return true;
+    case 0xc2:
+    case 0xc3:
+        t->type = MP_BOOL;
+        t->u = c == 0xc3;
+        return true;
+    /* bin is returned as a string */
+    case 0xc4: case 0xd9:
+    case 0xc5: case 0xda:
+    case 0xc6: case 0xdb: {
+        const size_t n = c == 0xc4 || c == 0xd9 ? 1 :
+                         c == 0xc5 || c == 0xda ? 2 : 4;
+        if (!mp_load(d, n, &v))
+            return false;
+        len = (size_t) v;
+        goto str;
+    }
+    case 0xca: {
+        if (!mp_load(d, 4, &v))
+            return false;
+        const uint32_t bits = (uint32_t) v;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        t->type = MP_DOUBLE;
+        t->f = f;
+        return true;
+    }
+    case 0xcb:
+        if (!mp_load(d, 8, &v))
+            return false;
+        t->type = MP_DOUBLE;
+        memcpy(&t->f, &v, sizeof(t->f));
+        return true;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        if (!mp_load(d, (size_t) 1 << (c - 0xcc), &v))
+            return false;
+        t->type = MP_UINT;
+        t->u = v;
+        return true;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+        const size_t n = (size_t) 1 << (c - 0xd0);
+        if (!mp_load(d, n, &v))
+            return false;
+        /* Sign extension of the n-byte value */
+        const unsigned shift = (unsigned) (64 - 8 * n);
+        t->type = MP_INT;
+        t->i = (int64_t) (v << shift) >> shift;
+        return true;
+    }
+    case 0xdc: case 0xdd:
+    case 0xde: case 0xdf:
+        if (!mp_load(d, c == 0xdc || c == 0xde ? 2 : 4, &v))
+            return false;
+        t->type = c <= 0xdd ? MP_ARRAY : MP_MAP;
+        t->size = (uint32_t) v;
+        return true;
+    case 0xc1:
+        return fail(d, "invalid byte");
+    default:
+        return fail(d, "extension types aren't supported");
+    }
+
+str:
+    if ((size_t) (d->end - d->p) < len)
+        return fail(d, "unexpected end");
+    t->type = MP_STR;
+    t->str = d->p;
+    t->size = (uint32_t) len;
+    d->p += len;
+    return true;
+}
+
+
+static
+bool
+mp_value(decoder_t *d)
+{
+    mp_token_t t;
+    if (!mp_next(d, &t))
+        return false;
+
+    lua_State *L = d->L;
+
+    switch (t.type) {
+    case MP_NIL:
+        push_null(L);
+        return true;
+    case MP_BOOL:
+        lua_pushboolean(L, (int) t.u);
+        return true;
+    case MP_UINT:
+        push_uint(L, t.u);
+        return true;
+    case MP_INT:
+        push_int(L, t.i);
+        return true;
+    case MP_DOUBLE:
+        lua_pushnumber(L, t.f);
+        return true;
+    case MP_STR:
+        lua_pushlstring(L, t.str, t.size);
+        return true;
+    case MP_ARRAY:
+    case MP_MAP:
+        break;
+    }
+
+    /* Each element takes a byte at least, so a forged size doesn't
+     * preallocate a huge table */
+    const uint64_t bytes = (uint64_t) t.size * (t.type == MP_MAP ? 2 : 1);
+    if (bytes > (uint64_t) (d->end - d->p))
+        return fail(d, "unexpected end");
+
+    if (!enter(d))
+        return false;
+
+    if (t.type == MP_ARRAY) {
+        lua_createtable(L, (int) t.size, 0);
+        for (uint32_t i = 0; i < t.size; ++i) {
+            if (!mp_value(d))
+                return false;
+            lua_rawseti(L, -2, (int) i + 1);
+        }
+    } else {
+        lua_createtable(L, 0, (int) t.size);
+        for (uint32_t i = 0; i < t.size; ++i) {
+            if (!mp_value(d))
+                return false;
+            if (lua_type(L, -1) == LUA_TNUMBER && isnan(lua_tonumber(L, -1)))
+                return fail(d, "NaN key");
+            if (!mp_value(d))
+                return false;
+            lua_rawset(L, -3);
+        }
+    }
+
+    --d->depth;
+    return true;
+}
+
+
+/** Check the value without pushing it, a tuple is built from valid MsgPack
+ *  only
+ */
+static
+bool
+mp_check(decoder_t *d)
+{
+    mp_token_t t;
+    if (!mp_next(d, &t))
+        return false;
+
+    if (t.type != MP_ARRAY && t.type != MP_MAP)
+        return true;
+
+    if (++d->depth > DECODE_MAX_DEPTH)
+        return fail(d, "too deep nesting");
+
+    const uint64_t n = (uint64_t) t.size * (t.type == MP_MAP ? 2 : 1);
+    for (uint64_t i = 0; i < n; ++i) {
+        if (!mp_check(d))
+            return false;
+    }
+
+    --d->depth;
+    return true;
+}
+
+
+static
+bool
+mp_tuple(decoder_t *d)
+{
+    if (d->p >= d->end)
+        return fail(d, "unexpected end");
+
+    const unsigned char c = (unsigned char) *d->p;
+    if ((c & 0xf0) != 0x90 && c != 0xdc && c != 0xdd)
+        return fail(d, "a tuple has to be an array");
+
+    if (!mp_check(d))
+        return false;
+    if (d->p != d->end)
+        return fail(d, "trailing bytes");
+
+    box_tuple_t *tuple = box_tuple_new(box_tuple_format_default(),
+                                       d->start, d->p);
+    if (tuple == NULL)
+        return fail(d, "can't create a tuple");
+
+    luaT_pushtuple(d->L, tuple);
+    return true;
+}
+/* }}} */
+
+
+bool
+decode_format_from_str(const char *name, decode_format_t *format)
+{
+    assert(name);
+    assert(format);
+
+    if (strcmp(name, "json") == 0)
+        *format = DECODE_JSON;
+    else if (strcmp(name, "msgpack") == 0)
+        *format = DECODE_MSGPACK;
+    else if (strcmp(name, "tuple") == 0)
+        *format = DECODE_TUPLE;
+    else
+        return false;
+
+    return true;
+}
+
+
+bool
+decode_push(lua_State *L, decode_format_t format, const char *data,
+            size_t size)
+{
+    assert(L);
+
+    if (format == DECODE_NONE) {
+        lua_pushlstring(L, data, size);
+        return true;
+    }
+
+    decoder_t d;
+    memset(&d, 0, sizeof(d));
+    d.L     = L;
+    d.start = data != NULL ? data : "";
+    d.p     = d.start;
+    d.end   = d.start + size;
+
+    const int top = lua_gettop(L);
+    const char *name = "msgpack";
+    bool ok;
+
+    switch (format) {
+    case DECODE_JSON:
+        name = "json";
+        ok = json_value(&d);
+        if (ok) {
+            skip_space(&d);
+            if (d.p != d.end)
+                ok = fail(&d, "trailing characters");
+        }
+        break;
+    case DECODE_TUPLE:
+        ok = mp_tuple(&d);
+        break;
+    default:
+        ok = mp_value(&d);
+        if (ok && d.p != d.end)
+            ok = fail(&d, "trailing bytes");
+        break;
+    }
+
+    buffer_free(&d.scratch);
+
+    if (ok)
+        return true;
+
+    lua_settop(L, top);
+    lua_pushfstring(L, "%s: %s at offset %d", name, d.error,
+                    (int) (d.p - d.start));
+    return false;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef DECODE_H_INCLUDED
+#define DECODE_H_INCLUDED 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <lua.h>
+
+/* Max nesting of arrays and maps */
+#define DECODE_MAX_DEPTH 128
+
+/** Response bodies are decoded right from the C buffer, so a large body
+ *  isn't interned as a Lua string before it's parsed
+ */
+typedef enum {
+  DECODE_NONE,
+  DECODE_JSON,
+  DECODE_MSGPACK,
+  /* A MsgPack array which becomes a box.tuple */
+  DECODE_TUPLE
+} decode_format_t;
+
+/* 'json', 'msgpack' or 'tuple', false if the name is unknown */
+bool decode_format_from_str(const char *name, decode_format_t *format);
+
+/* Push the value of the body. If it's malformed, an error message is pushed
+ * instead and false is returned */
+bool decode_push(lua_State *L, decode_format_t format, const char *data,
+                 size_t size);
+
+#endif /* DECODE_H_INCLUDED */
@@ -30,282 +30,2293 @@
  */
 
 #include "driver.h"
+#include "worker.h"
+#include "compress.h"
 
 #include <math.h>
+#include <strings.h>
 
 
+/** Map 'http_version' option to CURL_HTTP_VERSION_*, -1 - unknown version
+ */
+static
+long
+http_version_from_str(const char *v)
+{
+    if (strcmp(v, "1.0") == 0)
+        return CURL_HTTP_VERSION_1_0;
+    if (strcmp(v, "1.1") == 0)
+        return CURL_HTTP_VERSION_1_1;
+    if (strcmp(v, "2") == 0)
+        return CURL_HTTP_VERSION_2_0;
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    if (strcmp(v, "2tls") == 0)
+        return CURL_HTTP_VERSION_2TLS;
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+    if (strcmp(v, "2-prior-knowledge") == 0)
+        return CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+#endif
+    return -1;
+}
+
+
+/** Set up the retry policy of the request from 'retry' option at 'idx':
+ *  true - the defaults, or {attempts, base_delay, max_delay, retry_after,
+ *  statuses, curl_codes, idempotent_only}
+ */
+static
+bool
+get_retry_policy(lua_State *L, int idx, request_t *r, const char *method,
+                 const char **reason)
+{
+    static const long default_statuses[] = { 429, 502, 503, 504 };
+    static const CURLcode default_curl_codes[] = {
+        CURLE_COULDNT_CONNECT, CURLE_OPERATION_TIMEDOUT, CURLE_SEND_ERROR,
+        CURLE_RECV_ERROR, CURLE_GOT_NOTHING };
+
+    const bool is_table = lua_istable(L, idx);
+    if (!is_table && !lua_toboolean(L, idx))
+        return true;
+
+    r->retry.max_attempts = 3;
+    r->retry.base_delay = 0.1;
+    r->retry.max_delay = 10;
+    r->retry.use_after = true;
+
+    bool idempotent_only = true;
+
+    for (size_t i = 0;
+         i < sizeof(default_statuses) / sizeof(default_statuses[0]); ++i)
+        r->retry.statuses[r->retry.nstatuses++] = default_statuses[i];
+
+    for (size_t i = 0;
+         i < sizeof(default_curl_codes) / sizeof(default_curl_codes[0]); ++i)
+    {
+        const unsigned c = (unsigned) default_curl_codes[i];
+        r->retry.curl_codes[c / 64] |= 1ULL << (c % 64);
+    }
+
+    if (is_table) {
+        lua_getfield(L, idx, "attempts");
+        if (!lua_isnil(L, -1))
+            r->retry.max_attempts = (int) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "base_delay");
+        if (!lua_isnil(L, -1))
+            r->retry.base_delay = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "max_delay");
+        if (!lua_isnil(L, -1))
+            r->retry.max_delay = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "retry_after");
+        if (!lua_isnil(L, -1))
+            r->retry.use_after = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "idempotent_only");
+        if (!lua_isnil(L, -1))
+            idempotent_only = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "statuses");
+        if (lua_istable(L, -1)) {
+            const size_t n = lua_objlen(L, -1);
+            if (n > REQUEST_RETRY_MAX_STATUSES) {
+                lua_pop(L, 1);
+                *reason = "too many retry statuses";
+                return false;
+            }
+            r->retry.nstatuses = 0;
+            for (size_t i = 1; i <= n; ++i) {
+                lua_rawgeti(L, -1, (int) i);
+                r->retry.statuses[r->retry.nstatuses++] =
+                        (long) lua_tointeger(L, -1);
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, idx, "curl_codes");
+        if (lua_istable(L, -1)) {
+            r->retry.curl_codes[0] = r->retry.curl_codes[1] = 0;
+            const size_t n = lua_objlen(L, -1);
+            for (size_t i = 1; i <= n; ++i) {
+                lua_rawgeti(L, -1, (int) i);
+                const lua_Integer c = lua_tointeger(L, -1);
+                if (c > 0 && c < 128)
+                    r->retry.curl_codes[c / 64] |= 1ULL << (c % 64);
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    /* A POST could be applied twice */
+    r->retry.enabled = r->retry.max_attempts > 1 &&
+                       !(idempotent_only && strcmp(method, "POST") == 0);
+    r->retry.attempt = 1;
+
+    return true;
+}
+
+
+/** Read 'decode' option at 'idx': nil, 'json', 'msgpack' or 'tuple'
+ */
+static
+bool
+get_decode(lua_State *L, int idx, decode_format_t *format,
+           const char **reason)
+{
+    *format = DECODE_NONE;
+    if (lua_isnil(L, idx))
+        return true;
+
+    const char *name = lua_tostring(L, idx);
+    if (name == NULL || !decode_format_from_str(name, format)) {
+        *reason = "decode has to be 'json', 'msgpack' or 'tuple'";
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Set 'body' of the result at the top, it's decoded right from the
+ *  buffer. A malformed body is kept as a string and 'decode_error' is set
+ */
+static
+void
+push_body(lua_State *L, decode_format_t format, const char *data,
+          size_t size)
+{
+    if (decode_push(L, format, data, size)) {
+        lua_setfield(L, -2, "body");
+        return;
+    }
+
+    lua_setfield(L, -2, "decode_error");
+    lua_pushlstring(L, data, size);
+    lua_setfield(L, -2, "body");
+}
+
+
+/** Replace the upload body with its compressed copy and set
+ *  Content-Encoding, 'name' is 'gzip' or 'deflate'
+ */
+static
+bool
+compress_request_body(request_t *r, const char *name, const char **reason)
+{
+    compress_format_t format;
+    if (!compress_format_from_str(name, &format)) {
+        *reason = "compress_body has to be 'gzip' or 'deflate'";
+        return false;
+    }
+
+    if (!compress_available()) {
+        *reason = "the driver is built without zlib";
+        return false;
+    }
+
+    if (!compress_body(&r->upload.compressed, format, r->upload.data,
+                       r->upload.size))
+    {
+        *reason = "can't allocate memory (compress_body)";
+        return false;
+    }
+
+    char header[64];
+    snprintf(header, sizeof(header), "Content-Encoding: %s",
+             compress_encoding(format));
+    if (!request_add_header(r, header)) {
+        *reason = "can't allocate memory (request_add_header)";
+        return false;
+    }
+
+    request_set_body(r, r->upload.compressed.data, r->upload.compressed.size);
+
+    return true;
+}
+
+
+/** Set up the request from the options table at 'opts' (0 - none) and the
+ *  body string at 'body' (0 - none), the request is not freed on failure
+ */
+static
+bool
+request_prepare(lua_State *L, request_t *r, const char *method,
+                const char *url, int body, int opts,
+                request_start_args_t *req_args, const char **reason)
+{
+    r->lua_ctx.L = L;
+
+    bool use_cache = true;
+
+    /** Set Options {{{
+     */
+    if (opts != 0) {
+
+        const int top = lua_gettop(L);
+
+        /* Read callback */
+        lua_pushstring(L, "read");
+        lua_gettable(L, opts);
+        if (lua_isfunction(L, top + 1))
+            r->lua_ctx.read_fn = luaL_ref(L, LUA_REGISTRYINDEX);
+        else
+            lua_pop(L, 1);
+
+        /* Write callback */
+        lua_pushstring(L, "write");
+        lua_gettable(L, opts);
+        if (lua_isfunction(L, top + 1))
+            r->lua_ctx.write_fn = luaL_ref(L, LUA_REGISTRYINDEX);
+        else
+            lua_pop(L, 1);
+
+        /* Done callback */
+        lua_pushstring(L, "done");
+        lua_gettable(L, opts);
+        if (lua_isfunction(L, top + 1))
+            r->lua_ctx.done_fn = luaL_ref(L, LUA_REGISTRYINDEX);
+        else
+            lua_pop(L, 1);
+
+        /* callback's context */
+        lua_pushstring(L, "ctx");
+        lua_gettable(L, opts);
+        r->lua_ctx.fn_ctx = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        /* Upload body, it's referenced until the request is freed */
+        lua_pushstring(L, "body");
+        lua_gettable(L, opts);
+        if (lua_isstring(L, top + 1)) {
+            size_t size;
+            const char *data = lua_tolstring(L, top + 1, &size);
+            r->lua_ctx.body = luaL_ref(L, LUA_REGISTRYINDEX);
+            request_set_body(r, data, size);
+        } else
+            lua_pop(L, 1);
+
+        lua_pushstring(L, "buffer_response");
+        lua_gettable(L, opts);
+        r->buffer_response = lua_toboolean(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "decode");
+        lua_gettable(L, opts);
+        if (!get_decode(L, top + 1, &r->decode, reason))
+            return false;
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "retry");
+        lua_gettable(L, opts);
+        if (!get_retry_policy(L, top + 1, r, method, reason))
+            return false;
+        lua_pop(L, 1);
+
+        /* Response headers, true or a list of the needed ones */
+        lua_pushstring(L, "response_headers");
+        lua_gettable(L, opts);
+        if (lua_istable(L, top + 1)) {
+            r->capture_headers = true;
+            const size_t n = lua_objlen(L, top + 1);
+            for (size_t i = 1; i <= n; ++i) {
+                lua_rawgeti(L, top + 1, (int) i);
+                size_t size;
+                const char *name = lua_tolstring(L, top + 2, &size);
+                if (name != NULL &&
+                    !headers_allow(&r->headers_allow, name, size))
+                {
+                    *reason = "can't allocate memory (headers_allow)";
+                    return false;
+                }
+                lua_pop(L, 1);
+            }
+        } else
+            r->capture_headers = lua_toboolean(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "cache");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            use_cache = lua_toboolean(L, top + 1);
+        lua_pop(L, 1);
+
+        /** Http headers */
+        lua_pushstring(L, "headers");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1)) {
+            lua_pushnil(L);
+            char header[4096];
+            while (lua_next(L, -2) != 0) {
+                snprintf(header, sizeof(header) - 1,
+                        "%s: %s", lua_tostring(L, -2), lua_tostring(L, -1));
+                if (!request_add_header(r, header)) {
+                    *reason = "can't allocate memory (request_add_header)";
+                    return false;
+                }
+                lua_pop(L, 1);
+            } // while
+        }
+        lua_pop(L, 1);
+
+        /* SSL/TLS cert  {{{ */
+        /* curl copies the strings, so it's safe to pop them */
+        lua_pushstring(L, "ca_path");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->ca_path = lua_tostring(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "ca_file");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->ca_file = lua_tostring(L, top + 1);
+        lua_pop(L, 1);
+        /* }}} */
+
+        lua_pushstring(L, "max_conns");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->max_conns = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "keepalive_idle");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->keepalive_idle = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "keepalive_interval");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->keepalive_interval = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "low_speed_limit");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->low_speed_limit = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        /* Bandwidth caps, bytes per second */
+        lua_pushstring(L, "max_recv_speed");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->max_recv_speed = (curl_off_t) lua_tonumber(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "max_send_speed");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->max_send_speed = (curl_off_t) lua_tonumber(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "low_speed_time");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->low_speed_time = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "read_timeout");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->read_timeout = (long) floor(lua_tonumber(L, top + 1) * 1000);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "connect_timeout");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->connect_timeout = (long) floor(lua_tonumber(L, top + 1) * 1000);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "dns_cache_timeout");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1))
+            req_args->dns_cache_timeout = (long) lua_tointeger(L, top + 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, "http_version");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1)) {
+            req_args->http_version =
+                http_version_from_str(lua_tostring(L, top + 1));
+            if (req_args->http_version < 0) {
+                *reason = "http_version does not supported";
+                return false;
+            }
+            if (req_args->http_version >= CURL_HTTP_VERSION_2_0 &&
+                !(curl_version_info(CURLVERSION_NOW)->features &
+                  CURL_VERSION_HTTP2))
+            {
+                *reason = "curl is built without HTTP/2 support";
+                return false;
+            }
+        }
+        lua_pop(L, 1);
+
+        /* true - all the encodings which curl supports, or a list for
+         * Accept-Encoding, e.g. "gzip, deflate" */
+        lua_pushstring(L, "accept_encoding");
+        lua_gettable(L, opts);
+        if (lua_isstring(L, top + 1))
+            /* curl copies it */
+            req_args->accept_encoding = lua_tostring(L, top + 1);
+        else if (lua_toboolean(L, top + 1)) {
+            if (!(curl_version_info(CURLVERSION_NOW)->features &
+                  CURL_VERSION_LIBZ))
+            {
+                *reason = "curl is built without zlib";
+                return false;
+            }
+            req_args->accept_encoding = "";
+        }
+        lua_pop(L, 1);
+
+        /* Debug- / Internal- options */
+        lua_pushstring(L, "curl_verbose");
+        lua_gettable(L, opts);
+        if (!lua_isnil(L, top + 1) && lua_isboolean(L, top + 1))
+            req_args->curl_verbose = true;
+        lua_pop(L, 1);
+    }
+
+    /* An explicit body overrides the one of the options */
+    if (body != 0 && lua_isstring(L, body)) {
+        if (r->lua_ctx.body != LUA_REFNIL) {
+            luaL_unref(L, LUA_REGISTRYINDEX, r->lua_ctx.body);
+            r->lua_ctx.body = LUA_REFNIL;
+        }
+        size_t size;
+        const char *data = lua_tolstring(L, body, &size);
+        lua_pushvalue(L, body);
+        r->lua_ctx.body = luaL_ref(L, LUA_REGISTRYINDEX);
+        request_set_body(r, data, size);
+    }
+
+    /* The body is compressed here, Lua doesn't see the bytes twice. An empty
+     * body and the one of a GET or a HEAD (get() passes '') are sent as
+     * they are, they'd become a gzip stream with a Content-Encoding */
+    if (opts != 0 && r->upload.data != NULL && r->upload.size > 0 &&
+        strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+    {
+        lua_getfield(L, opts, "compress_body");
+        const char *name = lua_isstring(L, -1) ? lua_tostring(L, -1) :
+                           lua_toboolean(L, -1) ? "gzip" : NULL;
+        lua_pop(L, 1);
+        if (name != NULL && !compress_request_body(r, name, reason))
+            return false;
+    }
+    /* }}} */
+
+
+    /* Upstream group {{{ */
+    if (strncmp(url, UPSTREAM_SCHEME, sizeof(UPSTREAM_SCHEME) - 1) == 0) {
+        const char *name = url + sizeof(UPSTREAM_SCHEME) - 1;
+        const char *path = strchr(name, '/');
+        if (path == NULL)
+            path = name + strlen(name);
+
+        upstream_t *u = upstream_find(r->curl_ctx->upstreams, name,
+                                      (size_t) (path - name));
+        if (u == NULL) {
+            *reason = "unknown upstream group";
+            return false;
+        }
+
+        /* The key of the consistent hashing, the path by default */
+        const char *key = NULL;
+        size_t key_size = 0;
+        if (opts != 0) {
+            lua_getfield(L, opts, "hash_key");
+            key = lua_tolstring(L, -1, &key_size);
+            lua_pop(L, 1);
+        }
+
+        url = request_set_upstream(r, u, path, key, key_size);
+        if (url == NULL) {
+            *reason = "can't allocate memory (request_set_upstream)";
+            return false;
+        }
+    }
+    /* }}} */
+
+    req_args->url = url;
+
+    /* Method {{{ */
+
+    if (*method == 'G') {
+      curl_easy_setopt(r->easy, CURLOPT_HTTPGET, 1);
+      r->cache.enabled = use_cache && r->curl_ctx->cache != NULL;
+    }
+    else if (strcmp(method, "HEAD") == 0) {
+        /* The handle is reset when it's back in the pool */
+        curl_easy_setopt(r->easy, CURLOPT_NOBODY, 1L);
+        r->easy_dirty = true;
+    }
+    else if (strcmp(method, "POST") == 0) {
+        if (!request_set_post(r)) {
+            *reason = "can't allocate memory (request_set_post)";
+            return false;
+        }
+    }
+    else if (strcmp(method, "PUT") == 0) {
+        if (!request_set_put(r)) {
+            *reason = "can't allocate memory (request_set_put)";
+            return false;
+        }
+    } else {
+        *reason = "method does not supported";
+        return false;
+    }
+    /* }}} */
+
+    return true;
+}
+
+
+/** Check the request against the pool's mode and add it to curl,
+ *  the request is not freed on failure
+ */
+static
+bool
+request_submit(lib_ctx_t *ctx, request_t *r, const request_start_args_t *a,
+               const char **reason)
+{
+    /* Workers can't call Lua */
+    if (ctx->curl_ctx->workers != NULL &&
+        (!r->buffer_response ||
+         (r->upload.data == NULL && r->lua_ctx.read_fn != LUA_REFNIL)))
+    {
+        *reason = "requests of threads have to use buffer_response and body";
+        return false;
+    }
+
+    /* A stream is read and written by TX while the transfer runs, and its
+     * callbacks wake fibers up, so it can't run in a worker */
+    if (ctx->curl_ctx->workers != NULL &&
+        (r->stream.limit > 0 || r->body_stream.limit > 0))
+    {
+        *reason = "streams can't be used with threads";
+        return false;
+    }
+
+    /* A hit never reaches curl */
+    if (request_from_cache(r, a))
+        return true;
+
+    /* The upstream is down, the request doesn't wait for a timeout */
+    if (a->url != NULL && !request_breaker_allow(r, a->url)) {
+        *reason = "circuit breaker is open";
+        return false;
+    }
+
+    /* Note that the add_handle() will set a
+     * time-out to trigger very soon so that
+     * the necessary socket_action() call will be
+     * called by this app */
+    if (request_start(r, a) != CURLM_OK) {
+        *reason = "can't start the request";
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Give up a request which is still running. A worker's transfer can't be
+ *  taken back, so the request is detached and curl_request_done() frees it
+ */
+static
+void
+request_abandon(lib_ctx_t *ctx, request_t *r)
+{
+    if (ctx->curl_ctx->workers != NULL) {
+        r->sync.fiber = NULL;
+        r->sync.batch = NULL;
+        return;
+    }
+    free_request(ctx->curl_ctx, r);
+}
+
+
+/** Find the value of a header in the 'headers' option at 'headers',
+ *  NULL if it isn't there
+ */
+static
+const char*
+find_option_header(lua_State *L, int headers, const char *name)
+{
+    if (!lua_istable(L, headers))
+        return NULL;
+
+    const char *value = NULL;
+
+    lua_pushnil(L);
+    while (lua_next(L, headers) != 0) {
+        if (lua_type(L, -2) == LUA_TSTRING &&
+            strcasecmp(lua_tostring(L, -2), name) == 0)
+        {
+            /* The string is kept by the table */
+            value = lua_tostring(L, -1);
+            lua_pop(L, 2);
+            break;
+        }
+        lua_pop(L, 1);
+    }
+
+    return value;
+}
+
+
+/** Build the single-flight key of a GET which has the 'coalesce' option:
+ *  the url, the values of the request headers which are listed in the
+ *  option and the needed response headers. Returns false if the request
+ *  isn't coalesced
+ */
+static
+bool
+flight_key(lua_State *L, const char *method, const char *url, int opts,
+           buffer_t *key)
+{
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    const int top = lua_gettop(L);
+    bool ok = false;
+
+    lua_pushstring(L, "coalesce");
+    lua_gettable(L, opts);
+    if (!lua_toboolean(L, top + 1))
+        goto exit;
+
+    if (!buffer_append(key, url, strlen(url)))
+        goto exit;
+
+    if (lua_istable(L, top + 1)) {
+        lua_pushstring(L, "headers");
+        lua_gettable(L, opts);
+
+        for (int i = 1; ; ++i) {
+            lua_rawgeti(L, top + 1, i);
+            if (!lua_isstring(L, top + 3))
+                break;
+
+            const char *name = lua_tostring(L, top + 3);
+            const char *value = find_option_header(L, top + 2, name);
+            if (value == NULL)
+                value = "";
+
+            if (!buffer_append(key, "\n", 1) ||
+                !buffer_append(key, name, strlen(name)) ||
+                !buffer_append(key, ": ", 2) ||
+                !buffer_append(key, value, strlen(value)))
+                goto exit;
+
+            lua_settop(L, top + 2);
+        }
+        lua_settop(L, top + 1);
+    }
+
+    /* The followers get the response headers of the leader */
+    lua_pushstring(L, "response_headers");
+    lua_gettable(L, opts);
+    if (lua_toboolean(L, top + 2)) {
+        if (!buffer_append(key, "\n\n", 2))
+            goto exit;
+
+        for (int i = 1; lua_istable(L, top + 2); ++i) {
+            lua_rawgeti(L, top + 2, i);
+            if (!lua_isstring(L, top + 3))
+                break;
+
+            size_t size;
+            const char *name = lua_tolstring(L, top + 3, &size);
+            if (!buffer_append(key, name, size) ||
+                !buffer_append(key, "\n", 1))
+                goto exit;
+
+            lua_settop(L, top + 2);
+        }
+    }
+
+    ok = true;
+
+exit:
+    lua_settop(L, top);
+    return ok;
+}
+
+
+/** Read the admission options at 'opts' (0 - none): 'priority' - 'high',
+ *  'normal' (default) or 'low', and 'queue_timeout' in seconds. It returns
+ *  REQUEST_PRIORITY_*, error() is raised if the priority is unknown
+ */
+static
+int
+get_queue_options(lua_State *L, lib_ctx_t *ctx, int opts, double *timeout)
+{
+    int priority = REQUEST_PRIORITY_NORMAL;
+    *timeout = ctx->curl_ctx->cpool.queue.timeout;
+
+    if (opts == 0)
+        return priority;
+
+    lua_getfield(L, opts, "priority");
+    if (!lua_isnil(L, -1)) {
+        const char *v = lua_tostring(L, -1);
+        if (v != NULL && strcmp(v, "high") == 0)
+            priority = REQUEST_PRIORITY_HIGH;
+        else if (v != NULL && strcmp(v, "low") == 0)
+            priority = REQUEST_PRIORITY_LOW;
+        else if (v == NULL || strcmp(v, "normal") != 0)
+            return luaL_error(L, "priority have to be 'high', 'normal' "
+                                 "or 'low'");
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, opts, "queue_timeout");
+    if (!lua_isnil(L, -1))
+        *timeout = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    return priority;
+}
+
+
+/** Start a request from the arguments of async_request() or sync_request().
+ *  If 'follow' is set and the request is coalesced with an identical one
+ *  which is running, the flight is returned there and NULL is returned
+ */
+static
+request_t*
+start_request(lua_State *L, lib_ctx_t *ctx, bool sync, flight_t **follow)
+{
+    const char *reason = "unknown error";
+
+    if (ctx->done) {
+        luaL_error(L, "curl stopped");
+        return NULL;
+    }
+
+    const char *method = luaL_checkstring(L, 2);
+    const char *url    = luaL_checkstring(L, 3);
+    if (!lua_istable(L, 4)) {
+        luaL_error(L, "4-arg have to be a table");
+        return NULL;
+    }
+
+    double queue_timeout;
+    const int priority = get_queue_options(L, ctx, 4, &queue_timeout);
+
+    /* An identical GET which is running or queued is waited for, it doesn't
+     * take a request from the pool */
+    buffer_t key;
+    buffer_init(&key);
+    flight_t *flight = NULL;
+    if (follow != NULL && flight_key(L, method, url, 4, &key)) {
+        flight_t *f = flight_find(&ctx->curl_ctx->flights,
+                                  key.data, key.size);
+        if (f != NULL) {
+            buffer_free(&key);
+            flight_ref(f);
+            ++ctx->curl_ctx->stat.coalesced_requests;
+            *follow = f;
+            return NULL;
+        }
+
+        /* The flight is added before the request waits in the queue, so
+         * identical requests which come meanwhile follow it. It's fine
+         * to run the request alone if there's no memory */
+        flight = flight_new(&ctx->curl_ctx->flights, key.data, key.size);
+    }
+    buffer_free(&key);
+
+    request_t *r = wait_request(ctx->curl_ctx, priority, queue_timeout);
+    if (r == NULL) {
+        /* curl_destroy() has failed the flight itself */
+        if (flight != NULL && !ctx->done)
+            flight_done(&ctx->curl_ctx->flights, flight,
+                        CURLE_ABORTED_BY_CALLBACK);
+        luaL_error(L, ctx->done ? "curl stopped" :
+                                  "can't get request obj from pool");
+        return NULL;
+    }
+
+    /* free_request() releases the followers if the request fails here */
+    r->flight = flight;
+
+    request_start_args_t req_args;
+    request_start_args_init(&req_args);
+
+    if (!request_prepare(L, r, method, url, 0, 4, &req_args, &reason))
+        goto error_exit;
+
+    if (sync) {
+        r->buffer_response = true;
+        r->sync.fiber = fiber_self();
+    }
+
+    if (!request_submit(ctx, r, &req_args, &reason))
+        goto error_exit;
+
+    return r;
+
+error_exit:
+    free_request(ctx->curl_ctx, r);
+    luaL_error(L, reason);
+    return NULL;
+}
+
+
+/*
+   <async_request> This function does async HTTP request
+
+    Parameters:
+
+        method  - HTTP method, like GET, POST, PUT and so on
+        url     - HTTP url, like https://tarantool.org/doc
+        options - this is a table of options.
+
+            done - name of a callback function which is invoked when a request
+                   was completed;
+
+            write - name of a callback function which is invoked if the
+                    server returns data to the client;
+                    signature is function(data, context)
+
+            read - name of a callback function which is invoked if the
+                   client passes data to the server.
+                   signature is function(content_size, context)
+
+            body - a string which is passed to the server, 'read' isn't
+                   called if it's set;
+
+            done - name of a callback function which is invoked when a request
+                   was completed;
+                   signature is  function(curl_code, http_code, error_message, ctx [, body [, headers]])
+
+            buffer_response - if it's true, the response body is collected
+                              by the driver and passed to the 'done'
+                              callback, 'write' is not called;
+
+            cache - if it's false, the response cache isn't used;
+
+            retry - true or {attempts, base_delay, max_delay, retry_after,
+                    statuses, curl_codes, idempotent_only}, a request with
+                    buffer_response is sent again after a backoff if it
+                    has failed with a retryable result;
+
+            priority - 'high', 'normal' (default) or 'low', a class of the
+                       queue where the fiber waits if the pool is exhausted;
+
+            queue_timeout - how long the fiber waits in the queue, seconds;
+
+            response_headers - if it's true, the response headers are
+                               collected and passed to the 'done' callback,
+                               it also may be a list of the needed names;
+
+            ca_path - a path to ssl certificate dir;
+
+            ca_file - a path to ssl certificate file;
+
+            headers - a table of HTTP headers;
+
+            max_conns - max amount of cached alive connections;
+
+            keepalive_idle & keepalive_interval - non-universal keepalive knobs (Linux, AIX, HP-UX, more);
+
+            low_speed_time & low_speed_limit - If the download receives less than "low speed limit" bytes/second
+                                               during "low speed time" seconds, the operations is aborted.
+                                               You could i.e if you have a pretty high speed connection, abort if
+                                               it is less than 2000 bytes/sec during 20 seconds;
+
+            read_timeout - Time-out the read operation after this amount of seconds;
+
+            connect_timeout  - Time-out connect operations after this amount of seconds, if connects are;
+                               OK within this time, then fine... This only aborts the connect phase;
+
+            dns_cache_timeout - DNS cache timeout;
+
+            max_recv_speed & max_send_speed - bandwidth caps in bytes per
+                                              second;
+
+            http_version - '1.0', '1.1' (default), '2', '2tls' (HTTP/2 over
+                           TLS only) or '2-prior-knowledge' (h2c without
+                           upgrade);
+
+            accept_encoding - true (all the encodings which curl supports)
+                              or a value of Accept-Encoding, the response
+                              is decoded by curl;
+
+            compress_body - true ('gzip') or 'deflate', the body is
+                            compressed and Content-Encoding is set;
+
+            curl_verbose - make libcurl verbose!;
+
+        Returns:
+              bool, msg or error()
+*/
+static
+int
+async_request(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
+
+    start_request(L, ctx, false, NULL);
+
+    return curl_make_result(L, CURL_LAST, CURLM_OK);
+}
+
+
+/** Push {code = NUMBER, body = STRING [, headers = HEADERS]
+ *  [, attempts = NUMBER]} of a finished request */
+static
+void
+push_response(lua_State *L, request_t *r)
+{
+    lua_createtable(L, 0, 2);
+
+    lua_pushstring(L, "code");
+    lua_pushinteger(L, r->sync.http_code);
+    lua_settable(L, -3);
+
+    push_body(L, r->decode, r->response.data, r->response.size);
+
+    if (r->capture_headers) {
+        lua_pushstring(L, "headers");
+        headers_push(L, r->response_headers.data, r->response_headers.size);
+        lua_settable(L, -3);
+    }
+
+    if (r->retry.enabled) {
+        lua_pushstring(L, "attempts");
+        lua_pushinteger(L, r->retry.attempt);
+        lua_settable(L, -3);
+    }
+}
+
+
+/** Wait for the leader of a flight and push its response, see
+ *  push_response()
+ */
+static
+int
+follow_flight(lua_State *L, flight_t *f)
+{
+    /* The follower decodes the body the way it wants */
+    decode_format_t decode = DECODE_NONE;
+    if (lua_istable(L, 4)) {
+        const char *reason = NULL;
+        lua_getfield(L, 4, "decode");
+        const bool ok = get_decode(L, lua_gettop(L), &decode, &reason);
+        lua_pop(L, 1);
+        if (!ok) {
+            flight_unref(f);
+            return luaL_error(L, "%s", reason);
+        }
+    }
+
+    while (!f->done) {
+        fiber_cond_wait(f->cond);
+        if (!f->done && fiber_is_cancelled()) {
+            flight_unref(f);
+            return luaL_error(L, "fiber is cancelled");
+        }
+    }
+
+    const CURLcode curl_code = f->curl_code;
+    if (curl_code != CURLE_OK) {
+        flight_unref(f);
+        return luaL_error(L, "curl has an internal error, msg = %s",
+                          curl_easy_strerror(curl_code));
+    }
+
+    lua_createtable(L, 0, 2);
+
+    lua_pushstring(L, "code");
+    lua_pushinteger(L, f->http_code);
+    lua_settable(L, -3);
+
+    push_body(L, decode, f->body.data, f->body.size);
+
+    if (f->has_headers) {
+        lua_pushstring(L, "headers");
+        headers_push(L, f->headers.data, f->headers.size);
+        lua_settable(L, -3);
+    }
+
+    if (f->attempts > 0) {
+        lua_pushstring(L, "attempts");
+        lua_pushinteger(L, f->attempts);
+        lua_settable(L, -3);
+    }
+
+    flight_unref(f);
+
+    return 1;
+}
+
+
+static int finish_sync_request(lua_State *L, lib_ctx_t *ctx, request_t *r);
+
+
+/** Hedged requests {{{
+ */
+
+/* A hedge by 'p95' delay needs this number of recent samples of the host */
+#define HEDGE_MIN_SAMPLES 20
+
+/** Read 'hedge' option of a sync request: true or {url, delay}, the delay
+ *  is in seconds or it's 'p95' of the upstream's recent latency (the
+ *  default).
+ *  Returns false if the request isn't hedged
+ */
+static
+bool
+get_hedge(lua_State *L, lib_ctx_t *ctx, request_t *r, double *delay,
+          const char **url)
+{
+    curl_ctx_t *l = ctx->curl_ctx;
+    const int top = lua_gettop(L);
+    bool hedged = false;
+
+    lua_getfield(L, 4, "hedge");
+    if (!lua_toboolean(L, top + 1))
+        goto exit;
+
+    /* Only reads are sent twice, a body mustn't reach the upstream twice */
+    const char *method = lua_tostring(L, 2);
+    if (method == NULL ||
+        (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0))
+        goto exit;
+
+    *url = lua_tostring(L, 3);
+    *delay = -1;
+
+    if (lua_istable(L, top + 1)) {
+        lua_getfield(L, top + 1, "url");
+        if (lua_isstring(L, -1))
+            /* The string is kept by the options table */
+            *url = lua_tostring(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, top + 1, "delay");
+        if (lua_isnumber(L, -1))
+            *delay = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (*delay < 0) {
+        const histogram_t *latency = r->host != NULL ?
+                                     &r->host->recent_latency : NULL;
+        if (latency == NULL || latency->count < HEDGE_MIN_SAMPLES)
+            goto exit;
+        *delay = (double) histogram_percentile(latency, 0.95) / 1000000.0;
+    }
+
+    /* Each hedged request earns a share of a hedge */
+    if (l->hedge_budget.ratio > 0) {
+        l->hedge_budget.tokens += l->hedge_budget.ratio;
+        if (l->hedge_budget.tokens > HEDGE_BUDGET_BURST)
+            l->hedge_budget.tokens = HEDGE_BUDGET_BURST;
+    }
+
+    hedged = true;
+
+exit:
+    lua_settop(L, top);
+    return hedged;
+}
+
+
+/* Start the second copy of the request which is at the stack, NULL if the
+ * budget or the pool doesn't allow it */
+static
+request_t*
+start_hedge(lua_State *L, lib_ctx_t *ctx, const char *url,
+            request_batch_t *batch)
+{
+    curl_ctx_t *l = ctx->curl_ctx;
+    const char *reason = "unknown error";
+
+    if (l->hedge_budget.ratio > 0) {
+        if (l->hedge_budget.tokens < 1) {
+            ++l->stat.hedges_throttled;
+            return NULL;
+        }
+        l->hedge_budget.tokens -= 1;
+    }
+
+    request_t *h = new_request(l);
+    if (h == NULL)
+        return NULL;
+
+    request_start_args_t req_args;
+    request_start_args_init(&req_args);
+
+    if (!request_prepare(L, h, lua_tostring(L, 2), url, 0, 4, &req_args,
+                         &reason))
+        goto error_exit;
+
+    h->buffer_response = true;
+    h->sync.batch = batch;
+
+    if (!request_submit(ctx, h, &req_args, &reason))
+        goto error_exit;
+
+    ++l->stat.hedges;
+
+    return h;
+
+error_exit:
+    free_request(l, h);
+    return NULL;
+}
+
+
+/** Wait for the request, and send a copy of it if it isn't done within
+ *  'delay'. The first successful response wins, the other request is
+ *  given back to the pool at once
+ */
+static
+int
+hedged_request(lua_State *L, lib_ctx_t *ctx, request_t *r, double delay,
+               const char *url)
+{
+    curl_ctx_t *l = ctx->curl_ctx;
+
+    request_batch_t batch = { .cond = fiber_cond_new(), .done = NULL };
+    if (batch.cond == NULL) {
+        request_abandon(ctx, r);
+        return luaL_error(L, "can't allocate memory (fiber_cond_new)");
+    }
+
+    r->sync.fiber = NULL;
+    r->sync.batch = &batch;
+
+    /* The followers get the result of the winner */
+    flight_t *flight = r->flight;
+    r->flight = NULL;
+
+    request_t *reqs[2] = { r, NULL };
+    request_t *winner = NULL, *failed = NULL;
+    size_t running = 1;
+    bool hedge_tried = false;
+    const double deadline = fiber_clock() + delay;
+
+    while (winner == NULL && running > 0) {
+
+        if (batch.done != NULL) {
+            request_t *d = batch.done;
+            batch.done = d->sync.next;
+            --running;
+            if (d->sync.curl_code == CURLE_OK)
+                winner = d;
+            else if (failed == NULL || running == 0)
+                failed = d;
+            continue;
+        }
+
+        double wait = TIMEOUT_INFINITY;
+        if (!hedge_tried) {
+            wait = deadline - fiber_clock();
+            /* The first one has failed, so it isn't worth to wait */
+            if (wait <= 0 || failed != NULL) {
+                hedge_tried = true;
+                reqs[1] = start_hedge(L, ctx, url, &batch);
+                if (reqs[1] != NULL)
+                    ++running;
+                continue;
+            }
+        }
+
+        fiber_cond_wait_timeout(batch.cond, wait);
+
+        if (fiber_is_cancelled()) {
+            /* The followers are released while 'r' is still ours, freeing
+             * it could give its slot to another fiber */
+            if (flight != NULL) {
+                r->flight = flight;
+                request_flight_done(r, CURLE_ABORTED_BY_CALLBACK, 0);
+            }
+            for (size_t i = 0; i < 2; ++i) {
+                if (reqs[i] == NULL)
+                    continue;
+                if (reqs[i]->sync.done)
+                    free_request(l, reqs[i]);
+                else
+                    request_abandon(ctx, reqs[i]);
+            }
+            fiber_cond_delete(batch.cond);
+            return luaL_error(L, "fiber is cancelled");
+        }
+    }
+
+    request_t *result = winner != NULL ? winner : failed;
+
+    if (winner != NULL && winner == reqs[1])
+        ++l->stat.hedges_won;
+
+    /* The loser goes back to the pool right away */
+    for (size_t i = 0; i < 2; ++i) {
+        if (reqs[i] == NULL || reqs[i] == result)
+            continue;
+        if (reqs[i]->sync.done)
+            free_request(l, reqs[i]);
+        else
+            request_abandon(ctx, reqs[i]);
+    }
+
+    fiber_cond_delete(batch.cond);
+
+    if (flight != NULL) {
+        result->flight = flight;
+        request_flight_done(result, result->sync.curl_code,
+                            result->sync.http_code);
+    }
+
+    return finish_sync_request(L, ctx, result);
+}
+/* }}} */
+
+
+/*
+   <sync_request> This function does HTTP request, it yields the calling
+   fiber until the response has arrived
+
+    Parameters:
+
+        method  - HTTP method, like GET, POST, PUT and so on
+        url     - HTTP url, like https://tarantool.org/doc
+        options - a table of options, see <async_request>; the callbacks
+                  are ignored, the response is always buffered.
+
+            coalesce - if it's set, a GET waits for an identical one which
+                       is running and gets its response instead of doing
+                       a transfer; it's true or a list of the request
+                       headers which are compared besides the url;
+
+            hedge - true or {url, delay}, a copy of the request is sent to
+                    'url' (the same one by default) if there is no
+                    response within 'delay' seconds ('p95' of the
+                    upstream's latency by default), the first successful
+                    response wins; only GET and HEAD are hedged;
+
+            decode - 'json', 'msgpack' or 'tuple' (a MsgPack array), the
+                     body is parsed in C into a Lua value; a malformed body
+                     is returned as a string and decode_error is set;
+
+        Returns:
+              {code = NUMBER, body = STRING [, decode_error = STRING]} or
+              error()
+*/
+static
+int
+sync_request(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
+
+    flight_t *f = NULL;
+    request_t *r = start_request(L, ctx, true, &f);
+    if (r == NULL)
+        return follow_flight(L, f);
+
+    double hedge_delay;
+    const char *hedge_url;
+    if (!r->sync.done && get_hedge(L, ctx, r, &hedge_delay, &hedge_url))
+        return hedged_request(L, ctx, r, hedge_delay, hedge_url);
+
+    /* curl_request_done() wakes us up */
+    while (!r->sync.done) {
+        fiber_yield();
+        if (!r->sync.done && fiber_is_cancelled()) {
+            request_abandon(ctx, r);
+            return luaL_error(L, "fiber is cancelled");
+        }
+    }
+
+    return finish_sync_request(L, ctx, r);
+}
+
+
+/** Push the response of a finished sync request, or raise its error;
+ *  the request is freed
+ */
+static
+int
+finish_sync_request(lua_State *L, lib_ctx_t *ctx, request_t *r)
+{
+    const CURLcode curl_code = r->sync.curl_code;
+    if (curl_code != CURLE_OK) {
+        free_request(ctx->curl_ctx, r);
+        return luaL_error(L, "curl has an internal error, msg = %s",
+                          curl_easy_strerror(curl_code));
+    }
+
+    push_response(L, r);
+
+    free_request(ctx->curl_ctx, r);
+
+    return 1;
+}
+
+
+/** Store {error = reason} at results[i] */
+static
+void
+set_batch_error(lua_State *L, int results, size_t i, const char *reason)
+{
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "error");
+    lua_pushstring(L, reason);
+    lua_settable(L, -3);
+    lua_rawseti(L, results, (int) i + 1);
+}
+
+
+/** Store the result of a finished batch request and free it */
+static
+void
+finish_batch_request(lua_State *L, lib_ctx_t *ctx, int results, request_t *r)
+{
+    if (r->sync.curl_code != CURLE_OK)
+        set_batch_error(L, results, r->sync.index,
+                        curl_easy_strerror(r->sync.curl_code));
+    else {
+        push_response(L, r);
+        lua_rawseti(L, results, (int) r->sync.index + 1);
+    }
+    free_request(ctx->curl_ctx, r);
+}
+
+
+/*
+   <request_many> This function does a batch of HTTP requests, it yields
+   the calling fiber until all of them are done or the deadline expires
+
+    Parameters:
+
+        requests    - an array of {method, url [, body [, options]]},
+                      options are the same as for <sync_request>;
+        concurrency - max number of requests which run at once,
+                      0 - all of them;
+        timeout     - a deadline for the whole batch in seconds,
+                      0 - no deadline;
+        options     - priority and queue_timeout of the batch in the
+                      admission queue, see <sync_request>.
+
+        Returns:
+              an array of {code = NUMBER, body = STRING} or
+              {error = STRING} in the order of requests, the error is
+              'timeout' if the deadline has expired
+*/
+static
+int
+request_many(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
+
+    if (ctx->done)
+        return luaL_error(L, "curl stopped");
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const size_t n = lua_objlen(L, 2);
+    size_t concurrency = (size_t) luaL_optinteger(L, 3, 0);
+    const double timeout = luaL_optnumber(L, 4, 0);
+
+    double queue_timeout;
+    const int priority = get_queue_options(L, ctx, lua_istable(L, 5) ? 5 : 0,
+                                           &queue_timeout);
+
+    if (concurrency == 0 || concurrency > n)
+        concurrency = n;
+
+    lua_createtable(L, (int) n, 0);
+    const int results = lua_gettop(L);
+
+    if (n == 0)
+        return 1;
+
+    /* The requests in flight, it's collected by Lua on any error */
+    request_t **running = (request_t **)
+        lua_newuserdata(L, concurrency * sizeof(request_t *));
+
+    request_batch_t batch = { .cond = fiber_cond_new(), .done = NULL };
+    if (batch.cond == NULL)
+        return luaL_error(L, "can't allocate memory (fiber_cond_new)");
+
+    const double deadline = timeout > 0 ? fiber_clock() + timeout : 0;
+    size_t next = 0, active = 0, finished = 0;
+    const char *abort_reason = NULL;
+
+    while (finished < n) {
+
+        /* Fill the window {{{ */
+        while (active < concurrency && next < n) {
+
+            const char *reason = "unknown error";
+
+            request_t *r = new_request(ctx->curl_ctx);
+            /* Wait for a running request to free its slot of the pool */
+            if (r == NULL && active > 0)
+                break;
+            /* Nothing of the batch runs, so it waits in the queue */
+            if (r == NULL) {
+                double wait = queue_timeout;
+                if (deadline > 0 && deadline - fiber_clock() < wait)
+                    wait = deadline - fiber_clock();
+                r = wait_request(ctx->curl_ctx, priority, wait);
+                if (r == NULL && ctx->done) {
+                    abort_reason = "curl stopped";
+                    break;
+                }
+                /* The rest of the batch is late too */
+                if (r == NULL && deadline > 0 && fiber_clock() >= deadline) {
+                    abort_reason = "timeout";
+                    break;
+                }
+            }
+            if (r == NULL) {
+                set_batch_error(L, results, next,
+                                "can't get request obj from pool");
+                ++next;
+                ++finished;
+                continue;
+            }
+
+            const int top = lua_gettop(L);
+            lua_rawgeti(L, 2, (int) next + 1);
+            if (!lua_istable(L, top + 1)) {
+                reason = "a request has to be a table";
+                goto next_error;
+            }
+            lua_rawgeti(L, top + 1, 1);
+            lua_rawgeti(L, top + 1, 2);
+            lua_rawgeti(L, top + 1, 3);
+            lua_rawgeti(L, top + 1, 4);
+            if (!lua_isstring(L, top + 2) || !lua_isstring(L, top + 3)) {
+                reason = "a request has to be {method, url [, body [, options]]}";
+                goto next_error;
+            }
+
+            request_start_args_t req_args;
+            request_start_args_init(&req_args);
+
+            if (!request_prepare(L, r, lua_tostring(L, top + 2),
+                                 lua_tostring(L, top + 3), top + 4,
+                                 lua_istable(L, top + 5) ? top + 5 : 0,
+                                 &req_args, &reason))
+                goto next_error;
+
+            r->buffer_response = true;
+            r->sync.batch = &batch;
+            r->sync.index = next;
+
+            if (!request_submit(ctx, r, &req_args, &reason))
+                goto next_error;
+
+            lua_settop(L, top);
+            running[active++] = r;
+            ++next;
+            continue;
+
+next_error:
+            lua_settop(L, top);
+            free_request(ctx->curl_ctx, r);
+            set_batch_error(L, results, next, reason);
+            ++next;
+            ++finished;
+        }
+        /* }}} */
+
+        if (abort_reason != NULL)
+            break;
+
+        if (active == 0)
+            continue;
+
+        /* Wait for completions {{{ */
+        if (batch.done == NULL) {
+            double wait = TIMEOUT_INFINITY;
+            if (deadline > 0) {
+                wait = deadline - fiber_clock();
+                if (wait <= 0) {
+                    abort_reason = "timeout";
+                    break;
+                }
+            }
+            fiber_cond_wait_timeout(batch.cond, wait);
+            if (fiber_is_cancelled()) {
+                abort_reason = "fiber is cancelled";
+                break;
+            }
+        }
+
+        while (batch.done != NULL) {
+            request_t *r = batch.done;
+            batch.done = r->sync.next;
+
+            for (size_t i = 0; i < active; ++i) {
+                if (running[i] == r) {
+                    running[i] = running[--active];
+                    break;
+                }
+            }
+
+            finish_batch_request(L, ctx, results, r);
+            ++finished;
+        }
+        /* }}} */
+    }
+
+    if (abort_reason != NULL) {
+        /* Some of them may have completed while we were waiting */
+        for (size_t i = 0; i < active; ++i) {
+            if (running[i]->sync.done)
+                finish_batch_request(L, ctx, results, running[i]);
+            else {
+                set_batch_error(L, results, running[i]->sync.index,
+                                abort_reason);
+                request_abandon(ctx, running[i]);
+            }
+        }
+        for (; next < n; ++next)
+            set_batch_error(L, results, next, abort_reason);
+    }
+
+    fiber_cond_delete(batch.cond);
+
+    if (fiber_is_cancelled())
+        return luaL_error(L, "fiber is cancelled");
+
+    lua_settop(L, results);
+
+    return 1;
+}
+
+
+
+/** Stream API {{{
+ */
+
+/*
+   <stream> This function starts a HTTP request, the response body is read
+   by chunks through the returned reader
+
+    Parameters:
+
+        method  - HTTP method, like GET, POST, PUT and so on
+        url     - HTTP url, like https://tarantool.org/doc
+        options - a table of options, see <async_request>; the callbacks
+                  are ignored.
+
+            buffer_size - max number of bytes which are buffered for the
+                          reader (or the writer), the transfer is paused
+                          when it's reached;
+
+            upload - if it's true, the request body is passed by write()
+                     and finish(), the transfer is paused while no data is
+                     written;
+
+            body_size - the size of the uploaded body if it's known,
+                        otherwise it's sent chunked;
+
+        Returns:
+              stream object or error()
+*/
+static
+int
+stream_new(lua_State *L)
+{
+    const char *reason = "unknown error";
+
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
+
+    if (ctx->done)
+        return luaL_error(L, "curl stopped");
+
+    const char *method = luaL_checkstring(L, 2);
+    const char *url    = luaL_checkstring(L, 3);
+    const int  opts    = lua_istable(L, 4) ? 4 : 0;
+
+    size_t limit = STREAM_DEFAULT_BUFFER_SIZE;
+    if (opts != 0) {
+        lua_getfield(L, opts, "buffer_size");
+        if (!lua_isnil(L, -1))
+            limit = (size_t) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+    if (limit == 0)
+        return luaL_error(L, "buffer_size have to be greater than 0");
+
+    lib_stream_t *stream = (lib_stream_t *)
+            lua_newuserdata(L, sizeof(lib_stream_t));
+    if (stream == NULL)
+        return luaL_error(L, "lua_newuserdata failed: lib_stream_t");
+
+    stream->ctx        = ctx;
+    stream->ctx_ref    = LUA_REFNIL;
+    stream->r          = NULL;
+    stream->batch.cond = NULL;
+    stream->batch.done = NULL;
+
+    luaL_getmetatable(L, DRIVER_LUA_UDATA_STREAM_NAME);
+    lua_setmetatable(L, -2);
+
+    stream->batch.cond = fiber_cond_new();
+    if (stream->batch.cond == NULL)
+        return luaL_error(L, "can't allocate memory (fiber_cond_new)");
+
+    /* The curl object can't be collected while the stream is alive */
+    lua_pushvalue(L, 1);
+    stream->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    double queue_timeout;
+    const int priority = get_queue_options(L, ctx, opts, &queue_timeout);
+
+    request_t *r = wait_request(ctx->curl_ctx, priority, queue_timeout);
+    if (r == NULL)
+        return luaL_error(L, ctx->done ? "curl stopped" :
+                                         "can't get request obj from pool");
+
+    request_start_args_t req_args;
+    request_start_args_init(&req_args);
+
+    /* The body is written by write(), it's set up before the method */
+    if (opts != 0) {
+        lua_getfield(L, opts, "upload");
+        if (lua_toboolean(L, -1))
+            r->body_stream.limit = limit;
+        lua_pop(L, 1);
+
+        lua_getfield(L, opts, "body_size");
+        if (!lua_isnil(L, -1))
+            r->body_stream.size = (curl_off_t) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (!request_prepare(L, r, method, url, 0, opts, &req_args, &reason))
+        goto error_exit;
+
+    r->stream.limit = limit;
+    r->sync.batch = &stream->batch;
+
+    if (!request_submit(ctx, r, &req_args, &reason))
+        goto error_exit;
+
+    stream->r = r;
+
+    return 1;
+
+error_exit:
+    free_request(ctx->curl_ctx, r);
+    return luaL_error(L, reason);
+}
+
+
+/*
+   <read> This function returns the next chunk of the response body, it
+   yields the calling fiber until there is some data
+
+        Returns:
+              STRING, nil when the body is over or error()
+*/
+static
+int
+stream_read(lua_State *L)
+{
+    lib_stream_t *stream = stream_get(L);
+
+    for (;;) {
+
+        request_t *r = stream->r;
+        if (r == NULL || stream->ctx->done)
+            return luaL_error(L, "stream is closed");
+
+        if (r->response.size > 0) {
+            lua_pushlstring(L, r->response.data, r->response.size);
+            buffer_reset(&r->response, 2 * r->stream.limit);
+            /* curl passes the data which it has been holding right away */
+            if (r->stream.paused) {
+                r->stream.paused = false;
+                request_update_pause(r);
+            }
+            return 1;
+        }
+
+        if (r->sync.done) {
+            if (r->sync.curl_code != CURLE_OK)
+                return luaL_error(L, "curl has an internal error, msg = %s",
+                                  curl_easy_strerror(r->sync.curl_code));
+            lua_pushnil(L);
+            return 1;
+        }
+
+        fiber_cond_wait(stream->batch.cond);
+        if (fiber_is_cancelled())
+            return luaL_error(L, "fiber is cancelled");
+    }
+}
+
+
+/*
+   <write> This function passes the next chunk of the request body, it
+   yields the calling fiber while the body buffer is full
+
+        Returns:
+              true, false if the server has already responded or error()
+*/
 static
 int
-curl_ev_f(va_list ap)
+stream_write(lua_State *L)
 {
-    lib_ctx_t *ctx = va_arg(ap, lib_ctx_t *);
+    lib_stream_t *stream = stream_get(L);
 
-    fiber_set_cancellable(true);
+    size_t size;
+    const char *data = luaL_checklstring(L, 2, &size);
 
     for (;;) {
-        if (ctx->done)
-            break;
-        curl_poll_one(ctx->curl_ctx);
-        fiber_sleep(0.01);
+
+        request_t *r = stream->r;
+        if (r == NULL || stream->ctx->done)
+            return luaL_error(L, "stream is closed");
+
+        if (r->body_stream.limit == 0)
+            return luaL_error(L, "stream is not opened with upload");
+
+        if (r->body_stream.finished)
+            return luaL_error(L, "the body is finished");
+
+        /* Nobody reads the rest */
+        if (r->sync.done) {
+            if (r->sync.curl_code != CURLE_OK)
+                return luaL_error(L, "curl has an internal error, msg = %s",
+                                  curl_easy_strerror(r->sync.curl_code));
+            lua_pushboolean(L, false);
+            return 1;
+        }
+
+        buffer_t *b = &r->body_stream.buffer;
+        const size_t pending = b->size - r->body_stream.offset;
+        if (pending == 0 || pending + size <= r->body_stream.limit) {
+
+            if (r->body_stream.offset > 0) {
+                memmove(b->data, b->data + r->body_stream.offset, pending);
+                b->size = pending;
+                r->body_stream.offset = 0;
+            }
+
+            if (!buffer_append(b, data, size))
+                return luaL_error(L, "can't allocate memory (buffer_append)");
+
+            if (r->body_stream.paused && size > 0) {
+                r->body_stream.paused = false;
+                request_update_pause(r);
+            }
+
+            lua_pushboolean(L, true);
+            return 1;
+        }
+
+        fiber_cond_wait(stream->batch.cond);
+        if (fiber_is_cancelled())
+            return luaL_error(L, "fiber is cancelled");
+    }
+}
+
+
+/*
+   <finish> This function tells that the request body is over
+*/
+static
+int
+stream_finish(lua_State *L)
+{
+    lib_stream_t *stream = stream_get(L);
+
+    request_t *r = stream->r;
+    if (r == NULL || stream->ctx->done)
+        return luaL_error(L, "stream is closed");
+
+    if (r->body_stream.limit == 0)
+        return luaL_error(L, "stream is not opened with upload");
+
+    r->body_stream.finished = true;
+    if (r->body_stream.paused) {
+        r->body_stream.paused = false;
+        request_update_pause(r);
     }
 
+    return make_int_result(L, true, 0);
+}
+
+
+/*
+   <code> This function returns HTTP code of the response, it's 0 until
+   the response headers have arrived
+*/
+static
+int
+stream_code(lua_State *L)
+{
+    lib_stream_t *stream = stream_get(L);
+
+    request_t *r = stream->r;
+    if (r == NULL || stream->ctx->done)
+        return luaL_error(L, "stream is closed");
+
+    long http_code = r->sync.http_code;
+    if (!r->sync.done)
+        curl_easy_getinfo(r->easy, CURLINFO_RESPONSE_CODE, &http_code);
+
+    lua_pushinteger(L, http_code);
+    return 1;
+}
+
+
+/*
+   <headers> This function returns the response headers which have arrived,
+   the stream has to be opened with response_headers
+*/
+static
+int
+stream_headers(lua_State *L)
+{
+    lib_stream_t *stream = stream_get(L);
+
+    request_t *r = stream->r;
+    if (r == NULL || stream->ctx->done)
+        return luaL_error(L, "stream is closed");
+
+    if (!r->capture_headers)
+        return luaL_error(L, "stream is not opened with response_headers");
+
+    headers_push(L, r->response_headers.data, r->response_headers.size);
+    return 1;
+}
+
+
+/** Abort the transfer if it's still running, and free the request
+ */
+static
+void
+stream_do_close(lua_State *L, lib_stream_t *stream)
+{
+    if (stream->r != NULL && !stream->ctx->done)
+        free_request(stream->ctx->curl_ctx, stream->r);
+    stream->r = NULL;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, stream->ctx_ref);
+    stream->ctx_ref = LUA_REFNIL;
+
+    /* A reader which waits finds out that the stream is closed */
+    if (stream->batch.cond != NULL)
+        fiber_cond_broadcast(stream->batch.cond);
+}
+
+
+static
+int
+stream_close(lua_State *L)
+{
+    stream_do_close(L, stream_get(L));
+    return make_int_result(L, true, 0);
+}
+
+
+static
+int
+stream_gc(lua_State *L)
+{
+    lib_stream_t *stream = stream_get(L);
+
+    stream_do_close(L, stream);
+
+    /* Nobody waits on it, a waiting reader holds the stream */
+    if (stream->batch.cond != NULL)
+        fiber_cond_delete(stream->batch.cond);
+    stream->batch.cond = NULL;
+
     return 0;
 }
+/* }}} */
+
+static
+int
+get_stat(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
+
+    curl_ctx_t *l = ctx->curl_ctx;
+    if (l == NULL)
+        return luaL_error(L, "it doesn't initialized");
+
+    lua_newtable(L);
+
+    add_field_u64(L, "active_requests", (uint64_t) l->stat.active_requests);
+    add_field_u64(L, "sockets_added", (uint64_t) l->stat.sockets_added);
+    add_field_u64(L, "sockets_deleted", (uint64_t) l->stat.sockets_deleted);
+    add_field_u64(L, "loop_calls", (uint64_t) l->stat.loop_calls);
+    add_field_u64(L, "total_requests", l->stat.total_requests);
+    add_field_u64(L, "http_200_responses",  l->stat.http_200_responses);
+    add_field_u64(L, "http_other_responses", l->stat.http_other_responses);
+    add_field_u64(L, "failed_requests", (uint64_t) l->stat.failed_requests);
+    add_field_u64(L, "coalesced_requests", l->stat.coalesced_requests);
+    add_field_u64(L, "retries", l->stat.retries);
+    add_field_u64(L, "retries_throttled", l->stat.retries_throttled);
+    add_field_u64(L, "hedges", l->stat.hedges);
+    add_field_u64(L, "hedges_won", l->stat.hedges_won);
+    add_field_u64(L, "hedges_throttled", l->stat.hedges_throttled);
+    add_field_u64(L, "breaker_rejections", l->stat.breaker_rejections);
+
+    if (l->cache != NULL) {
+        add_field_u64(L, "cache_hits", l->cache->stat.hits);
+        add_field_u64(L, "cache_stale_hits", l->cache->stat.stale_hits);
+        add_field_u64(L, "cache_misses", l->cache->stat.misses);
+        add_field_u64(L, "cache_revalidations",
+                      l->cache->stat.revalidations);
+        add_field_u64(L, "cache_stores", l->cache->stat.stores);
+        add_field_u64(L, "cache_evictions", l->cache->stat.evictions);
+        add_field_u64(L, "cache_entries", (uint64_t) l->cache->count);
+        add_field_u64(L, "cache_size", (uint64_t) l->cache->size);
+    }
+
+    lua_pushstring(L, "timing");
+    lua_createtable(L, 0, 5);
+    add_field_timing(L, "namelookup", &l->stat.timing.namelookup);
+    add_field_timing(L, "connect", &l->stat.timing.connect);
+    add_field_timing(L, "appconnect", &l->stat.timing.appconnect);
+    add_field_timing(L, "starttransfer", &l->stat.timing.starttransfer);
+    add_field_timing(L, "total", &l->stat.timing.total);
+    lua_settable(L, -3);
+
+    return 1;
+}
 
 
 /*
-   <async_request> This function does async HTTP request
+   <host_stat> This function returns statistics of each upstream
 
-    Parameters:
+        Returns:
+              {['scheme://host:port'] = {requests, errors, active_requests,
+                                         bytes_in, bytes_out,
+                                         connections_new, connections_reused,
+                                         latency = {count, p50, p90, p99,
+                                                    p999}}, ...}
+*/
+static
+int
+host_stat(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
 
-        method  - HTTP method, like GET, POST, PUT and so on
-        url     - HTTP url, like https://tarantool.org/doc
-        options - this is a table of options.
+    curl_ctx_t *l = ctx->curl_ctx;
+    if (l == NULL)
+        return luaL_error(L, "it doesn't initialized");
 
-            done - name of a callback function which is invoked when a request
-                   was completed;
+    lua_createtable(L, 0, (int) l->hosts.size);
+
+    for (size_t i = 0; i < l->hosts.capacity; ++i) {
+        const host_stat_t *h = l->hosts.slots[i];
+        if (h == NULL)
+            continue;
+
+        lua_pushstring(L, h->key);
+        lua_createtable(L, 0, 8);
+        add_field_u64(L, "requests", h->requests);
+        add_field_u64(L, "errors", h->errors);
+        add_field_u64(L, "active_requests", (uint64_t) h->active_requests);
+        add_field_u64(L, "bytes_in", h->bytes_in);
+        add_field_u64(L, "bytes_out", h->bytes_out);
+        add_field_u64(L, "connections_new", h->connections_new);
+        add_field_u64(L, "connections_reused", h->connections_reused);
+        add_field_u64(L, "running_requests", (uint64_t) h->limiter.running);
+        add_field_u64(L, "queued_requests", (uint64_t) h->limiter.queued);
+        add_field_u64(L, "delayed_requests", h->limiter.delayed);
+        add_field_timing(L, "latency", &h->latency);
+        lua_pushstring(L, breaker_state_name(h->breaker.state));
+        lua_setfield(L, -2, "breaker");
+        add_field_u64(L, "breaker_opened", h->breaker.stat.opened);
+        add_field_u64(L, "breaker_half_opened", h->breaker.stat.half_opened);
+        add_field_u64(L, "breaker_closed", h->breaker.stat.closed);
+        add_field_u64(L, "breaker_rejected", h->breaker.stat.rejected);
+        lua_settable(L, -3);
+    }
 
-            write - name of a callback function which is invoked if the
-                    server returns data to the client;
-                    signature is function(data, context)
+    return 1;
+}
 
-            read - name of a callback function which is invoked if the
-                   client passes data to the server.
-                   signature is function(content_size, context)
 
-            done - name of a callback function which is invoked when a request
-                   was completed;
-                   signature is  function(curl_code, http_code, error_message, ctx)
+/** Read {max_requests, rate, burst} at 'idx'
+ */
+static
+void
+get_host_limit(lua_State *L, int idx, host_limit_t *limit)
+{
+    lua_getfield(L, idx, "max_requests");
+    limit->max_requests = (size_t) luaL_optlong(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "rate");
+    limit->rate = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
+
+    /* A second's worth of requests by default */
+    lua_getfield(L, idx, "burst");
+    limit->burst = luaL_optnumber(L, -1, limit->rate);
+    lua_pop(L, 1);
+}
 
-            ca_path - a path to ssl certificate dir;
 
-            ca_file - a path to ssl certificate file;
+/** Read {window, min_requests, error_rate, timeout_rate, open_time, probes}
+ *  at 'idx'
+ */
+static
+void
+get_breaker_config(lua_State *L, int idx, breaker_config_t *c)
+{
+    lua_getfield(L, idx, "window");
+    c->window = luaL_optnumber(L, -1, 10);
+    lua_pop(L, 1);
 
-            headers - a table of HTTP headers;
+    lua_getfield(L, idx, "min_requests");
+    c->min_requests = (size_t) luaL_optlong(L, -1, 20);
+    lua_pop(L, 1);
 
-            max_conns - max amount of cached alive connections;
+    lua_getfield(L, idx, "error_rate");
+    c->error_rate = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
 
-            keepalive_idle & keepalive_interval - non-universal keepalive knobs (Linux, AIX, HP-UX, more);
+    lua_getfield(L, idx, "timeout_rate");
+    c->timeout_rate = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
 
-            low_speed_time & low_speed_limit - If the download receives less than "low speed limit" bytes/second
-                                               during "low speed time" seconds, the operations is aborted.
-                                               You could i.e if you have a pretty high speed connection, abort if
-                                               it is less than 2000 bytes/sec during 20 seconds;
+    lua_getfield(L, idx, "open_time");
+    c->open_time = luaL_optnumber(L, -1, 5);
+    lua_pop(L, 1);
 
-            read_timeout - Time-out the read operation after this amount of seconds;
+    lua_getfield(L, idx, "probes");
+    c->probes = (size_t) luaL_optlong(L, -1, 1);
+    lua_pop(L, 1);
+}
 
-            connect_timeout  - Time-out connect operations after this amount of seconds, if connects are;
-                               OK within this time, then fine... This only aborts the connect phase;
 
-            dns_cache_timeout - DNS cache timeout;
+/*
+   <set_circuit_breaker> This function sets the circuit breaker of an
+   upstream, its requests fail at once while it's open
 
-            curl_verbose - make libcurl verbose!;
+    Parameters:
+
+        url     - any url of the upstream, e.g. https://tarantool.org
+        config  - {window = 10, min_requests = 20, error_rate = 0,
+                   timeout_rate = 0, open_time = 5, probes = 1},
+                  it's off if neither rate is set
 
         Returns:
-              bool, msg or error()
+              true or error()
 */
 static
 int
-async_request(lua_State *L)
+set_circuit_breaker(lua_State *L)
 {
-    const char *reason = "unknown error";
-
     lib_ctx_t *ctx = ctx_get(L);
     if (ctx == NULL)
         return luaL_error(L, "can't get lib ctx");
 
-    if (ctx->done)
-        return luaL_error(L, "curl stopped");
-
-    request_t *r = new_request(ctx->curl_ctx);
-    if (r == NULL)
-        return luaL_error(L, "can't get request obj from pool");
+    curl_ctx_t *l = ctx->curl_ctx;
+    if (l == NULL)
+        return luaL_error(L, "it doesn't initialized");
 
-    request_start_args_t req_args;
-    request_start_args_init(&req_args);
+    const char *url = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
 
-    const char *method = luaL_checkstring(L, 2);
-    const char *url    = luaL_checkstring(L, 3);
+    breaker_config_t config;
+    get_breaker_config(L, 3, &config);
 
-    /** Set Options {{{
-     */
-    if (lua_istable(L, 4)) {
+    if (!curl_set_breaker(l, url, &config))
+        return luaL_error(L, "can't allocate memory (curl_set_breaker)");
 
-        const int top = lua_gettop(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-        r->lua_ctx.L = L;
 
-        /* Read callback */
-        lua_pushstring(L, "read");
-        lua_gettable(L, 4);
-        if (lua_isfunction(L, top + 1))
-            r->lua_ctx.read_fn = luaL_ref(L, LUA_REGISTRYINDEX);
-        else
-            lua_pop(L, 1);
+/*
+   <set_host_limit> This function sets the limits of an upstream, requests
+   which exceed them are delayed
 
-        /* Write callback */
-        lua_pushstring(L, "write");
-        lua_gettable(L, 4);
-        if (lua_isfunction(L, top + 1))
-            r->lua_ctx.write_fn = luaL_ref(L, LUA_REGISTRYINDEX);
-        else
-            lua_pop(L, 1);
+    Parameters:
 
-        /* Done callback */
-        lua_pushstring(L, "done");
-        lua_gettable(L, 4);
-        if (lua_isfunction(L, top + 1))
-            r->lua_ctx.done_fn = luaL_ref(L, LUA_REGISTRYINDEX);
-        else
-            lua_pop(L, 1);
+        url     - any url of the upstream, e.g. https://tarantool.org
+        limits  - {max_requests = NUMBER, rate = NUMBER, burst = NUMBER},
+                  0 or nil - unlimited
 
-        /* callback's context */
-        lua_pushstring(L, "ctx");
-        lua_gettable(L, 4);
-        r->lua_ctx.fn_ctx = luaL_ref(L, LUA_REGISTRYINDEX);
+        Returns:
+              true or error()
+*/
+static
+int
+set_host_limit(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
 
-        /** Http headers */
-        lua_pushstring(L, "headers");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1)) {
-            lua_pushnil(L);
-            char header[4096];
-            while (lua_next(L, -2) != 0) {
-                snprintf(header, sizeof(header) - 1,
-                        "%s: %s", lua_tostring(L, -2), lua_tostring(L, -1));
-                if (!request_add_header(r, header)) {
-                    reason = "can't allocate memory (request_add_header)";
-                    goto error_exit;
-                }
-                lua_pop(L, 1);
-            } // while
-        }
-        lua_pop(L, 1);
+    curl_ctx_t *l = ctx->curl_ctx;
+    if (l == NULL)
+        return luaL_error(L, "it doesn't initialized");
 
-        /* SSL/TLS cert  {{{ */
-        lua_pushstring(L, "ca_path");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            curl_easy_setopt(r->easy, CURLOPT_CAPATH,
-                             lua_tostring(L, top + 1));
-        lua_pop(L, 1);
+    const char *url = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
 
-        lua_pushstring(L, "ca_file");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            curl_easy_setopt(r->easy, CURLOPT_CAINFO,
-                             lua_tostring(L, top + 1));
-        lua_pop(L, 1);
-        /* }}} */
+    host_limit_t limit;
+    get_host_limit(L, 3, &limit);
 
-        lua_pushstring(L, "max_conns");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.max_conns = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
+    if (!curl_set_host_limit(l, url, &limit))
+        return luaL_error(L, "can't allocate memory (curl_set_host_limit)");
 
-        lua_pushstring(L, "keepalive_idle");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.keepalive_idle = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-        lua_pushstring(L, "keepalive_interval");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.keepalive_interval = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
 
-        lua_pushstring(L, "low_speed_limit");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.low_speed_limit = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
+/*
+   <add_upstream> This function adds a named group of peers, requests to
+   upstream://name/path are sent to one of them
 
-        lua_pushstring(L, "low_speed_time");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.low_speed_time = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
+    Parameters:
 
-        lua_pushstring(L, "read_timeout");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.read_timeout = (long) floor(lua_tonumber(L, top + 1) * 1000);
-        lua_pop(L, 1);
+        name    - the name of the group
+        opts    - {
+                    urls = {'http://10.0.0.1:8080', ...},
+                    policy = 'round_robin' | 'least_requests' | 'hash',
+                    max_errors = 5,
+                    eject_time = 10,
+                    max_latency = 0,
+                    circuit_breaker = nil,
+                  }
+
+                  'hash' uses the option hash_key of a request, the path
+                  by default. A peer is ejected for eject_time seconds
+                  after max_errors failures (an error of curl, 5xx or
+                  a response slower than max_latency seconds) in a row,
+                  max_errors = 0 turns it off. circuit_breaker is set for
+                  each peer, see <set_circuit_breaker>.
 
-        lua_pushstring(L, "connect_timeout");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.connect_timeout = (long) floor(lua_tonumber(L, top + 1) * 1000);
-        lua_pop(L, 1);
+        Returns:
+              true or error()
+*/
+static
+int
+add_upstream(lua_State *L)
+{
+    lib_ctx_t *ctx = ctx_get(L);
+    if (ctx == NULL)
+        return luaL_error(L, "can't get lib ctx");
 
-        lua_pushstring(L, "dns_cache_timeout");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1))
-            req_args.dns_cache_timeout = (long) lua_tointeger(L, top + 1);
-        lua_pop(L, 1);
+    curl_ctx_t *l = ctx->curl_ctx;
+    if (l == NULL)
+        return luaL_error(L, "it doesn't initialized");
 
-        /* Debug- / Internal- options */
-        lua_pushstring(L, "curl_verbose");
-        lua_gettable(L, 4);
-        if (!lua_isnil(L, top + 1) && lua_isboolean(L, top + 1))
-            req_args.curl_verbose = true;
+    size_t name_size;
+    const char *name = luaL_checklstring(L, 2, &name_size);
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    if (name_size == 0 || strchr(name, '/') != NULL)
+        return luaL_error(L, "invalid upstream name");
+    if (upstream_find(l->upstreams, name, name_size) != NULL)
+        return luaL_error(L, "upstream '%s' already exists", name);
+
+    upstream_policy_t policy = UPSTREAM_ROUND_ROBIN;
+    lua_getfield(L, 3, "policy");
+    const char *s = lua_tostring(L, -1);
+    if (s == NULL || strcmp(s, "round_robin") == 0)
+        policy = UPSTREAM_ROUND_ROBIN;
+    else if (strcmp(s, "least_requests") == 0)
+        policy = UPSTREAM_LEAST_REQUESTS;
+    else if (strcmp(s, "hash") == 0)
+        policy = UPSTREAM_HASH;
+    else
+        return luaL_error(L, "invalid upstream policy '%s'", s);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 3, "urls");
+    const size_t nurls = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+    if (nurls == 0)
+        return luaL_error(L, "upstream needs a non-empty list of urls");
+
+    /* The strings stay referenced by the table until upstream_new() */
+    const char **urls = (const char **) lua_newuserdata(L,
+                                            nurls * sizeof(const char *));
+    for (size_t i = 0; i < nurls; ++i) {
+        lua_rawgeti(L, -2, (int) i + 1);
+        urls[i] = lua_tostring(L, -1);
         lua_pop(L, 1);
-    } else {
-        reason = "4-arg have to be a table";
-        goto error_exit;
+        if (urls[i] == NULL)
+            return luaL_error(L, "upstream urls have to be strings");
     }
-    /* }}} */
 
-    curl_easy_setopt(r->easy, CURLOPT_PRIVATE, (void *) r);
+    upstream_t *u = upstream_new(name, policy, urls, nurls);
+    lua_pop(L, 2);
+    if (u == NULL)
+        return luaL_error(L, "can't allocate memory (upstream_new)");
 
-    curl_easy_setopt(r->easy, CURLOPT_URL, url);
-    curl_easy_setopt(r->easy, CURLOPT_FOLLOWLOCATION, 1);
+    lua_getfield(L, 3, "max_errors");
+    u->max_errors = (size_t) luaL_optlong(L, -1, 5);
+    lua_pop(L, 1);
 
-    curl_easy_setopt(r->easy, CURLOPT_SSL_VERIFYPEER, 1);
+    lua_getfield(L, 3, "eject_time");
+    u->eject_time = luaL_optnumber(L, -1, 10);
+    lua_pop(L, 1);
 
-    /* Method {{{ */
+    lua_getfield(L, 3, "max_latency");
+    u->max_latency = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 1);
 
-    if (*method == 'G') {
-      curl_easy_setopt(r->easy, CURLOPT_HTTPGET, 1);
-    }
-    else if (strcmp(method, "POST") == 0) {
-        if (!request_set_post(r)) {
-            reason = "can't allocate memory (request_set_post)";
-            goto error_exit;
-        }
+    if (!curl_add_upstream(l, u)) {
+        upstream_delete(u);
+        return luaL_error(L, "can't allocate memory (curl_add_upstream)");
     }
-    else if (strcmp(method, "PUT") == 0) {
-        if (!request_set_put(r)) {
-            reason = "can't allocate memory (request_set_put)";
-            goto error_exit;
+
+    lua_getfield(L, 3, "circuit_breaker");
+    if (lua_istable(L, -1)) {
+        breaker_config_t config;
+        get_breaker_config(L, lua_gettop(L), &config);
+        for (size_t i = 0; i < u->npeers; ++i) {
+            if (!curl_set_breaker(l, u->peers[i].url, &config))
+                return luaL_error(L, "can't allocate memory "
+                                     "(curl_set_breaker)");
         }
-    } else {
-        reason = "method does not supported";
-        goto error_exit;
     }
-    /* }}} */
-
-    /* Note that the add_handle() will set a
-     * time-out to trigger very soon so that
-     * the necessary socket_action() call will be
-     * called by this app */
-    CURLMcode rc = request_start(r, &req_args);
-    if (rc != CURLM_OK)
-        goto error_exit;
+    lua_pop(L, 1);
 
-    return curl_make_result(L, CURL_LAST, rc);
-
-error_exit:
-    free_request(ctx->curl_ctx, r);
-    return luaL_error(L, reason);
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 
 static
 int
-get_stat(lua_State *L)
+upstream_stat(lua_State *L)
 {
     lib_ctx_t *ctx = ctx_get(L);
     if (ctx == NULL)
@@ -315,16 +2326,27 @@ get_stat(lua_State *L)
     if (l == NULL)
         return luaL_error(L, "it doesn't initialized");
 
+    const double now = fiber_clock();
+
     lua_newtable(L);
 
-    add_field_u64(L, "active_requests", (uint64_t) l->stat.active_requests);
-    add_field_u64(L, "sockets_added", (uint64_t) l->stat.sockets_added);
-    add_field_u64(L, "sockets_deleted", (uint64_t) l->stat.sockets_deleted);
-    add_field_u64(L, "loop_calls", (uint64_t) l->stat.loop_calls);
-    add_field_u64(L, "total_requests", l->stat.total_requests);
-    add_field_u64(L, "http_200_responses",  l->stat.http_200_responses);
-    add_field_u64(L, "http_other_responses", l->stat.http_other_responses);
-    add_field_u64(L, "failed_requests", (uint64_t) l->stat.failed_requests);
+    for (const upstream_t *u = l->upstreams; u != NULL; u = u->next) {
+        lua_pushstring(L, u->name);
+        lua_createtable(L, (int) u->npeers, 0);
+        for (size_t i = 0; i < u->npeers; ++i) {
+            const upstream_peer_t *p = &u->peers[i];
+            lua_createtable(L, 0, 4);
+            lua_pushstring(L, p->url);
+            lua_setfield(L, -2, "url");
+            lua_pushboolean(L, upstream_peer_ejected(u, p, now));
+            lua_setfield(L, -2, "ejected");
+            add_field_u64(L, "ejections", p->ejections);
+            add_field_u64(L, "active_requests",
+                          (uint64_t) p->host->active_requests);
+            lua_rawseti(L, -2, (int) i + 1);
+        }
+        lua_settable(L, -3);
+    }
 
     return 1;
 }
@@ -346,6 +2368,15 @@ pool_stat(lua_State *L)
 
     add_field_u64(L, "pool_size", (uint64_t) l->cpool.size);
     add_field_u64(L, "free", (uint64_t) request_pool_get_free_size(&l->cpool));
+    add_field_u64(L, "allocated", (uint64_t) l->cpool.allocated);
+
+    const request_queue_t *q = &l->cpool.queue;
+    add_field_u64(L, "queue_size", (uint64_t) q->size);
+    add_field_u64(L, "queue_waits", q->stat.waits);
+    add_field_u64(L, "queue_rejections", q->stat.rejections);
+    add_field_u64(L, "queue_timeouts", q->stat.timeouts);
+    add_field_u64(L, "queue_cancellations", q->stat.cancellations);
+    add_field_timing(L, "queue_wait", &q->stat.wait_time);
 
     return 1;
 }
@@ -358,21 +2389,17 @@ int
 version(lua_State *L)
 {
   char version[sizeof("tarantool.curl: xxx.xxx.xxx") +
-               sizeof("curl: xxx.xxx.xxx,") +
-               sizeof("libev: xxx.xxx") ];
+               sizeof("curl: xxx.xxx.xxx") ];
 
   snprintf(version, sizeof(version) - 1,
-            "tarantool.curl: %i.%i.%i, curl: %i.%i.%i, libev: %i.%i",
+            "tarantool.curl: %i.%i.%i, curl: %i.%i.%i",
             TNT_CURL_VERSION_MAJOR,
             TNT_CURL_VERSION_MINOR,
             TNT_CURL_VERSION_PATCH,
 
             LIBCURL_VERSION_MAJOR,
             LIBCURL_VERSION_MINOR,
-            LIBCURL_VERSION_PATCH,
-
-            EV_VERSION_MAJOR,
-            EV_VERSION_MINOR );
+            LIBCURL_VERSION_PATCH );
 
   return make_str_result(L, true, version);
 }
@@ -381,54 +2408,81 @@ version(lua_State *L)
 /** lib API {{{
  */
 
-static void do_free_(lib_ctx_t *ctx);
-
 static
 int
 new(lua_State *L)
 {
-    const char *reason = "unknown error";
-
     lib_ctx_t *ctx = (lib_ctx_t *)
             lua_newuserdata(L, sizeof(lib_ctx_t));
     if (ctx == NULL)
         return luaL_error(L, "lua_newuserdata failed: lib_ctx_t");
 
     ctx->curl_ctx = NULL;
-    ctx->fiber   = NULL;
-    ctx->done    = false;
+    ctx->done     = false;
 
     curl_args_t args = { .pipeline = false,
                          .max_conns = 5,
-                         .pool_size = 10000 };
+                         .pool_size = 10000,
+                         .keep_options = false,
+                         .multiplex = false,
+                         .max_concurrent_streams = 0,
+                         .share = NULL,
+                         .threads = 0,
+                         .cache_size = 0,
+                         .queue_size = 0,
+                         .queue_timeout = 0,
+                         .max_host_connections = 0,
+                         .max_total_connections = 0,
+                         .host_limit = { 0, 0, 0 },
+                         .retry_budget = 0,
+                         .hedge_budget = 0,
+                         .breaker = { 0, 0, 0, 0, 0, 0 } };
 
     /* pipeline: 1 - on, 0 - off */
     args.pipeline  = (bool) luaL_checkint(L, 1);
     args.max_conns = luaL_checklong(L, 2);
     args.pool_size = (size_t) luaL_checklong(L, 3);
+    args.keep_options = (bool) lua_toboolean(L, 4);
+    args.multiplex = (bool) lua_toboolean(L, 5);
+    args.max_concurrent_streams = luaL_optlong(L, 6, 0);
+
+    if (!lua_isnoneornil(L, 7)) {
+        lib_share_t *share = share_get(L, 7);
+        if (share->share == NULL)
+            return luaL_error(L, "share is freed");
+        args.share = share->share;
+    }
+
+    args.threads = (size_t) luaL_optlong(L, 8, 0);
+    if (args.threads > 0) {
+#if !defined (HAVE_CURL_WORKERS)
+        return luaL_error(L, "curl is too old for threads");
+#endif
+        /* The share's callbacks don't lock */
+        if (args.share != NULL)
+            return luaL_error(L, "share can't be used with threads");
+    }
+
+    args.cache_size = (size_t) luaL_optlong(L, 9, 0);
+    args.queue_size = (size_t) luaL_optlong(L, 10, 0);
+    args.queue_timeout = luaL_optnumber(L, 11, 1);
+    args.max_host_connections = luaL_optlong(L, 12, 0);
+    args.max_total_connections = luaL_optlong(L, 13, 0);
+    if (lua_istable(L, 14))
+        get_host_limit(L, 14, &args.host_limit);
+    args.retry_budget = luaL_optnumber(L, 15, 0.1);
+    args.hedge_budget = luaL_optnumber(L, 16, 0.05);
+    if (lua_istable(L, 17))
+        get_breaker_config(L, 17, &args.breaker);
 
     ctx->curl_ctx = curl_ctx_new(&args);
     if (ctx->curl_ctx == NULL)
         return luaL_error(L, "curl_new failed");
 
-    ctx->fiber = fiber_new("__curl_ev_fiber", curl_ev_f);
-    if (ctx->fiber == NULL) {
-        reason = "can't create new fiber: __curl_ev_fiber";
-        goto error_exit;
-    }
-
-    /* Run fibers */
-    fiber_set_joinable(ctx->fiber, true);
-    fiber_start(ctx->fiber, (void *) ctx);
-
     luaL_getmetatable(L, DRIVER_LUA_UDATA_NAME);
     lua_setmetatable(L, -2);
 
     return 1;
-
-error_exit:
-    do_free_(ctx);
-    return luaL_error(L, reason);
 }
 
 
@@ -441,10 +2495,8 @@ do_free_(lib_ctx_t *ctx)
 
     ctx->done = true;
 
-    if (ctx->fiber)
-        fiber_join(ctx->fiber);
-
     curl_destroy(ctx->curl_ctx);
+    ctx->curl_ctx = NULL;
 }
 
 
@@ -462,6 +2514,74 @@ cleanup(lua_State *L)
 }
 
 
+/** Share API {{{
+ */
+static
+int
+share_new(lua_State *L)
+{
+    curl_share_args_t args = { .dns = lua_toboolean(L, 1),
+                               .ssl_session = lua_toboolean(L, 2),
+                               .connect = lua_toboolean(L, 3) };
+
+    lib_share_t *share = (lib_share_t *)
+            lua_newuserdata(L, sizeof(lib_share_t));
+    if (share == NULL)
+        return luaL_error(L, "lua_newuserdata failed: lib_share_t");
+
+    share->share = curl_share_ctx_new(&args);
+    if (share->share == NULL)
+        return luaL_error(L, "curl_share_ctx_new failed");
+
+    luaL_getmetatable(L, DRIVER_LUA_UDATA_SHARE_NAME);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+static
+int
+share_stat(lua_State *L)
+{
+    lib_share_t *share = share_get(L, 1);
+
+    curl_share_ctx_t *s = share->share;
+    if (s == NULL)
+        return luaL_error(L, "it doesn't initialized");
+
+    lua_newtable(L);
+
+    add_field_u64(L, "instances", (uint64_t) s->refs);
+    add_field_u64(L, "dns_lock_calls", s->stat.dns_lock_calls);
+    add_field_u64(L, "ssl_session_lock_calls", s->stat.ssl_session_lock_calls);
+    add_field_u64(L, "connect_lock_calls", s->stat.connect_lock_calls);
+    add_field_u64(L, "connections_reused", s->stat.connections_reused);
+    add_field_u64(L, "connections_new", s->stat.connections_new);
+
+    return 1;
+}
+
+
+static
+int
+share_cleanup(lua_State *L)
+{
+    lib_share_t *share = share_get(L, 1);
+
+    if (!curl_share_ctx_destroy(share->share))
+        return luaL_error(L, "share is used by curl instances");
+    share->share = NULL;
+
+    /* remove all methods operating on share */
+    lua_newtable(L);
+    lua_setmetatable(L, -2);
+
+    return make_int_result(L, true, 0);
+}
+/* }}} */
+
+
 /*
  * Lists of exporting: object and/or functions to the Lua
  */
@@ -469,17 +2589,43 @@ cleanup(lua_State *L)
 static const struct luaL_Reg R[] = {
     {"version", version},
     {"new",     new},
+    {"share",   share_new},
     {NULL,      NULL}
 };
 
 static const struct luaL_Reg M[] = {
     {"async_request", async_request},
+    {"request",       sync_request},
+    {"request_many",  request_many},
+    {"stream",        stream_new},
     {"stat",          get_stat},
     {"pool_stat",     pool_stat},
+    {"host_stat",     host_stat},
+    {"set_host_limit", set_host_limit},
+    {"set_circuit_breaker", set_circuit_breaker},
+    {"add_upstream",  add_upstream},
+    {"upstream_stat", upstream_stat},
     {"free",          cleanup /* free already exists */},
     {NULL,            NULL}
 };
 
+static const struct luaL_Reg T[] = {
+    {"read",          stream_read},
+    {"write",         stream_write},
+    {"finish",        stream_finish},
+    {"code",          stream_code},
+    {"headers",       stream_headers},
+    {"close",         stream_close},
+    {"__gc",          stream_gc},
+    {NULL,            NULL}
+};
+
+static const struct luaL_Reg S[] = {
+    {"stat",          share_stat},
+    {"free",          share_cleanup},
+    {NULL,            NULL}
+};
+
 
 /*
  * Lib initializer
@@ -491,6 +2637,20 @@ luaopen_curl_driver(lua_State *L)
     /*
         Add metatable.__index = metatable
     */
+    luaL_newmetatable(L, DRIVER_LUA_UDATA_SHARE_NAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, S);
+    lua_pop(L, 1);
+
+    headers_register(L);
+
+    luaL_newmetatable(L, DRIVER_LUA_UDATA_STREAM_NAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, T);
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, DRIVER_LUA_UDATA_NAME);
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
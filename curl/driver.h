@@ -39,6 +39,9 @@
  * Unique name for userdata metatables
  */
 #define DRIVER_LUA_UDATA_NAME	"__tnt_curl"
+#define DRIVER_LUA_UDATA_SHARE_NAME	"__tnt_curl_share"
+#define DRIVER_LUA_UDATA_STREAM_NAME	"__tnt_curl_stream"
+#define STREAM_DEFAULT_BUFFER_SIZE (1024 * 1024)
 #define WORK_TIMEOUT 0.3
 #define TNT_CURL_VERSION_MAJOR 2
 #define TNT_CURL_VERSION_MINOR 3
@@ -46,11 +49,25 @@
 
 typedef struct  {
     curl_ctx_t   *curl_ctx;
-    struct fiber *fiber;
     bool         done;
 } lib_ctx_t;
 
 
+typedef struct  {
+    curl_share_ctx_t *share;
+} lib_share_t;
+
+
+/** A reader of a streamed response, it keeps the curl object alive
+ */
+typedef struct  {
+    lib_ctx_t       *ctx;
+    int             ctx_ref;
+    request_t       *r;
+    request_batch_t batch;
+} lib_stream_t;
+
+
 static inline
 lib_ctx_t*
 ctx_get(lua_State *L)
@@ -59,6 +76,22 @@ ctx_get(lua_State *L)
       luaL_checkudata(L, 1, DRIVER_LUA_UDATA_NAME);
 }
 
+static inline
+lib_share_t*
+share_get(lua_State *L, int idx)
+{
+  return (lib_share_t *)
+      luaL_checkudata(L, idx, DRIVER_LUA_UDATA_SHARE_NAME);
+}
+
+static inline
+lib_stream_t*
+stream_get(lua_State *L)
+{
+  return (lib_stream_t *)
+      luaL_checkudata(L, 1, DRIVER_LUA_UDATA_STREAM_NAME);
+}
+
 static inline
 int
 curl_make_result(lua_State *L, CURLcode code, CURLMcode mcode)
@@ -82,4 +115,30 @@ add_field_u64(lua_State *L, const char *key, uint64_t value)
     lua_settable(L, -3);  /* 3rd element from the stack top */
 }
 
+/* {count, p50, p90, p99, p999}, percentiles are in seconds */
+static inline
+void
+add_field_timing(lua_State *L, const char *key, const histogram_t *h)
+{
+    lua_pushstring(L, key);
+    lua_createtable(L, 0, 5);
+
+    add_field_u64(L, "count", h->count);
+
+    static const struct {
+        const char *key;
+        double     q;
+    } percentiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+    };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        lua_pushstring(L, percentiles[i].key);
+        lua_pushnumber(L, (double) histogram_percentile(h, percentiles[i].q)
+                          / 1000000);
+        lua_settable(L, -3);
+    }
+
+    lua_settable(L, -3);
+}
+
 #endif /* DRIVER_H_INCLUDED */
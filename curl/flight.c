@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+
+#define FLIGHT_MIN_BUCKETS 64
+
+
+bool
+flight_table_init(flight_table_t *t)
+{
+    assert(t);
+
+    t->buckets = (hash_link_t **)
+            calloc(FLIGHT_MIN_BUCKETS, sizeof(hash_link_t *));
+    if (t->buckets == NULL)
+        return false;
+
+    t->nbuckets = FLIGHT_MIN_BUCKETS;
+    t->count = 0;
+
+    return true;
+}
+
+
+void
+flight_table_free(flight_table_t *t)
+{
+    assert(t);
+
+    for (size_t i = 0; i < t->nbuckets && t->buckets != NULL; ++i) {
+        while (t->buckets[i] != NULL) {
+            flight_t *f = (flight_t *) t->buckets[i];
+            flight_unlink(t, f);
+            if (!f->done) {
+                f->done = true;
+                f->curl_code = CURLE_ABORTED_BY_CALLBACK;
+                fiber_cond_broadcast(f->cond);
+                flight_unref(f);
+            }
+        }
+    }
+
+    free(t->buckets);
+    t->buckets = NULL;
+    t->nbuckets = 0;
+}
+
+
+flight_t*
+flight_find(flight_table_t *t, const char *key, size_t key_size)
+{
+    assert(t);
+
+    const size_t hash = (size_t) fnv1a(key, key_size);
+
+    hash_link_t *l = t->buckets[hash & (t->nbuckets - 1)];
+    for (; l != NULL; l = l->next) {
+        flight_t *f = (flight_t *) l;
+        if (l->hash == hash && f->key_size == key_size &&
+            memcmp(f->key, key, key_size) == 0)
+            return f;
+    }
+
+    return NULL;
+}
+
+
+flight_t*
+flight_new(flight_table_t *t, const char *key, size_t key_size)
+{
+    assert(t);
+
+    flight_t *f = (flight_t *) calloc(1, sizeof(flight_t) + key_size);
+    if (f == NULL)
+        return NULL;
+
+    f->cond = fiber_cond_new();
+    if (f->cond == NULL) {
+        free(f);
+        return NULL;
+    }
+
+    f->refs = 1;
+    f->link.hash = (size_t) fnv1a(key, key_size);
+    f->key_size = key_size;
+    memcpy(f->key, key, key_size);
+
+    hash_buckets_grow(&t->buckets, &t->nbuckets, t->count);
+    hash_link_insert(t->buckets, t->nbuckets, &f->link);
+    f->linked = true;
+    ++t->count;
+
+    return f;
+}
+
+
+void
+flight_unlink(flight_table_t *t, flight_t *f)
+{
+    assert(t);
+    assert(f);
+
+    if (!f->linked)
+        return;
+
+    hash_link_remove(t->buckets, t->nbuckets, &f->link);
+    f->linked = false;
+    --t->count;
+}
+
+
+void
+flight_done(flight_table_t *t, flight_t *f, CURLcode curl_code)
+{
+    assert(t);
+    assert(f);
+
+    f->done = true;
+    f->curl_code = curl_code;
+
+    flight_unlink(t, f);
+    fiber_cond_broadcast(f->cond);
+    flight_unref(f);
+}
+
+
+void
+flight_unref(flight_t *f)
+{
+    assert(f);
+    assert(f->refs > 0);
+
+    if (--f->refs > 0)
+        return;
+
+    assert(!f->linked);
+
+    fiber_cond_delete(f->cond);
+    buffer_free(&f->body);
+    buffer_free(&f->headers);
+    free(f);
+}
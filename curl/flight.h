@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FLIGHT_H_INCLUDED
+#define FLIGHT_H_INCLUDED 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <curl/curl.h>
+#include <tarantool/module.h>
+
+#include "buffer.h"
+#include "utils.h"
+
+/** A transfer which is shared by identical requests (single-flight): the
+ *  first request runs it, the others wait for its result. A flight is
+ *  found by its key until it's done, it's freed when nobody holds it.
+ */
+typedef struct flight_s {
+  /* It's the first member, see hash_link_t */
+  hash_link_t       link;
+  bool              linked;
+  /* The leader and the followers */
+  size_t            refs;
+  struct fiber_cond *cond;
+
+  bool              done;
+  CURLcode          curl_code;
+  long              http_code;
+  /* Attempts of the leader, 0 - it has no retry policy */
+  int               attempts;
+  buffer_t          body;
+  bool              has_headers;
+  buffer_t          headers;
+
+  size_t            key_size;
+  char              key[];
+} flight_t;
+
+typedef struct {
+  hash_link_t **buckets;
+  size_t      nbuckets;
+  size_t      count;
+} flight_table_t;
+
+bool flight_table_init(flight_table_t *t);
+/* Flights which are held by somebody are unlinked, they're freed later.
+ * The requests have to be freed before, so the flights which aren't done
+ * are failed and their leaders' references are dropped */
+void flight_table_free(flight_table_t *t);
+
+flight_t *flight_find(flight_table_t *t, const char *key, size_t key_size);
+
+/* Add a new flight, it's held by the caller */
+flight_t *flight_new(flight_table_t *t, const char *key, size_t key_size);
+
+/* The flight isn't found anymore */
+void flight_unlink(flight_table_t *t, flight_t *f);
+
+/* The leader has the result: the flight is unlinked, the followers are woken
+ * up and the leader's reference is dropped */
+void flight_done(flight_table_t *t, flight_t *f, CURLcode curl_code);
+
+static inline
+void
+flight_ref(flight_t *f)
+{
+  ++f->refs;
+}
+
+void flight_unref(flight_t *f);
+
+#endif /* FLIGHT_H_INCLUDED */
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include "headers.h"
+
+#define HEADER_NAME_MAX 256
+
+typedef struct {
+  size_t size;
+  char   data[];
+} headers_t;
+
+
+static inline
+bool
+is_status_line(const char *line, size_t size)
+{
+    return size >= 5 && memcmp(line, "HTTP/", 5) == 0;
+}
+
+
+static
+bool
+is_allowed(const buffer_t *allow, const char *name, size_t size)
+{
+    if (allow == NULL || allow->size == 0)
+        return true;
+
+    /* The list is "\nname\nname\n" */
+    const char *p = allow->data + 1;
+    const char *end = allow->data + allow->size;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t) (end - p));
+        if ((size_t) (eol - p) == size && strncasecmp(p, name, size) == 0)
+            return true;
+        p = eol + 1;
+    }
+
+    return false;
+}
+
+
+void
+headers_add_line(buffer_t *b, const buffer_t *allow,
+                 const char *line, size_t size)
+{
+    if (is_status_line(line, size)) {
+        b->size = 0;
+        return;
+    }
+
+    const char *colon = memchr(line, ':', size);
+    if (colon == NULL)
+        return;
+
+    if (!is_allowed(allow, line, (size_t) (colon - line)))
+        return;
+
+    /* A header is lost if memory is out, the transfer goes on */
+    buffer_append(b, line, size);
+}
+
+
+bool
+headers_allow(buffer_t *allow, const char *name, size_t size)
+{
+    if (allow->size == 0 && !buffer_append(allow, "\n", 1))
+        return false;
+
+    if (!buffer_reserve(allow, size + 1))
+        return false;
+
+    for (size_t i = 0; i < size; ++i)
+        allow->data[allow->size++] = (char) tolower((unsigned char) name[i]);
+    allow->data[allow->size++] = '\n';
+
+    return true;
+}
+
+
+/** Call fn(name, name_len, value, value_len, arg) for each header, the
+ *  value is stripped of spaces and CRLF
+ */
+static
+void
+headers_foreach(const char *data, size_t size,
+                void (*fn)(const char *, size_t, const char *, size_t, void *),
+                void *arg)
+{
+    const char *p = data;
+    const char *end = data + size;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t) (end - p));
+        const char *next = eol != NULL ? eol + 1 : end;
+        if (eol == NULL)
+            eol = end;
+
+        const char *colon = memchr(p, ':', (size_t) (eol - p));
+        if (colon != NULL) {
+            const char *v = colon + 1;
+            const char *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t'))
+                ++v;
+            while (v_end > v && isspace((unsigned char) v_end[-1]))
+                --v_end;
+            fn(p, (size_t) (colon - p), v, (size_t) (v_end - v), arg);
+        }
+
+        p = next;
+    }
+}
+
+
+typedef struct {
+  const char  *name;
+  size_t      name_len;
+  const char  *value;
+  size_t      value_len;
+  bool        found;
+} find_t;
+
+
+static
+void
+find_cb(const char *name, size_t name_len,
+        const char *value, size_t value_len, void *arg)
+{
+    find_t *f = (find_t *) arg;
+
+    if (f->found || name_len != f->name_len ||
+        strncasecmp(name, f->name, name_len) != 0)
+        return;
+
+    f->value = value;
+    f->value_len = value_len;
+    f->found = true;
+}
+
+
+bool
+headers_find(const char *data, size_t size, const char *name,
+             const char **value, size_t *value_size)
+{
+    find_t f = { .name = name, .name_len = strlen(name), .found = false };
+    headers_foreach(data, size, find_cb, &f);
+
+    *value = f.value;
+    *value_size = f.value_len;
+    return f.found;
+}
+
+
+typedef struct {
+  lua_State   *L;
+  const char  *name;
+  size_t      name_len;
+  bool        found;
+} lookup_t;
+
+
+static
+void
+lookup_cb(const char *name, size_t name_len,
+          const char *value, size_t value_len, void *arg)
+{
+    lookup_t *l = (lookup_t *) arg;
+
+    if (name_len != l->name_len || strncasecmp(name, l->name, name_len) != 0)
+        return;
+
+    /* Fields with the same name are joined, RFC 7230 3.2.2; it's done at
+     * once, so any number of them takes 3 slots of the stack */
+    if (l->found) {
+        lua_pushliteral(l->L, ", ");
+        lua_pushlstring(l->L, value, value_len);
+        lua_concat(l->L, 3);
+    } else
+        lua_pushlstring(l->L, value, value_len);
+    l->found = true;
+}
+
+
+static
+int
+headers_index(lua_State *L)
+{
+    const headers_t *h = (const headers_t *)
+            luaL_checkudata(L, 1, HEADERS_LUA_UDATA_NAME);
+
+    lookup_t l = { .L = L, .found = false };
+    l.name = luaL_checklstring(L, 2, &l.name_len);
+
+    headers_foreach(h->data, h->size, lookup_cb, &l);
+
+    if (!l.found)
+        lua_pushnil(L);
+
+    return 1;
+}
+
+
+static
+void
+totable_cb(const char *name, size_t name_len,
+           const char *value, size_t value_len, void *arg)
+{
+    lua_State *L = (lua_State *) arg;
+
+    char key[HEADER_NAME_MAX];
+    if (name_len > HEADER_NAME_MAX)
+        return;
+    for (size_t i = 0; i < name_len; ++i)
+        key[i] = (char) tolower((unsigned char) name[i]);
+
+    lua_pushlstring(L, key, name_len);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, value, value_len);
+    } else {
+        lua_pushliteral(L, ", ");
+        lua_pushlstring(L, value, value_len);
+        lua_concat(L, 3);
+    }
+    lua_rawset(L, -3);
+}
+
+
+static
+int
+headers_totable(lua_State *L)
+{
+    const headers_t *h = (const headers_t *)
+            luaL_checkudata(L, 1, HEADERS_LUA_UDATA_NAME);
+
+    lua_newtable(L);
+    headers_foreach(h->data, h->size, totable_cb, L);
+
+    return 1;
+}
+
+
+void
+headers_push(lua_State *L, const char *data, size_t size)
+{
+    headers_t *h = (headers_t *) lua_newuserdata(L, sizeof(headers_t) + size);
+    h->size = size;
+    if (size > 0)
+        memcpy(h->data, data, size);
+
+    luaL_getmetatable(L, HEADERS_LUA_UDATA_NAME);
+    lua_setmetatable(L, -2);
+}
+
+
+void
+headers_register(lua_State *L)
+{
+    luaL_newmetatable(L, HEADERS_LUA_UDATA_NAME);
+    lua_pushcfunction(L, headers_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, headers_totable);
+    lua_setfield(L, -2, "__call");
+    lua_pop(L, 1);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HEADERS_H_INCLUDED
+#define HEADERS_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffer.h"
+
+/**
+ * Unique name for userdata metatables
+ */
+#define HEADERS_LUA_UDATA_NAME "__tnt_curl_headers"
+
+/** Response headers are kept as they have come, "Name: value\r\n" lines
+ *  in one buffer. Lua gets them as a userdata which finds a field only when
+ *  it's accessed, calling the userdata returns a table of all of them.
+ */
+
+/* Append a header line of the response to 'b', the lines of a previous
+ * response (a redirect, 100 Continue) are dropped. If 'allow' isn't NULL or empty,
+ * it's "\nname\nname\n" of lowercase names, other headers are skipped */
+void headers_add_line(buffer_t *b, const buffer_t *allow,
+                      const char *line, size_t size);
+
+/* Find the first field with the name, the value is stripped of spaces */
+bool headers_find(const char *data, size_t size, const char *name,
+                  const char **value, size_t *value_size);
+
+/* Append the name to the allow-list */
+bool headers_allow(buffer_t *allow, const char *name, size_t size);
+
+/* Push a headers userdata which holds a copy of the buffer */
+void headers_push(lua_State *L, const char *data, size_t size);
+
+/* Create the userdata's metatable */
+void headers_register(lua_State *L);
+
+#endif /* HEADERS_H_INCLUDED */
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H_INCLUDED
+#define HISTOGRAM_H_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** A histogram of durations in microseconds with log-linear buckets: each
+ *  power of two is split into HISTOGRAM_SUB_BUCKETS buckets, so a value is
+ *  known within ~6%. Values above 2^HISTOGRAM_MAX_BITS us (~19 hours) go
+ *  to the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS    36
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t count;
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+
+static inline
+size_t
+histogram_bucket(uint64_t v)
+{
+  if (v < HISTOGRAM_SUB_BUCKETS)
+    return (size_t) v;
+
+  size_t msb = 63 - (size_t) __builtin_clzll(v);
+  if (msb > HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKETS - 1;
+
+  const size_t shift = msb - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+         (size_t) ((v >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* The highest value which falls into the bucket */
+static inline
+uint64_t
+histogram_bucket_value(size_t i)
+{
+  if (i < HISTOGRAM_SUB_BUCKETS)
+    return (uint64_t) i;
+
+  const size_t shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+  const uint64_t sub = HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+static inline
+void
+histogram_add(histogram_t *h, uint64_t v)
+{
+  ++h->buckets[histogram_bucket(v)];
+  ++h->count;
+}
+
+/* Halve the counts, a histogram which is halved every N values follows
+ * a change of the distribution, the older values weigh less and less */
+static inline
+void
+histogram_decay(histogram_t *h)
+{
+  h->count = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    h->buckets[i] /= 2;
+    h->count += h->buckets[i];
+  }
+}
+
+/* A value which 'q' (0..1) of all values are less or equal to */
+static inline
+uint64_t
+histogram_percentile(const histogram_t *h, double q)
+{
+  if (h->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (q * (double) h->count + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      return histogram_bucket_value(i);
+  }
+  return histogram_bucket_value(HISTOGRAM_BUCKETS - 1);
+}
+
+#endif /* HISTOGRAM_H_INCLUDED */
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "host_stat.h"
+#include "utils.h"
+
+#define HOST_STAT_TABLE_MIN_CAPACITY 16
+#define HOST_STAT_KEY_MAX 512
+
+
+void
+host_stat_key(const char *url, char *buf, size_t size)
+{
+    assert(url);
+    assert(buf);
+
+    const char *scheme = "http";
+    size_t scheme_len = 4;
+
+    const char *p = strstr(url, "://");
+    if (p != NULL && strcspn(url, "/?#") > (size_t) (p - url)) {
+        scheme = url;
+        scheme_len = (size_t) (p - url);
+        url = p + 3;
+    }
+
+    /* Authority ends with the path, the query or the fragment */
+    size_t authority_len = strcspn(url, "/?#");
+
+    /* Skip user:password@ */
+    const char *at = memchr(url, '@', authority_len);
+    if (at != NULL) {
+        authority_len -= (size_t) (at + 1 - url);
+        url = at + 1;
+    }
+
+    /* A port follows the last ':' unless it's inside of [IPv6] */
+    size_t host_len = authority_len;
+    const char *port = NULL;
+    size_t port_len = 0;
+    for (size_t i = authority_len; i > 0; --i) {
+        if (url[i - 1] == ']')
+            break;
+        if (url[i - 1] == ':') {
+            host_len = i - 1;
+            port = url + i;
+            port_len = authority_len - i;
+            break;
+        }
+    }
+
+    if (port == NULL || port_len == 0) {
+        if (scheme_len == 5 && strncasecmp(scheme, "https", 5) == 0)
+            port = "443";
+        else
+            port = "80";
+        port_len = strlen(port);
+    }
+
+    snprintf(buf, size, "%.*s://%.*s:%.*s",
+             (int) scheme_len, scheme, (int) host_len, url,
+             (int) port_len, port);
+
+    /* The scheme and the host are case-insensitive, the port is digits */
+    for (char *c = buf; *c != '\0'; ++c)
+        *c = (char) tolower((unsigned char) *c);
+}
+
+
+void
+host_stat_table_init(host_stat_table_t *t)
+{
+    assert(t);
+    t->slots = NULL;
+    t->capacity = 0;
+    t->size = 0;
+}
+
+
+void
+host_stat_table_free(host_stat_table_t *t)
+{
+    assert(t);
+    for (size_t i = 0; i < t->capacity; ++i)
+        free(t->slots[i]);
+    free(t->slots);
+    host_stat_table_init(t);
+}
+
+
+static
+bool
+table_grow(host_stat_table_t *t)
+{
+    const size_t capacity = t->capacity > 0 ?
+            t->capacity * 2 : HOST_STAT_TABLE_MIN_CAPACITY;
+
+    host_stat_t **slots = (host_stat_t **)
+            calloc(capacity, sizeof(host_stat_t *));
+    if (slots == NULL)
+        return false;
+
+    for (size_t i = 0; i < t->capacity; ++i) {
+        host_stat_t *h = t->slots[i];
+        if (h == NULL)
+            continue;
+        size_t j = (size_t) fnv1a(h->key, strlen(h->key)) & (capacity - 1);
+        while (slots[j] != NULL)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = h;
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->capacity = capacity;
+
+    return true;
+}
+
+
+host_stat_t*
+host_stat_get(host_stat_table_t *t, const char *url)
+{
+    assert(t);
+    assert(url);
+
+    char key[HOST_STAT_KEY_MAX];
+    host_stat_key(url, key, sizeof(key));
+
+    /* Keep the load factor below 3/4 */
+    if ((t->size + 1) * 4 > t->capacity * 3 && !table_grow(t))
+        return NULL;
+
+    size_t i = (size_t) fnv1a(key, strlen(key)) & (t->capacity - 1);
+    for (; t->slots[i] != NULL; i = (i + 1) & (t->capacity - 1)) {
+        if (strcmp(t->slots[i]->key, key) == 0)
+            return t->slots[i];
+    }
+
+    const size_t key_size = strlen(key) + 1;
+    host_stat_t *h = (host_stat_t *) calloc(1, sizeof(host_stat_t) + key_size);
+    if (h == NULL)
+        return NULL;
+    memcpy(h->key, key, key_size);
+
+    t->slots[i] = h;
+    ++t->size;
+
+    return h;
+}
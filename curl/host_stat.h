@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HOST_STAT_H_INCLUDED
+#define HOST_STAT_H_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+#include "breaker.h"
+
+struct request_s;
+
+/** Limits of an upstream, a request which exceeds them is delayed
+ */
+typedef struct {
+  /* Max number of running requests, 0 - unlimited */
+  size_t max_requests;
+  /* Requests per second, 0 - unlimited; the bucket holds up to 'burst'
+   * tokens */
+  double rate;
+  double burst;
+} host_limit_t;
+
+#define HOST_STAT_RECENT_REQUESTS 256
+
+/** Statistics of one upstream, it's keyed by scheme://host:port
+ */
+typedef struct host_stat_s {
+  uint64_t    requests;
+  uint64_t    errors;
+  size_t      active_requests;
+  uint64_t    bytes_in;
+  uint64_t    bytes_out;
+  uint64_t    connections_new;
+  uint64_t    connections_reused;
+  /* The total time of successful requests */
+  histogram_t latency;
+  /* The same of the recent requests, it's halved every
+   * HOST_STAT_RECENT_REQUESTS requests; the hedge delay is taken here */
+  histogram_t recent_latency;
+
+  /* It's closed if neither the upstream nor the instance has a config,
+   * see curl_ctx_t.breaker */
+  breaker_t   breaker;
+
+  /* The limiter's state, see curl_ctx_t.limits */
+  struct {
+    /* The limits are set, otherwise the instance's ones are used */
+    bool               set;
+    host_limit_t       limit;
+    double             tokens;
+    double             stamp;
+    size_t             running;
+    /* Delayed requests */
+    struct request_s   *head;
+    struct request_s   *tail;
+    size_t             queued;
+    uint64_t           delayed;
+    /* Link of the hosts which have delayed requests */
+    bool               blocked;
+    struct host_stat_s *next;
+  } limiter;
+
+  char        key[];
+} host_stat_t;
+
+/** An open addressing hash table of host_stat_t, entries are never removed
+ *  while the table is alive, so requests may keep pointers to them
+ */
+typedef struct {
+  host_stat_t **slots;
+  size_t      capacity;
+  size_t      size;
+} host_stat_table_t;
+
+void host_stat_table_init(host_stat_table_t *t);
+void host_stat_table_free(host_stat_table_t *t);
+
+/* Get (or add) the entry of the url's upstream, NULL if memory is out */
+host_stat_t *host_stat_get(host_stat_table_t *t, const char *url);
+
+/* Write scheme://host:port of the url to 'buf' in lower case, the scheme and
+ * the port are defaulted if they are omitted */
+void host_stat_key(const char *url, char *buf, size_t size);
+
+#endif /* HOST_STAT_H_INCLUDED */
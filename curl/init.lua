@@ -29,10 +29,10 @@
 --  SUCH DAMAGE.
 --
 
-local fiber       = require('fiber')
 local curl_driver = require('curl.driver')
 
 local curl_mt
+local share_mt
 
 --
 --  <http> - create a new curl instance.
@@ -41,6 +41,37 @@ local curl_mt
 --
 --    pipeline - set to true to enable pipelining for this multi handle */
 --    max_conns -  Maximum number of entries in the connection cache */
+--    pool_size - Maximum number of requests which are run at the same time */
+--    keep_options - set to true to keep the default options of the pooled
+--                   curl handles between requests, only the options which
+--                   were changed by a request are reverted */
+--    multiplex - set to true to multiplex HTTP/2 requests over the same
+--                connection */
+--    max_concurrent_streams - Maximum number of concurrent streams per
+--                             HTTP/2 connection */
+--    share - caches shared with other instances, see <share> */
+--    threads - number of threads which run the transfers, 0 (default) means
+--              that they run in TX. Requests of such instance could use
+--              only buffer_response and body, i.e. the sync API */
+--    cache_size - max size of the response cache in bytes, 0 (default)
+--                 means that there is no cache. Responses to GET requests
+--                 with buffer_response are cached by url according to
+--                 Cache-Control, ETag and Last-Modified */
+--    queue_size - max number of fibers which wait for a request when the
+--                 pool is exhausted, 0 (default) means that such requests
+--                 fail at once */
+--    queue_timeout - how long a request waits in the queue in seconds,
+--                    1 by default */
+--    max_host_connections - max number of connections to one host */
+--    max_total_connections - max number of connections at all */
+--    host_limits - {max_requests, rate, burst}, the limits of each upstream
+--                  which doesn't have its own ones, see <set_host_limit> */
+--    retry_budget - retries are allowed up to this share of requests, 0.1
+--                   by default, 0 - unlimited */
+--    hedge_budget - hedges are allowed up to this share of hedged
+--                   requests, 0.05 by default, 0 - unlimited */
+--    circuit_breaker - the circuit breaker of each upstream which doesn't
+--                      have its own one, see <set_circuit_breaker> */
 --
 --  Returns:
 --     curl object or raise error()
@@ -53,7 +84,16 @@ local http = function(opts)
     opts.max_conns = opts.max_conns or 5
     opts.pool_size = opts.pool_size or 1000
 
-    local curl = curl_driver.new(opts.pipeline, opts.max_conns, opts.pool_size)
+    local curl = curl_driver.new(opts.pipeline, opts.max_conns, opts.pool_size,
+                                 opts.keep_options, opts.multiplex,
+                                 opts.max_concurrent_streams,
+                                 opts.share and opts.share.share,
+                                 opts.threads, opts.cache_size,
+                                 opts.queue_size, opts.queue_timeout,
+                                 opts.max_host_connections,
+                                 opts.max_total_connections,
+                                 opts.host_limits, opts.retry_budget,
+                                 opts.hedge_budget, opts.circuit_breaker)
 
     local ok, version = curl:version()
     if not ok then
@@ -61,30 +101,89 @@ local http = function(opts)
     end
 
     return setmetatable({VERSION     = version,
-                         curl        = curl, },
+                         curl        = curl,
+                         share       = opts.share, },
                          curl_mt )
 end
 
+--
+--  <share> - create caches which could be shared by curl instances.
+--
+--  Parameters:
+--
+--    dns - set to true to share the DNS cache
+--    ssl_session - set to true to share the TLS session cache
+--    connect - set to true to share the connection cache
+--
+--  All options are true by default.
+--
+--  Returns:
+--     share object or raise error()
+--
+local share = function(opts)
 
--- Internal {{{
-local function read_cb(cnt, ctx)
-    local res = ctx.body:sub(ctx.off, ctx.off + cnt - 1)
-    ctx.off = ctx.off + res:len()
-    return res
-end
+    opts = opts or {}
+
+    local function opt(v)
+        return v == nil or v
+    end
 
-local function write_cb(data, ctx)
-    ctx.response = ctx.response .. data
-    return data:len()
+    return setmetatable({share = curl_driver.share(opt(opts.dns),
+                                                   opt(opts.ssl_session),
+                                                   opt(opts.connect))},
+                        share_mt)
 end
 
-local function done_cb(curl_code, http_code, error_message, ctx)
-    ctx.http_code     = http_code
-    ctx.curl_code     = curl_code
-    ctx.error_message = error_message
-    ctx.cond:signal()
+
+-- Internal {{{
+
+-- A body which isn't a string is produced by chunks: it's a function which
+-- returns the next chunk or nil at the end, or a fiber.channel which is
+-- closed at the end
+local function body_producer(body)
+    if body == nil or type(body) == 'string' then
+        return nil
+    end
+    if type(body) == 'function' then
+        return body
+    end
+    return function()
+        return body:get()
+    end
 end
 
+-- Send the body from the producer, the transfer is paused while the
+-- producer is late, and the body is sent chunked if its size is unknown
+local function stream_request(self, method, url, producer, request_opts)
+    local stream = self.curl:stream(method, url, request_opts)
+    local ok, res = pcall(function()
+        while true do
+            local chunk = producer()
+            if chunk == nil or not stream:write(chunk) then
+                break
+            end
+        end
+        stream:finish()
+        local parts = {}
+        while true do
+            local chunk = stream:read()
+            if chunk == nil then
+                break
+            end
+            table.insert(parts, chunk)
+        end
+        local res = { code = stream:code(), body = table.concat(parts) }
+        if request_opts.response_headers then
+            res.headers = stream:headers()
+        end
+        return res
+    end)
+    stream:close()
+    if not ok then
+        error(res)
+    end
+    return res
+end
 --
 --  <sync_request> This function does HTTP request
 --
@@ -93,7 +192,9 @@ end
 --    method  - HTTP method, like GET, POST, PUT and so on
 --    url     - HTTP url, like https://tarantool.org/doc
 --    body    - this parameter is optional, you may use it for passing the
---              body to a server. Like 'My text string!'
+--              body to a server. Like 'My text string!'. It also may be
+--              a function which returns the next chunk of the body or nil
+--              at the end, or a fiber.channel which is closed at the end;
 --    options - this is a table of options.
 --              ca_path                             - a path to ssl certificate dir;
 --              ca_file                             - a path to ssl certificate file;
@@ -108,9 +209,38 @@ end
 --              connect_timeout                     - Time-out connect operations after this amount of seconds, if connects are;
 --                                                    OK within this time, then fine... This only aborts the connect phase;
 --              dns_cache_timeout                   - DNS cache timeout;
+--              max_recv_speed & max_send_speed     - bandwidth caps in bytes per second;
+--              http_version                        - '1.0', '1.1', '2', '2tls' or '2-prior-knowledge';
+--              body_size                           - the size of a produced body if it's known,
+--                                                    otherwise it's sent chunked;
+--              response_headers                    - true or a list of the needed names, the
+--                                                    result gets headers;
+--              cache                               - set to false to bypass the response cache;
+--              coalesce                            - true or a list of request header names, a GET
+--                                                    gets the response of an identical running one;
+--              retry                               - true or a retry policy {attempts, base_delay,
+--                                                    max_delay, retry_after, statuses, curl_codes,
+--                                                    idempotent_only}, the result gets attempts;
+--              hedge                               - true or {url, delay}, a copy of a slow request
+--                                                    is sent to 'url', the first response wins;
+--                                                    only GET and HEAD are hedged;
+--              priority                            - 'high', 'normal' (default) or 'low', a class
+--                                                    of the queue when the pool is exhausted;
+--              queue_timeout                       - how long the request waits in the queue;
+--              hash_key                            - the key of an upstream group with the 'hash'
+--                                                    policy, the path by default, see <add_upstream>;
+--              accept_encoding                     - true or a value of Accept-Encoding, the response
+--                                                    is decompressed in C;
+--              compress_body                       - true ('gzip') or 'deflate', a string body is
+--                                                    compressed in C and Content-Encoding is set;
+--              decode                              - 'json', 'msgpack' or 'tuple', the body is parsed
+--                                                    in C into a Lua value, a malformed one is kept
+--                                                    as a string and the result gets decode_error;
+--                                                    a body produced by a function isn't decoded;
 --
 --  Returns:
---              {code=NUMBER, body=STRING} or error()
+--              {code=NUMBER, body=STRING [, headers=HEADERS] [, attempts=NUMBER]
+--               [, decode_error=STRING]} or error()
 --
 local function sync_request(self, method, url, body, opts)
 
@@ -120,55 +250,48 @@ local function sync_request(self, method, url, body, opts)
 
     opts = opts or {}
 
-    local ctx = {cond          = fiber.cond(),
-                 http_code     = 0,
-                 curl_code     = 0,
-                 error_message = '',
-                 response      = '',
-                 body          = body or '',
-                 off           = 1}
-
+    -- Content-Length is set by curl, it knows the body's size
     local headers = opts.headers or {}
 
-    -- I have to set CL since CURL-engine works async
-    if body then
-        headers['Content-Length'] = body:len()
+    local request_opts = {ca_path            = opts.ca_path,
+                          ca_file            = opts.ca_file,
+                          headers            = headers,
+                          max_conns          = opts.max_conns,
+                          keepalive_idle     = opts.keepalive_idle,
+                          keepalive_interval = opts.keepalive_interval,
+                          low_speed_time     = opts.low_speed_time,
+                          low_speed_limit    = opts.low_speed_limit,
+                          read_timeout       = opts.read_timeout,
+                          connect_timeout    = opts.connect_timeout,
+                          dns_cache_timeout  = opts.dns_cache_timeout,
+                          max_recv_speed     = opts.max_recv_speed,
+                          max_send_speed     = opts.max_send_speed,
+                          http_version       = opts.http_version,
+                          curl_verbose       = opts.curl_verbose,
+                          response_headers   = opts.response_headers,
+                          cache              = opts.cache,
+                          coalesce           = opts.coalesce,
+                          retry              = opts.retry,
+                          hedge              = opts.hedge,
+                          priority           = opts.priority,
+                          queue_timeout      = opts.queue_timeout,
+                          hash_key           = opts.hash_key,
+                          accept_encoding    = opts.accept_encoding, }
+
+    local producer = body_producer(body)
+    if producer ~= nil then
+        request_opts.upload      = true
+        request_opts.body_size   = opts.body_size
+        request_opts.buffer_size = opts.buffer_size
+        return stream_request(self, method, url, producer, request_opts)
     end
 
-    local ok, emsg = self.curl:async_request(method, url,
-                                  {ca_path            = opts.ca_path,
-                                   ca_file            = opts.ca_file,
-                                   headers            = headers,
-                                   read               = read_cb,
-                                   write              = write_cb,
-                                   done               = done_cb,
-                                   ctx                = ctx,
-                                   max_conns          = opts.max_conns,
-                                   keepalive_idle     = opts.keepalive_idle,
-                                   keepalive_interval = opts.keepalive_interval,
-                                   low_speed_time     = opts.low_speed_time,
-                                   low_speed_limit    = opts.low_speed_limit,
-                                   read_timeout       = opts.read_timeout,
-                                   connect_timeout    = opts.connect_timeout,
-                                   dns_cache_timeout  = opts.dns_cache_timeout,
-                                   curl_verbose       = opts.curl_verbose, } )
-
-    -- Curl can't add a new request
-    if not ok then
-        error("curl has an internal error, msg = " .. emsg)
-    end
-
-    -- 'yield' until all data have arrived {{{
-    ctx.cond:wait()
-    -- }}}
-
-    -- Curl has an internal error
-    if ctx.curl_code ~= 0 then
-        error("curl has an internal error, msg = " .. ctx.error_message)
-    end
-
-    -- Curl did a request and he has a response
-    return { code = ctx.http_code, body = ctx.response }
+    -- The calling fiber is yielded in C until all data have arrived,
+    -- error() is raised if curl has failed
+    request_opts.body = body
+    request_opts.compress_body = opts.compress_body
+    request_opts.decode = opts.decode
+    return self.curl:request(method, url, request_opts)
 end
 -- }}}
 
@@ -192,6 +315,13 @@ curl_mt = {
         return self:request('GET', url, '', options)
     end,
 
+    --
+    -- <head> - see <sync_request>, the body of the result is empty
+    --
+    head = function(self, url, options)
+        return self:request('HEAD', url, '', options)
+    end,
+
     --
     -- <post> - see <sync_request>
     --
@@ -206,6 +336,77 @@ curl_mt = {
         return self:request('PUT', url, body, options)
     end,
 
+    --
+    --  <request_many> This function does a batch of HTTP requests, all of
+    --  them are submitted by one call, the calling fiber is yielded until
+    --  they are done.
+    --
+    --  Parameters:
+    --
+    --    requests - an array of {method, url [, body [, options]]}, options
+    --               are the same as for <sync_request>;
+    --    options  - this is a table of options.
+    --               concurrency - max number of requests which run at once,
+    --                             all of them by default;
+    --               timeout     - a deadline for the whole batch in seconds,
+    --                             requests which are not done by then are
+    --                             aborted with the 'timeout' error;
+    --               priority, queue_timeout - the batch waits in the
+    --                             admission queue with them, see
+    --                             <sync_request>;
+    --
+    --  Returns:
+    --     an array of results in the order of requests, a result is
+    --     {code=NUMBER, body=STRING} or {error=STRING}
+    --
+    request_many = function(self, requests, options)
+        if type(requests) ~= 'table' then
+            error('signature (requests [, options])')
+        end
+        options = options or {}
+        return self.curl:request_many(requests, options.concurrency or 0,
+                                      options.timeout or 0, options)
+    end,
+
+    --
+    --  <stream> This function does HTTP request, the response body is read
+    --  by chunks, so it's never kept in memory as a whole.
+    --
+    --  Parameters:
+    --
+    --    method  - HTTP method, like GET, POST, PUT and so on
+    --    url     - HTTP url, like https://tarantool.org/doc
+    --    options - the same as for <sync_request>, and
+    --              buffer_size - max number of bytes which are buffered
+    --                            for the reader, the transfer is paused
+    --                            until the reader takes them (1MB by
+    --                            default), it's the same for the writer;
+    --              upload      - the request body is passed by write();
+    --              body_size   - the size of the body if it's known,
+    --                            otherwise it's sent chunked;
+    --
+    --  Returns:
+    --     a reader object with the methods:
+    --       read()  - yields until the next chunk of the body, returns it
+    --                 or nil when the body is over, raises error() if
+    --                 the transfer has failed;
+    --       write(data) - passes the next chunk of the request body if
+    --                     options.upload is true, yields while the
+    --                     buffer is full, returns false if the server has
+    --                     already responded;
+    --       finish()    - tells that the request body is over;
+    --       code()  - HTTP code of the response;
+    --       headers() - the response headers if options.response_headers
+    --                   is set;
+    --       close() - aborts the transfer, it's also done by GC.
+    --
+    stream = function(self, method, url, options)
+        if not method or not url then
+            error('signature (method, url [, options])')
+        end
+        return self.curl:stream(method, url, options or {})
+    end,
+
     --
     --  <async_request> This function does HTTP request
     --
@@ -226,9 +427,43 @@ curl_mt = {
     --             client passes data to the server.
     --             signature is function(content_size, context)
     --
+    --      body - a string which is passed to the server, 'read' isn't
+    --             needed if it's set;
+    --
     --      done - name of a callback function which is invoked when a request
     --             was completed;
-    --             signature is  function(curl_code, http_code, error_message, ctx)
+    --             signature is  function(curl_code, http_code, error_message, ctx [, body [, headers]])
+    --
+    --      buffer_response - if it's true, the response body is collected
+    --                        by the driver and passed to the 'done' callback,
+    --                        'write' isn't needed;
+    --
+    --      cache - set to false to bypass the response cache;
+    --
+    --      retry - true or a retry policy, see <sync_request>; it's used
+    --              only with buffer_response;
+    --
+    --      priority - 'high', 'normal' (default) or 'low', the fiber waits
+    --                 in this class of the queue if the pool is exhausted;
+    --
+    --      queue_timeout - how long the fiber waits in the queue in
+    --                      seconds, the instance's queue_timeout by default;
+    --
+    --      hash_key - the key of an upstream group with the 'hash' policy,
+    --                 see <add_upstream>;
+    --
+    --      accept_encoding - true or a value of Accept-Encoding, the
+    --                        response is decompressed before 'write';
+    --
+    --      compress_body - true ('gzip') or 'deflate', the string body is
+    --                      compressed and Content-Encoding is set;
+    --
+    --      response_headers - if it's true, the response headers are
+    --                         collected by the driver and passed to the
+    --                         'done' callback, it also may be a list of the
+    --                         needed names; headers are parsed only when a
+    --                         field is accessed, headers() returns a table
+    --                         of all of them;
     --
     --      ca_path - a path to ssl certificate dir;
     --
@@ -252,6 +487,13 @@ curl_mt = {
     --
     --      dns_cache_timeout - DNS cache timeout;
     --
+    --      max_recv_speed & max_send_speed - bandwidth caps in bytes per
+    --                                        second;
+    --
+    --      http_version - '1.0', '1.1' (default), '2', '2tls' (HTTP/2 over
+    --                     TLS only) or '2-prior-knowledge' (h2c without
+    --                     upgrade);
+    --
     --      curl_verbose - make libcurl verbose!;
     --
     --  Returns:
@@ -261,8 +503,10 @@ curl_mt = {
         if not method or not url or not options then
             error('signature (method, url [, body [, options]])')
         end
-        if type(options.read) ~= 'function' or
-           type(options.write) ~= 'function' or
+        if (type(options.read) ~= 'function' and
+            type(options.body) ~= 'string') or
+           (type(options.write) ~= 'function' and
+            not options.buffer_response) or
            type(options.done) ~= 'function'
         then
             error('options should have read write and done functions')
@@ -298,12 +542,14 @@ curl_mt = {
     --
     --    active_requests - this is number of currently executing requests
     --
-    --    sockets_added - this is a total number of added sockets into libev loop
+    --    sockets_added - this is a total number of sockets added into the
+    --                    event loop
     --
-    --    sockets_deleted - this is a total number of deleted sockets from libev
-    --                      loop
+    --    sockets_deleted - this is a total number of sockets deleted from the
+    --                      event loop
     --
-    --    loop_calls - this is a total number of iterations over libev loop
+    --    loop_calls - this is a total number of socket events and timeouts
+    --                 passed to curl
     --
     --    total_requests - this is a total number of requests
     --
@@ -316,6 +562,30 @@ curl_mt = {
     --    failed_requests - this is a total number of requests which have
     --                      failed (included systeme erros, curl errors, HTTP
     --                      erros and so on)
+    --
+    --    coalesced_requests - this is a total number of requests which have
+    --                         got the response of an identical one
+    --
+    --    retries - this is a total number of retries
+    --
+    --    retries_throttled - this is a number of retries which the retry
+    --                        budget hasn't allowed
+    --
+    --    hedges, hedges_won, hedges_throttled - these are numbers of sent
+    --          hedges, hedges which have answered first and hedges which
+    --          the budget hasn't allowed
+    --
+    --    breaker_rejections - this is a number of requests which circuit
+    --                         breakers have failed at once
+    --
+    --    cache_hits, cache_stale_hits, cache_misses, cache_revalidations,
+    --    cache_stores, cache_evictions, cache_entries, cache_size - these
+    --          are values of the response cache, if it's on
+    --
+    --    timing - durations of the phases of successful requests:
+    --             namelookup, connect, appconnect, starttransfer, total;
+    --             each of them is {count, p50, p90, p99, p999},
+    --             percentiles are in seconds from the start of a request
     --  }
     --  or error()
     --
@@ -323,10 +593,185 @@ curl_mt = {
         return self.curl:stat()
     end,
 
+    --
+    -- <pool_stat> - this function returns a table with values of the
+    -- request pool's statistic.
+    --
+    -- Returns {
+    --
+    --    pool_size - this is a max number of requests
+    --
+    --    free - this is a number of requests which could be started
+    --
+    --    allocated - this is a number of requests which have memory
+    --                allocated, the pool grows and shrinks by chunks
+    --
+    --    queue_size - this is a number of fibers which wait for a request
+    --
+    --    queue_waits, queue_rejections, queue_timeouts - these are numbers
+    --          of requests which have waited, have found the queue full
+    --          and have given up waiting
+    --
+    --    queue_cancellations - this is a number of requests whose fibers
+    --                          have been cancelled while they waited
+    --
+    --    queue_wait - wait times of the requests which have got one,
+    --                 {count, p50, p90, p99, p999} in seconds
+    --  }
+    --  or error()
+    --
     pool_stat = function(self)
         return self.curl:pool_stat()
     end,
 
+    --
+    -- <host_stat> - this function returns a table of statistics of each
+    -- upstream, it's keyed by 'scheme://host:port'.
+    --
+    -- Returns {
+    --
+    --    ['https://tarantool.org:443'] = {
+    --
+    --      requests - this is a total number of started requests
+    --
+    --      errors - this is a number of requests which have failed
+    --
+    --      active_requests - this is a number of requests which hold
+    --                        a slot of the pool now
+    --
+    --      bytes_in, bytes_out - these are numbers of received and sent
+    --                            bytes of bodies
+    --
+    --      connections_new, connections_reused - these are numbers of
+    --          requests which have opened a new connection or have reused
+    --          a cached one
+    --
+    --      running_requests, queued_requests - these are numbers of
+    --          requests which run now and which are delayed by the
+    --          upstream's limits
+    --
+    --      delayed_requests - this is a total number of delayed requests
+    --
+    --      latency - {count, p50, p90, p99, p999} of the total time of
+    --                successful requests in seconds
+    --
+    --      breaker - 'closed', 'open' or 'half_open', the state of the
+    --                circuit breaker
+    --
+    --      breaker_opened, breaker_half_opened, breaker_closed - these are
+    --          numbers of transitions of the circuit breaker
+    --
+    --      breaker_rejected - this is a number of requests which the
+    --                         circuit breaker has failed at once
+    --    },
+    --    ...
+    --  }
+    --  or error()
+    --
+    host_stat = function(self)
+        return self.curl:host_stat()
+    end,
+
+    --
+    -- <set_host_limit> - this function sets the limits of the url's
+    -- upstream, requests which exceed them are delayed, not failed.
+    --
+    -- Parameters:
+    --
+    --    url - any url of the upstream
+    --
+    --    limits - {
+    --      max_requests - max number of running requests, 0 - unlimited
+    --      rate - requests per second, 0 - unlimited
+    --      burst - max number of requests which are started at once
+    --              when the rate allows it, rate by default
+    --    }
+    --
+    --  Returns:
+    --     true or error()
+    --
+    set_host_limit = function(self, url, limits)
+        return self.curl:set_host_limit(url, limits)
+    end,
+
+    --
+    -- <set_circuit_breaker> - this function sets the circuit breaker of
+    -- the url's upstream. It opens when the share of failed (an error of
+    -- curl or 5xx) or timed out requests in the sliding window reaches
+    -- its rate, requests fail at once with "circuit breaker is open" then.
+    -- After open_time it lets 'probes' requests pass, it's closed if all
+    -- of them succeed and it's opened again otherwise.
+    --
+    -- Parameters:
+    --
+    --    url - any url of the upstream
+    --
+    --    config - {
+    --      window - the sliding window in seconds, 10
+    --      min_requests - the rates aren't checked until the window has
+    --                     this number of requests, 20
+    --      error_rate - 0..1, 0 (default) - not checked
+    --      timeout_rate - 0..1, 0 (default) - not checked
+    --      open_time - seconds, 5
+    --      probes - 1
+    --    }
+    --
+    --  Returns:
+    --     true or error()
+    --
+    set_circuit_breaker = function(self, url, config)
+        return self.curl:set_circuit_breaker(url, config)
+    end,
+
+    --
+    -- <add_upstream> - this function adds a named group of peers which
+    -- serve the same requests, a request to 'upstream://name/path' is sent
+    -- to 'path' of one of them.
+    --
+    -- Parameters:
+    --
+    --    name - the name of the group
+    --
+    --    opts - {
+    --      urls - a list of the peers' base urls, e.g. 'http://10.0.0.1:8080'
+    --      policy - 'round_robin' (default), 'least_requests' (the peer
+    --               with the fewest active requests) or 'hash' (consistent
+    --               hashing of the request's hash_key, the path by default)
+    --      max_errors - a peer is ejected after this number of failures in
+    --                   a row (an error of curl, 5xx or a response slower
+    --                   than max_latency), 5 by default, 0 - never
+    --      eject_time - how long a peer stays ejected in seconds, 10
+    --      max_latency - seconds, 0 (default) - latency isn't checked
+    --      circuit_breaker - the circuit breaker of each peer, see
+    --                        <set_circuit_breaker>
+    --    }
+    --
+    --  If all the peers are ejected, the one which comes back first is used.
+    --
+    --  Returns:
+    --     true or error()
+    --
+    add_upstream = function(self, name, opts)
+        return self.curl:add_upstream(name, opts)
+    end,
+
+    --
+    -- <upstream_stat> - this function returns the peers of each group
+    --
+    -- Returns {
+    --
+    --    name = {
+    --      {url, ejected, ejections, active_requests},
+    --      ...
+    --    },
+    --    ...
+    --  }
+    --  or error()
+    --
+    upstream_stat = function(self)
+        return self.curl:upstream_stat()
+    end,
+
     --
     -- <free> - cleanup resources
     --
@@ -339,10 +784,49 @@ curl_mt = {
   },
 }
 
+share_mt = {
+  __index = {
+    --
+    -- <stat> - this function returns a table with values of statistic.
+    --
+    -- Returns {
+    --
+    --    instances - this is a number of curl instances which use the share
+    --
+    --    dns_lock_calls, ssl_session_lock_calls, connect_lock_calls -
+    --          these are numbers of times curl has locked the shared
+    --          caches, both for reads and writes, so they don't tell hits
+    --          from misses
+    --
+    --    connections_reused - this is a number of requests which have
+    --                         reused a connection
+    --
+    --    connections_new - this is a number of requests which have opened
+    --                      a new connection
+    --  }
+    --  or error()
+    --
+    stat = function(self)
+        return self.share:stat()
+    end,
+
+    --
+    -- <free> - cleanup resources
+    --
+    -- Should be called after all instances which use the share are freed.
+    --
+    free = function(self)
+        self.share:free()
+    end,
+  },
+}
+
 --
 -- Export
 --
 return {
   -- <see http>
   http = http,
+  -- <see share>
+  share = share,
 }
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef QUEUE_H_INCLUDED
+#define QUEUE_H_INCLUDED 1
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/** Intrusive lock-free multi-producer single-consumer queue
+ *  (D. Vyukov's algorithm): push() is wait-free and could be called
+ *  from any thread, pop() is called by the only consumer
+ */
+typedef struct mpsc_node_s mpsc_node_t;
+
+struct mpsc_node_s {
+  _Atomic(mpsc_node_t *) next;
+};
+
+typedef struct {
+  _Atomic(mpsc_node_t *) head;
+  mpsc_node_t            *tail;
+  mpsc_node_t            stub;
+} mpsc_queue_t;
+
+
+static inline
+void
+mpsc_queue_init(mpsc_queue_t *q)
+{
+  atomic_store(&q->stub.next, NULL);
+  atomic_store(&q->head, &q->stub);
+  q->tail = &q->stub;
+}
+
+static inline
+void
+mpsc_queue_push(mpsc_queue_t *q, mpsc_node_t *n)
+{
+  atomic_store(&n->next, NULL);
+  mpsc_node_t *prev = atomic_exchange(&q->head, n);
+  atomic_store(&prev->next, n);
+}
+
+/* It returns NULL if the queue is empty or a push is in progress */
+static inline
+mpsc_node_t*
+mpsc_queue_pop(mpsc_queue_t *q)
+{
+  mpsc_node_t *tail = q->tail;
+  mpsc_node_t *next = atomic_load(&tail->next);
+
+  if (tail == &q->stub) {
+    if (next == NULL)
+      return NULL;
+    q->tail = next;
+    tail = next;
+    next = atomic_load(&tail->next);
+  }
+
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load(&q->head))
+    return NULL;
+
+  mpsc_queue_push(q, &q->stub);
+
+  next = atomic_load(&tail->next);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+#endif /* QUEUE_H_INCLUDED */
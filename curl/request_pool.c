@@ -38,22 +38,105 @@
 
 static inline void reset_request(request_t *r);
 
+/** A fiber in the admission queue, it lives on the fiber's stack
+ */
+struct request_waiter_s {
+  struct fiber     *fiber;
+  request_waiter_t *prev;
+  request_waiter_t *next;
+  int              priority;
+  bool             linked;
+  double           start;
+  /* A request which is given to the waiter */
+  request_t        *r;
+};
+
 
 static inline
-bool
-create_request(struct curl_ctx_s *ctx, size_t idx, request_t *r)
+void
+chunk_link(request_chunk_t **head, request_chunk_t *c)
 {
-    assert(ctx);
-    assert(r);
+    c->prev = NULL;
+    c->next = *head;
+    if (*head != NULL)
+        (*head)->prev = c;
+    *head = c;
+}
+
 
-    memset(r, 0, sizeof(request_t));
+static inline
+void
+chunk_unlink(request_chunk_t **head, request_chunk_t *c)
+{
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        *head = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+}
 
-    r->pool.idx = idx;
-    r->curl_ctx = ctx;
 
-    reset_request(r);
+static
+request_chunk_t*
+chunk_new(request_pool_t *p)
+{
+    assert(p->allocated < p->size);
 
-    return true;
+    size_t size = p->size - p->allocated;
+    if (size > REQUEST_POOL_CHUNK_SIZE)
+        size = REQUEST_POOL_CHUNK_SIZE;
+
+    request_chunk_t *c = (request_chunk_t *)
+            malloc(sizeof(request_chunk_t) + size * sizeof(request_t));
+    if (c == NULL)
+        return NULL;
+
+    memset(c, 0, sizeof(request_chunk_t) + size * sizeof(request_t));
+
+    c->size = size;
+
+    for (size_t i = size; i > 0; --i) {
+        request_t *r = &c->mem[i - 1];
+        r->pool.chunk = c;
+        r->curl_ctx   = p->curl_ctx;
+        reset_request(r);
+        r->pool.next = c->free;
+        c->free = r;
+    }
+
+    p->allocated += size;
+    chunk_link(&p->avail, c);
+
+    return c;
+}
+
+
+static
+void
+chunk_free(request_pool_t *p, request_chunk_t *c)
+{
+    for (size_t i = 0; i < c->size; ++i) {
+        request_t *r = &c->mem[i];
+        if (r->easy != NULL) {
+            curl_easy_cleanup(r->easy);
+            r->easy = NULL;
+        }
+        reset_request(r);
+        buffer_free(&r->response);
+        buffer_free(&r->body_stream.buffer);
+        buffer_free(&r->response_headers);
+        buffer_free(&r->headers_allow);
+        buffer_free(&r->cache.key);
+        buffer_free(&r->cache.headers);
+        buffer_free(&r->upstream.url);
+        buffer_free(&r->upload.compressed);
+    }
+
+    p->allocated -= c->size;
+
+    free(c);
 }
 
 
@@ -70,10 +153,20 @@ reset_request(request_t *r)
         r->headers = NULL;
     }
 
+    /* The easy handle is recycled, so the TLS session, the DNS cache
+     * and the connection are kept for the next request */
     if (r->easy) {
-        curl_easy_cleanup(r->easy);
-        r->easy = NULL;
+        if (r->curl_ctx->cpool.keep_options && !r->easy_dirty)
+            request_reset_options(r);
+        else {
+            curl_easy_reset(r->easy);
+            request_set_defaults(r);
+        }
     }
+    r->easy_dirty = false;
+
+    r->buffer_response = false;
+    buffer_reset(&r->response, REQUEST_BUFFER_KEEP_SIZE);
 
     if (r->lua_ctx.L) {
         luaL_unref(r->lua_ctx.L, LUA_REGISTRYINDEX,
@@ -84,6 +177,8 @@ reset_request(request_t *r)
                    r->lua_ctx.done_fn);
         luaL_unref(r->lua_ctx.L, LUA_REGISTRYINDEX,
                    r->lua_ctx.fn_ctx);
+        luaL_unref(r->lua_ctx.L, LUA_REGISTRYINDEX,
+                   r->lua_ctx.body);
     }
 
     r->lua_ctx.L        = NULL;
@@ -91,6 +186,49 @@ reset_request(request_t *r)
     r->lua_ctx.write_fn = LUA_REFNIL;
     r->lua_ctx.done_fn  = LUA_REFNIL;
     r->lua_ctx.fn_ctx   = LUA_REFNIL;
+    r->lua_ctx.body     = LUA_REFNIL;
+
+    r->capture_headers = false;
+    r->decode = DECODE_NONE;
+    buffer_reset(&r->response_headers, REQUEST_BUFFER_KEEP_SIZE);
+    buffer_reset(&r->headers_allow, REQUEST_BUFFER_KEEP_SIZE);
+
+    r->cache.enabled    = false;
+    r->cache.revalidate = false;
+    buffer_reset(&r->cache.key, REQUEST_BUFFER_KEEP_SIZE);
+    buffer_reset(&r->cache.headers, REQUEST_BUFFER_KEEP_SIZE);
+
+    r->host = NULL;
+    r->flight = NULL;
+    r->upstream.group = NULL;
+    r->upstream.peer  = NULL;
+    buffer_reset(&r->upstream.url, REQUEST_BUFFER_KEEP_SIZE);
+    buffer_reset(&r->upload.compressed, REQUEST_BUFFER_KEEP_SIZE);
+    memset(&r->limiter, 0, sizeof(r->limiter));
+    r->breaker_probe = NULL;
+    memset(&r->retry, 0, sizeof(r->retry));
+
+    r->sync.fiber     = NULL;
+    r->sync.batch     = NULL;
+    r->sync.index     = 0;
+    r->sync.next      = NULL;
+    r->sync.done      = false;
+    r->sync.curl_code = CURLE_OK;
+    r->sync.http_code = 0;
+
+    r->stream.limit  = 0;
+    r->stream.paused = false;
+
+    buffer_reset(&r->body_stream.buffer, REQUEST_BUFFER_KEEP_SIZE);
+    r->body_stream.offset   = 0;
+    r->body_stream.limit    = 0;
+    r->body_stream.size     = -1;
+    r->body_stream.finished = false;
+    r->body_stream.paused   = false;
+
+    r->upload.data   = NULL;
+    r->upload.size   = 0;
+    r->upload.offset = 0;
 }
 
 
@@ -102,95 +240,289 @@ request_pool_new(request_pool_t *p, struct curl_ctx_s *c, size_t s)
 
     memset(p, 0, sizeof(request_pool_t));
 
-    p->size = s;
+    /* Chunks are allocated on demand */
+    p->curl_ctx = c;
+    p->size     = s;
+
+    p->queue.classes[REQUEST_PRIORITY_HIGH].weight   = 4;
+    p->queue.classes[REQUEST_PRIORITY_NORMAL].weight = 2;
+    p->queue.classes[REQUEST_PRIORITY_LOW].weight    = 1;
+
+    return true;
+}
+
+
+/** Admission queue {{{
+ */
+static
+void
+waiter_link(request_queue_t *q, request_waiter_t *w)
+{
+    request_waiter_t **tail = &q->classes[w->priority].tail;
+
+    w->prev = *tail;
+    w->next = NULL;
+    if (*tail != NULL)
+        (*tail)->next = w;
+    else
+        q->classes[w->priority].head = w;
+    *tail = w;
+
+    w->linked = true;
+    ++q->size;
+}
+
+
+static
+void
+waiter_unlink(request_queue_t *q, request_waiter_t *w)
+{
+    if (w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        q->classes[w->priority].head = w->next;
+
+    if (w->next != NULL)
+        w->next->prev = w->prev;
+    else
+        q->classes[w->priority].tail = w->prev;
+
+    w->prev = w->next = NULL;
+    w->linked = false;
+    --q->size;
+}
 
-    p->mem = (request_t *) malloc(p->size * sizeof(request_t));
-    if (p->mem == NULL)
-        goto error_exit;
-    memset(p->mem, 0, p->size * sizeof(request_t));
 
-    for (size_t i = 0; i < p->size; ++i) {
-        if (!create_request(c, i, &p->mem[i]))
-            goto error_exit;
+/** Pick a waiter by smooth weighted round-robin: each waiting class gains
+ *  its weight, the richest one is picked and pays the total weight
+ */
+static
+request_waiter_t*
+pick_waiter(request_queue_t *q)
+{
+    int total = 0;
+    int best = -1;
+
+    for (int i = 0; i < REQUEST_PRIORITY_MAX; ++i) {
+        if (q->classes[i].head == NULL)
+            continue;
+        q->classes[i].current += q->classes[i].weight;
+        total += q->classes[i].weight;
+        if (best < 0 || q->classes[i].current > q->classes[best].current)
+            best = i;
     }
 
+    if (best < 0)
+        return NULL;
+
+    q->classes[best].current -= total;
+    return q->classes[best].head;
+}
+
+
+/* Give the request to a waiter, false if nobody waits */
+static
+bool
+grant_request(request_queue_t *q, request_t *r)
+{
+    if (q->size == 0)
+        return false;
+
+    request_waiter_t *w = pick_waiter(q);
+    waiter_unlink(q, w);
+
+    const double waited = fiber_clock() - w->start;
+    histogram_add(&q->stat.wait_time, (uint64_t) (waited * 1000000.0));
+
+    w->r = r;
+    fiber_wakeup(w->fiber);
+
     return true;
-error_exit:
-    request_pool_free(p);
-    return false;
 }
 
 
+/* Wake up all waiters with nothing, the pool is freed */
+static
 void
-request_pool_free(request_pool_t *p)
+queue_free(request_queue_t *q)
 {
-    assert(p);
-
-    if (p->mem) {
-        for (size_t i = 0; i < p->size; ++i)
-            reset_request(&p->mem[i]);
-        free(p->mem);
-        p->mem = NULL;
+    for (int i = 0; i < REQUEST_PRIORITY_MAX; ++i) {
+        while (q->classes[i].head != NULL) {
+            request_waiter_t *w = q->classes[i].head;
+            waiter_unlink(q, w);
+            fiber_wakeup(w->fiber);
+        }
     }
 }
 
 
 request_t*
-request_pool_get_request(request_pool_t *p)
+request_pool_wait_request(request_pool_t *p, int priority, double timeout)
 {
     assert(p);
+    assert(priority >= 0 && priority < REQUEST_PRIORITY_MAX);
 
-    if (p->mem == NULL)
+    request_t *r = request_pool_get_request(p);
+
+    /* Nothing to wait for if it's out of memory */
+    if (r != NULL || p->busy < p->size || p->queue.limit == 0)
+        return r;
+
+    request_queue_t *q = &p->queue;
+    if (q->size >= q->limit) {
+        ++q->stat.rejections;
         return NULL;
+    }
 
-    for (size_t i = 0; i < p->size; ++i) {
+    request_waiter_t w;
+    memset(&w, 0, sizeof(w));
+    w.fiber    = fiber_self();
+    w.priority = priority;
+    w.start    = fiber_clock();
+
+    waiter_link(q, &w);
+    ++q->stat.waits;
+
+    const double deadline = w.start + timeout;
+
+    /* grant_request() and queue_free() unlink the waiter */
+    while (w.linked) {
+        const double left = deadline - fiber_clock();
+        if (left <= 0 || fiber_is_cancelled()) {
+            waiter_unlink(q, &w);
+            if (left <= 0)
+                ++q->stat.timeouts;
+            else
+                ++q->stat.cancellations;
+            break;
+        }
+        fiber_sleep(left);
+    }
+
+    return w.r;
+}
+/* }}} */
 
-        if (!p->mem[i].pool.busy) {
 
-            request_t *r = &p->mem[i];
+void
+request_pool_free(request_pool_t *p)
+{
+    assert(p);
 
-            r->easy = curl_easy_init();
-            if (r->easy == NULL)
-                return NULL;
+    queue_free(&p->queue);
 
-            ++r->curl_ctx->stat.active_requests;
-            r->pool.busy = true;
+    while (p->avail != NULL) {
+        request_chunk_t *c = p->avail;
+        chunk_unlink(&p->avail, c);
+        chunk_free(p, c);
+    }
 
-            return r;
-        }
+    while (p->full != NULL) {
+        request_chunk_t *c = p->full;
+        chunk_unlink(&p->full, c);
+        chunk_free(p, c);
     }
 
-    return NULL;
+    p->busy = 0;
 }
 
 
+/** Return a request into its chunk. An idle chunk is given back to the
+ *  allocator only if a chunk of free requests is left without it, so a load
+ *  which hovers around a multiple of the chunk size doesn't free and allocate
+ *  the requests and their easy handles again and again
+ */
+static
 void
-request_pool_free_request(request_pool_t *p, request_t *r)
+put_request(request_pool_t *p, request_t *r)
 {
-    if (r == NULL || p->mem == NULL)
-        return;
+    request_chunk_t *c = r->pool.chunk;
 
-    if (r->pool.busy) {
-        --r->curl_ctx->stat.active_requests;
-        curl_multi_remove_handle(r->curl_ctx->multi, r->easy);
+    if (c->free == NULL) {
+        chunk_unlink(&p->full, c);
+        chunk_link(&p->avail, c);
     }
 
-    reset_request(r);
+    r->pool.next = c->free;
+    c->free = r;
+
+    --c->busy;
+    --p->busy;
+
+    if (c->busy == 0 &&
+        p->allocated - p->busy - c->size >= REQUEST_POOL_CHUNK_SIZE)
+    {
+        chunk_unlink(&p->avail, c);
+        chunk_free(p, c);
+    }
+}
+
+
+request_t*
+request_pool_get_request(request_pool_t *p)
+{
+    assert(p);
+
+    if (p->avail == NULL) {
+        if (p->allocated >= p->size)
+            return NULL;
+        if (chunk_new(p) == NULL)
+            return NULL;
+    }
+
+    request_chunk_t *c = p->avail;
+    request_t       *r = c->free;
+
+    c->free = r->pool.next;
+    r->pool.next = NULL;
+
+    ++c->busy;
+    ++p->busy;
+
+    if (c->free == NULL) {
+        chunk_unlink(&p->avail, c);
+        chunk_link(&p->full, c);
+    }
+
+    if (r->easy == NULL) {
+        r->easy = curl_easy_init();
+        if (r->easy == NULL) {
+            put_request(p, r);
+            return NULL;
+        }
+        request_set_defaults(r);
+    }
+
+    ++r->curl_ctx->stat.active_requests;
+    r->pool.busy = true;
+
+    return r;
 }
 
 
-size_t
-request_pool_get_free_size(request_pool_t *p)
+void
+request_pool_free_request(request_pool_t *p, request_t *r)
 {
-    size_t size = 0;
+    if (r == NULL || !r->pool.busy)
+        return;
 
-    if (p == NULL)
-        return size;
+    --r->curl_ctx->stat.active_requests;
+    if (r->host != NULL)
+        --r->host->active_requests;
+    request_limiter_release(r);
+    /* The followers mustn't wait for a request which is given up */
+    if (r->flight != NULL)
+        request_flight_done(r, CURLE_ABORTED_BY_CALLBACK, 0);
+    curl_multi_remove_handle(r->curl_ctx->multi, r->easy);
 
-    for (size_t i = 0; i < p->size; ++i) {
-        if (!p->mem[i].pool.busy)
-            ++size;
+    reset_request(r);
+
+    /* The request goes right to a fiber which waits for one */
+    if (grant_request(&p->queue, r)) {
+        ++r->curl_ctx->stat.active_requests;
+        r->pool.busy = true;
+        return;
     }
 
-    return size;
+    put_request(p, r);
 }
@@ -42,22 +42,59 @@
 
 #include <curl/curl.h>
 
+#include "buffer.h"
+#include "queue.h"
+#include "histogram.h"
+#include "decode.h"
+
 struct curl_ctx_s;
 
-typedef struct {
+/* A response buffer which is bigger than this is freed between requests */
+#define REQUEST_BUFFER_KEEP_SIZE (64 * 1024)
+
+/* Requests are allocated by chunks of this size */
+#define REQUEST_POOL_CHUNK_SIZE 64
+
+/* Max number of HTTP statuses of a retry policy */
+#define REQUEST_RETRY_MAX_STATUSES 16
+
+typedef struct request_s request_t;
+typedef struct request_chunk_s request_chunk_t;
+
+struct request_s {
+
+  /* Hot fields, they are touched by every get/free/socket event {{{ */
 
   /* pool meta info */
   struct {
-    size_t idx;
-    bool   busy;
+    /* Next free request of the chunk */
+    request_t       *next;
+    request_chunk_t *chunk;
+    bool            busy;
   } pool;
 
-  /** Information associated with a specific easy handle */
+  /** Information associated with a specific easy handle, it lives
+   *  as long as the request's chunk */
   CURL       *easy;
 
+  /* The easy handle has options which can't be reverted by
+   * request_reset_options(), so it needs curl_easy_reset() */
+  bool       easy_dirty;
+
   /* Reference to curl context */
   struct curl_ctx_s *curl_ctx;
 
+  /* Link in the workers' queues */
+  mpsc_node_t       queue;
+
+  /* The response body is collected here instead of being passed
+   * to the write callback */
+  bool       buffer_response;
+  buffer_t   response;
+  /* }}} */
+
+  /* Cold fields {{{ */
+
   /* Callbacks from lua and Lua context */
   struct {
     lua_State *L;
@@ -65,15 +102,207 @@ typedef struct {
     int       write_fn;
     int       done_fn;
     int       fn_ctx;
+    /* Keeps the upload body alive while curl reads it */
+    int       body;
   } lua_ctx;
 
+  /* The upload body, it's a string owned by Lua or 'compressed' */
+  struct {
+    const char *data;
+    size_t     size;
+    size_t     offset;
+    /* The body which compress_body has produced */
+    buffer_t   compressed;
+  } upload;
+
+  /* A streamed upload body, it's written by a Lua producer and is kept in
+   * 'buffer' up to 'limit' bytes, the transfer is paused while it's empty */
+  struct {
+    buffer_t   buffer;
+    size_t     offset;
+    size_t     limit;
+    /* -1 - unknown, the body is sent chunked */
+    curl_off_t size;
+    bool       finished;
+    bool       paused;
+  } body_stream;
+
   /* HTTP headers */
   struct curl_slist *headers;
-} request_t;
+
+  /* Response headers are collected if 'capture_headers' is set, only the
+   * ones of 'headers_allow' if it's not empty, see headers.h */
+  bool              capture_headers;
+  buffer_t          response_headers;
+  buffer_t          headers_allow;
+
+  /* The body of a sync request is decoded into a Lua value, see decode.h */
+  decode_format_t   decode;
+
+  /* The response cache, see cache.h */
+  struct {
+    /* It's a GET which could be cached */
+    bool     enabled;
+    /* Validators of the cached response are sent */
+    bool     revalidate;
+    buffer_t key;
+    /* All the response headers */
+    buffer_t headers;
+  } cache;
+
+  /* Statistics of the request's upstream, NULL until it's started */
+  struct host_stat_s *host;
+
+  /* The single-flight which is led by the request, see flight.h */
+  struct flight_s   *flight;
+
+  /* The group and the peer of a request to upstream://name/path, url is
+   * the peer's url of the request */
+  struct {
+    struct upstream_s      *group;
+    struct upstream_peer_s *peer;
+    buffer_t               url;
+  } upstream;
+
+  /* The retry policy, a request which is done with a retryable result is
+   * started again after a backoff */
+  struct {
+    bool             enabled;
+    /* The attempts which have been started, and the max of them */
+    int              attempt;
+    int              max_attempts;
+    /* The backoff with full jitter, seconds */
+    double           base_delay;
+    double           max_delay;
+    /* Retry-After of the last response is honored, seconds */
+    bool             use_after;
+    bool             has_after;
+    double           after;
+    /* Bits of the retryable CURLcode values */
+    uint64_t         curl_codes[2];
+    long             statuses[REQUEST_RETRY_MAX_STATUSES];
+    size_t           nstatuses;
+    /* It waits in curl_ctx_t.limiter.retries until 'at' */
+    bool             scheduled;
+    double           at;
+    struct request_s *next;
+  } retry;
+
+  /* The request is delayed by its upstream's limits (it's linked into
+   * the host's list) or it's counted as running by the limiter */
+  struct {
+    bool             delayed;
+    bool             running;
+    struct request_s *prev;
+    struct request_s *next;
+  } limiter;
+
+  /* The host whose half-open circuit breaker has let the request pass as
+   * a probe, NULL if it isn't a probe */
+  struct host_stat_s *breaker_probe;
+
+  /* The result of a transfer which has run in a worker */
+  CURLcode          result;
+
+  /* A fiber or a batch which waits for the request, the request isn't
+   * freed when it's done, the waiter frees it */
+  struct {
+    struct fiber           *fiber;
+    struct request_batch_s *batch;
+    /* The position in the batch, and the link of batch's done list */
+    size_t                 index;
+    struct request_s       *next;
+    bool                   done;
+    CURLcode               curl_code;
+    long                   http_code;
+  } sync;
+
+  /* A streamed response is kept in 'response' up to 'limit' bytes,
+   * the transfer is paused while it's full */
+  struct {
+    size_t limit;
+    bool   paused;
+  } stream;
+  /* }}} */
+};
+
+struct request_chunk_s {
+
+  /* A chunk is linked into request_pool_t.avail if it has free
+   * requests, otherwise into request_pool_t.full */
+  request_chunk_t *prev;
+  request_chunk_t *next;
+
+  /* Stack of free requests */
+  request_t       *free;
+
+  size_t          busy;
+  size_t          size;
+
+  request_t       mem[];
+};
+
+/* Priority classes of the admission queue, a freed request goes to the
+ * waiting classes in proportion to their weights */
+enum {
+  REQUEST_PRIORITY_HIGH,
+  REQUEST_PRIORITY_NORMAL,
+  REQUEST_PRIORITY_LOW,
+  REQUEST_PRIORITY_MAX
+};
+
+typedef struct request_waiter_s request_waiter_t;
+
+/** Fibers which wait for a request while the pool is exhausted, a freed
+ *  request is given to one of them directly
+ */
+typedef struct {
+  struct {
+    /* FIFO of the waiters */
+    request_waiter_t *head;
+    request_waiter_t *tail;
+    int              weight;
+    /* Smooth weighted round-robin between the classes */
+    int              current;
+  } classes[REQUEST_PRIORITY_MAX];
+
+  /* Amount of waiters, at most 'limit', 0 - nobody waits */
+  size_t     size;
+  size_t     limit;
+
+  /* A wait time if the request doesn't set it, in seconds */
+  double     timeout;
+
+  struct {
+    uint64_t    waits;
+    /* The queue was full */
+    uint64_t    rejections;
+    uint64_t    timeouts;
+    /* The fiber was cancelled while it waited */
+    uint64_t    cancellations;
+    /* Wait times of the requests which have been got */
+    histogram_t wait_time;
+  } stat;
+} request_queue_t;
 
 typedef struct {
-  request_t  *mem;
+  struct curl_ctx_s *curl_ctx;
+
+  request_chunk_t *avail;
+  request_chunk_t *full;
+
+  /* Fibers which wait for a request */
+  request_queue_t queue;
+
+  /* Max amount of requests */
   size_t     size;
+
+  /* Amount of requests in use and in allocated chunks */
+  size_t     busy;
+  size_t     allocated;
+
+  /* See curl_args_t.keep_options */
+  bool       keep_options;
 } request_pool_t;
 
 
@@ -81,7 +310,21 @@ bool request_pool_new(request_pool_t *p, struct curl_ctx_s *c, size_t s);
 void request_pool_free(request_pool_t *p);
 
 request_t* request_pool_get_request(request_pool_t *p);
+
+/* Get a request, the fiber waits for one up to 'timeout' seconds if the
+ * pool is exhausted. NULL if the queue is full, the time is out, the fiber
+ * is cancelled or the pool is freed */
+request_t* request_pool_wait_request(request_pool_t *p, int priority,
+                                     double timeout);
 void request_pool_free_request(request_pool_t *p, request_t *c);
-size_t request_pool_get_free_size(request_pool_t *p);
+
+static inline
+size_t
+request_pool_get_free_size(request_pool_t *p)
+{
+  if (p == NULL)
+    return 0;
+  return p->size - p->busy;
+}
 
 #endif /* REQUEST_POOL_H_INCLUDED */
@@ -52,13 +52,13 @@ basic_features(void)
 #endif
         if (l->stat.active_requests > 10)
             break;
-        curl_poll_one(l);
+        fiber_sleep(0.001);
     }
 
     for (;;) {
         if (l->stat.active_requests == 0)
             break;
-        curl_poll_one(l);
+        fiber_sleep(0.001);
     }
 
     curl_print_stat(l, stderr);
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_stat.h"
+#include "upstream.h"
+#include "utils.h"
+
+
+/** FNV-1a folded to 32 bits, the ring is small enough for them
+ */
+static inline
+uint32_t
+hash32(const char *data, size_t size)
+{
+    const uint64_t h = fnv1a(data, size);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+
+static
+int
+point_cmp(const void *a, const void *b)
+{
+    const uint32_t x = ((const upstream_point_t *) a)->hash;
+    const uint32_t y = ((const upstream_point_t *) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+
+static
+bool
+ring_build(upstream_t *u)
+{
+    u->nring = u->npeers * UPSTREAM_RING_POINTS;
+    u->ring = (upstream_point_t *) malloc(u->nring * sizeof(upstream_point_t));
+    if (u->ring == NULL)
+        return false;
+
+    char point[32];
+    for (size_t i = 0; i < u->npeers; ++i) {
+        const uint32_t base = hash32(u->peers[i].url, u->peers[i].url_size);
+        for (size_t j = 0; j < UPSTREAM_RING_POINTS; ++j) {
+            const int n = snprintf(point, sizeof(point), "%u-%zu",
+                                   (unsigned) base, j);
+            upstream_point_t *p = &u->ring[i * UPSTREAM_RING_POINTS + j];
+            p->hash = hash32(point, (size_t) n);
+            p->peer = (uint32_t) i;
+        }
+    }
+
+    qsort(u->ring, u->nring, sizeof(upstream_point_t), point_cmp);
+
+    return true;
+}
+
+
+upstream_t*
+upstream_new(const char *name, upstream_policy_t policy,
+             const char **urls, size_t nurls)
+{
+    assert(name);
+    assert(urls);
+    assert(nurls > 0);
+
+    const size_t name_size = strlen(name) + 1;
+
+    upstream_t *u = (upstream_t *) calloc(1, sizeof(upstream_t) + name_size);
+    if (u == NULL)
+        return NULL;
+
+    memcpy(u->name, name, name_size);
+    u->policy = policy;
+
+    u->peers = (upstream_peer_t *) calloc(nurls, sizeof(upstream_peer_t));
+    if (u->peers == NULL)
+        goto error_exit;
+
+    for (size_t i = 0; i < nurls; ++i) {
+        size_t size = strlen(urls[i]);
+        while (size > 0 && urls[i][size - 1] == '/')
+            --size;
+
+        u->peers[i].url = (char *) malloc(size + 1);
+        if (u->peers[i].url == NULL)
+            goto error_exit;
+        memcpy(u->peers[i].url, urls[i], size);
+        u->peers[i].url[size] = 0;
+        u->peers[i].url_size = size;
+        ++u->npeers;
+    }
+
+    if (policy == UPSTREAM_HASH && !ring_build(u))
+        goto error_exit;
+
+    return u;
+
+error_exit:
+    upstream_delete(u);
+    return NULL;
+}
+
+
+void
+upstream_delete(upstream_t *u)
+{
+    if (u == NULL)
+        return;
+
+    for (size_t i = 0; i < u->npeers; ++i)
+        free(u->peers[i].url);
+    free(u->peers);
+    free(u->ring);
+    free(u);
+}
+
+
+upstream_t*
+upstream_find(upstream_t *list, const char *name, size_t name_size)
+{
+    for (upstream_t *u = list; u != NULL; u = u->next) {
+        if (strlen(u->name) == name_size &&
+            memcmp(u->name, name, name_size) == 0)
+            return u;
+    }
+    return NULL;
+}
+
+
+bool
+upstream_peer_ejected(const upstream_t *u, const upstream_peer_t *p,
+                      double now)
+{
+    if (p->ejected_until > now)
+        return true;
+
+    if (p->host == NULL)
+        return false;
+
+    const breaker_config_t *c = p->host->breaker.set ?
+                                &p->host->breaker.config : u->breaker;
+    return c != NULL && breaker_is_open(&p->host->breaker, c, now);
+}
+
+
+static
+upstream_peer_t*
+pick_round_robin(upstream_t *u, double now)
+{
+    for (size_t i = 0; i < u->npeers; ++i) {
+        upstream_peer_t *p = &u->peers[u->cursor++ % u->npeers];
+        if (!upstream_peer_ejected(u, p, now))
+            return p;
+    }
+    return NULL;
+}
+
+
+static
+upstream_peer_t*
+pick_least_requests(upstream_t *u, double now)
+{
+    upstream_peer_t *best = NULL;
+
+    /* Ties are broken in turn, so an idle group is loaded evenly */
+    const size_t start = u->cursor++;
+    for (size_t i = 0; i < u->npeers; ++i) {
+        upstream_peer_t *p = &u->peers[(start + i) % u->npeers];
+        if (upstream_peer_ejected(u, p, now))
+            continue;
+        const size_t active = p->host != NULL ? p->host->active_requests : 0;
+        if (best == NULL ||
+            active < (best->host != NULL ? best->host->active_requests : 0))
+            best = p;
+    }
+
+    return best;
+}
+
+
+static
+upstream_peer_t*
+pick_hash(upstream_t *u, const char *key, size_t key_size, double now)
+{
+    const uint32_t h = hash32(key, key_size);
+
+    /* The first point which isn't below the hash */
+    size_t lo = 0, hi = u->nring;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (u->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* The next peers on the ring take the keys of an ejected one */
+    for (size_t i = 0; i < u->nring; ++i) {
+        upstream_peer_t *p = &u->peers[u->ring[(lo + i) % u->nring].peer];
+        if (!upstream_peer_ejected(u, p, now))
+            return p;
+    }
+
+    return NULL;
+}
+
+
+upstream_peer_t*
+upstream_pick(upstream_t *u, const char *key, size_t key_size, double now)
+{
+    assert(u);
+
+    upstream_peer_t *p = NULL;
+
+    switch (u->policy) {
+    case UPSTREAM_ROUND_ROBIN:
+        p = pick_round_robin(u, now);
+        break;
+    case UPSTREAM_LEAST_REQUESTS:
+        p = pick_least_requests(u, now);
+        break;
+    case UPSTREAM_HASH:
+        p = pick_hash(u, key, key_size, now);
+        break;
+    }
+
+    if (p != NULL)
+        return p;
+
+    /* All of them are ejected, the one which comes back first is used
+     * rather than failing the request */
+    p = &u->peers[0];
+    for (size_t i = 1; i < u->npeers; ++i) {
+        if (u->peers[i].ejected_until < p->ejected_until)
+            p = &u->peers[i];
+    }
+    return p;
+}
+
+
+void
+upstream_report(upstream_t *u, upstream_peer_t *p, bool ok, double now)
+{
+    assert(u);
+    assert(p);
+
+    if (ok) {
+        p->errors = 0;
+        return;
+    }
+
+    if (u->max_errors == 0 || ++p->errors < u->max_errors)
+        return;
+
+    p->errors = 0;
+    p->ejected_until = now + u->eject_time;
+    ++p->ejections;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef UPSTREAM_H_INCLUDED
+#define UPSTREAM_H_INCLUDED 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "breaker.h"
+
+struct host_stat_s;
+
+/* Requests go to upstream://name/path, the peer's url replaces
+ * upstream://name */
+#define UPSTREAM_SCHEME "upstream://"
+
+/* Points of each peer on the consistent hashing ring */
+#define UPSTREAM_RING_POINTS 160
+
+typedef enum {
+  UPSTREAM_ROUND_ROBIN,
+  /* The peer with the least number of active requests */
+  UPSTREAM_LEAST_REQUESTS,
+  /* Consistent hashing of the request's key */
+  UPSTREAM_HASH
+} upstream_policy_t;
+
+typedef struct upstream_peer_s {
+  /* scheme://host[:port][/prefix] without the trailing '/' */
+  char               *url;
+  size_t             url_size;
+  /* Active requests of the peer are taken from here */
+  struct host_stat_s *host;
+  /* Consecutive failures, the peer is ejected when there are max_errors
+   * of them */
+  size_t             errors;
+  double             ejected_until;
+  uint64_t           ejections;
+} upstream_peer_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t peer;
+} upstream_point_t;
+
+/** A named group of peers which serve the same requests, peers which fail
+ *  are ejected for a while (passive health checking)
+ */
+typedef struct upstream_s {
+  struct upstream_s *next;
+
+  upstream_policy_t policy;
+
+  /* Ejection: consecutive errors, seconds, a response which is slower
+   * than max_latency seconds is an error (0 - off) */
+  size_t            max_errors;
+  double            eject_time;
+  double            max_latency;
+
+  /* The config of the circuit breakers of the peers' hosts which don't
+   * have their own, a peer is skipped while its breaker is open */
+  const breaker_config_t *breaker;
+
+  upstream_peer_t   *peers;
+  size_t            npeers;
+  size_t            cursor;
+
+  /* Sorted by hash, UPSTREAM_HASH only */
+  upstream_point_t  *ring;
+  size_t            nring;
+
+  char              name[];
+} upstream_t;
+
+/* NULL if memory is out */
+upstream_t *upstream_new(const char *name, upstream_policy_t policy,
+                         const char **urls, size_t nurls);
+void upstream_delete(upstream_t *u);
+
+upstream_t *upstream_find(upstream_t *list, const char *name,
+                          size_t name_size);
+
+/* Pick a peer, ejected ones are skipped while there are others. The key is
+ * used by UPSTREAM_HASH */
+upstream_peer_t *upstream_pick(upstream_t *u, const char *key,
+                               size_t key_size, double now);
+
+/* Count the result of a request to the peer */
+void upstream_report(upstream_t *u, upstream_peer_t *p, bool ok,
+                     double now);
+
+bool upstream_peer_ejected(const upstream_t *u, const upstream_peer_t *p,
+                           double now);
+
+#endif /* UPSTREAM_H_INCLUDED */
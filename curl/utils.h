@@ -33,6 +33,8 @@
 #define DRIVER_UTILS_H_INCLUDED 1
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -71,4 +73,77 @@ make_errorno_result(lua_State *L, int the_errno)
 	return 2;
 }
 
+
+/** FNV-1a, it hashes the keys of the tables
+ */
+static inline
+uint64_t
+fnv1a(const char *data, size_t size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+
+/** A link of a chained hash table. It's the first member of an entry, so
+ *  the entry and its link are cast to each other.
+ */
+typedef struct hash_link_s {
+	struct hash_link_s *next;
+	size_t             hash;
+} hash_link_t;
+
+static inline
+void
+hash_link_insert(hash_link_t **buckets, size_t nbuckets, hash_link_t *l)
+{
+	hash_link_t **b = &buckets[l->hash & (nbuckets - 1)];
+	l->next = *b;
+	*b = l;
+}
+
+static inline
+void
+hash_link_remove(hash_link_t **buckets, size_t nbuckets, hash_link_t *l)
+{
+	hash_link_t **p = &buckets[l->hash & (nbuckets - 1)];
+	while (*p != l)
+		p = &(*p)->next;
+	*p = l->next;
+	l->next = NULL;
+}
+
+/** The buckets are doubled if there are more entries than buckets, the
+ *  old ones are kept if memory is out
+ */
+static inline
+void
+hash_buckets_grow(hash_link_t ***buckets, size_t *nbuckets, size_t count)
+{
+	if (count < *nbuckets)
+		return;
+
+	const size_t n = *nbuckets * 2;
+	hash_link_t **b = (hash_link_t **) calloc(n, sizeof(hash_link_t *));
+	if (b == NULL)
+		return;
+
+	for (size_t i = 0; i < *nbuckets; ++i) {
+		hash_link_t *l = (*buckets)[i];
+		while (l != NULL) {
+			hash_link_t *next = l->next;
+			hash_link_insert(b, n, l);
+			l = next;
+		}
+	}
+
+	free(*buckets);
+	*buckets = b;
+	*nbuckets = n;
+}
+
 #endif /* DRIVER_UTILS_H_INCLUDED */
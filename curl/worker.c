@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "debug.h"
+#include "worker.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define request_of(node) \
+    ((request_t *) ((char *) (node) - offsetof(request_t, queue)))
+
+
+#if defined (HAVE_CURL_WORKERS)
+
+/** Pass a finished request to TX, TX is woken up only if it doesn't
+ *  have a notification yet
+ */
+static
+void
+worker_complete(worker_pool_t *p, request_t *r, CURLcode result)
+{
+    r->result = result;
+
+    mpsc_queue_push(&p->completed, &r->queue);
+
+    if (!atomic_exchange(&p->notified, true)) {
+        const char c = 0;
+        if (write(p->fds[1], &c, 1) < 0) {
+            dd("write() to the notify pipe failed, errno = %d", errno);
+        }
+    }
+}
+
+
+/** The worker's thread, it runs the transfers of its multi handle
+ */
+static
+void*
+worker_f(void *arg)
+{
+    worker_t      *w = (worker_t *) arg;
+    worker_pool_t *p = w->pool;
+    mpsc_node_t   *node;
+    CURLMsg       *msg;
+    int           msgs_left;
+    int           still_running;
+
+    while (!atomic_load(&w->stop)) {
+
+        while ((node = mpsc_queue_pop(&w->submitted)) != NULL) {
+            request_t *r = request_of(node);
+            if (curl_multi_add_handle(w->multi, r->easy) != CURLM_OK)
+                worker_complete(p, r, CURLE_OUT_OF_MEMORY);
+        }
+
+        curl_multi_perform(w->multi, &still_running);
+
+        while ((msg = curl_multi_info_read(w->multi, &msgs_left))) {
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            request_t *r;
+            CURL      *easy   = msg->easy_handle;
+            CURLcode  result  = msg->data.result;
+
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (void *) &r);
+
+            /* The request belongs to TX since now */
+            curl_multi_remove_handle(w->multi, easy);
+            worker_complete(p, r, result);
+        }
+
+        /* curl_multi_wakeup() interrupts it */
+        curl_multi_poll(w->multi, NULL, 0, 1000, NULL);
+    }
+
+    return NULL;
+}
+
+
+/** TX fiber, it dispatches the requests finished by the workers
+ */
+static
+int
+notify_f(va_list ap)
+{
+    worker_pool_t *p = va_arg(ap, worker_pool_t *);
+    mpsc_node_t   *node;
+    char          buf[64];
+
+    while (!p->done) {
+
+        coio_wait(p->fds[0], COIO_READ, TIMEOUT_INFINITY);
+        if (p->done)
+            break;
+
+        while (read(p->fds[0], buf, sizeof(buf)) > 0)
+            ;
+
+        /* A request which is pushed after this point notifies again */
+        atomic_store(&p->notified, false);
+
+        while ((node = mpsc_queue_pop(&p->completed)) != NULL) {
+            request_t *r = request_of(node);
+            curl_request_done(p->curl_ctx, r, r->result);
+        }
+    }
+
+    return 0;
+}
+
+
+worker_pool_t*
+worker_pool_new(curl_ctx_t *l, const curl_args_t *a)
+{
+    assert(l);
+    assert(a);
+    assert(a->threads > 0);
+
+    worker_pool_t *p = (worker_pool_t *) malloc(sizeof(worker_pool_t));
+    if (p == NULL)
+        return NULL;
+
+    memset(p, 0, sizeof(worker_pool_t));
+
+    p->curl_ctx = l;
+    p->fds[0] = p->fds[1] = -1;
+
+    mpsc_queue_init(&p->completed);
+    atomic_store(&p->notified, false);
+
+    if (pipe(p->fds) != 0)
+        goto error_exit;
+
+    if (fcntl(p->fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(p->fds[1], F_SETFL, O_NONBLOCK) != 0)
+        goto error_exit;
+
+    p->mem = (worker_t *) malloc(a->threads * sizeof(worker_t));
+    if (p->mem == NULL)
+        goto error_exit;
+
+    memset(p->mem, 0, a->threads * sizeof(worker_t));
+
+    p->size = a->threads;
+
+    for (size_t i = 0; i < p->size; ++i) {
+
+        worker_t *w = &p->mem[i];
+
+        w->pool = p;
+        mpsc_queue_init(&w->submitted);
+        atomic_store(&w->stop, false);
+
+        w->multi = curl_multi_init();
+        if (w->multi == NULL)
+            goto error_exit;
+
+        curl_multi_set_args(w->multi, a);
+
+        if (pthread_create(&w->thread, NULL, worker_f, (void *) w) != 0)
+            goto error_exit;
+        w->started = true;
+    }
+
+    p->fiber = fiber_new("__curl_notify_fiber", notify_f);
+    if (p->fiber == NULL)
+        goto error_exit;
+
+    fiber_set_joinable(p->fiber, true);
+    fiber_start(p->fiber, p);
+
+    return p;
+
+error_exit:
+    worker_pool_free(p);
+    return NULL;
+}
+
+
+void
+worker_pool_free(worker_pool_t *p)
+{
+    if (p == NULL)
+        return;
+
+    if (p->fiber != NULL) {
+        p->done = true;
+        fiber_wakeup(p->fiber);
+        fiber_join(p->fiber);
+    }
+
+    for (size_t i = 0; i < p->size; ++i) {
+        worker_t *w = &p->mem[i];
+        if (w->started) {
+            atomic_store(&w->stop, true);
+            curl_multi_wakeup(w->multi);
+            pthread_join(w->thread, NULL);
+        }
+    }
+
+    /* The threads have gone, the easy handles which are still added
+     * are left to the request pool */
+    for (size_t i = 0; i < p->size; ++i) {
+        if (p->mem[i].multi != NULL)
+            curl_multi_cleanup(p->mem[i].multi);
+    }
+
+    free(p->mem);
+
+    if (p->fds[0] >= 0)
+        close(p->fds[0]);
+    if (p->fds[1] >= 0)
+        close(p->fds[1]);
+
+    free(p);
+}
+
+
+void
+worker_pool_submit(worker_pool_t *p, request_t *r)
+{
+    worker_t *w = &p->mem[p->next];
+
+    p->next = (p->next + 1) % p->size;
+
+    mpsc_queue_push(&w->submitted, &r->queue);
+    curl_multi_wakeup(w->multi);
+}
+
+#else /* HAVE_CURL_WORKERS */
+
+worker_pool_t*
+worker_pool_new(curl_ctx_t *l __attribute__((unused)),
+                const curl_args_t *a __attribute__((unused)))
+{
+    /* curl is too old */
+    return NULL;
+}
+
+
+void
+worker_pool_free(worker_pool_t *p __attribute__((unused)))
+{
+}
+
+
+void
+worker_pool_submit(worker_pool_t *p __attribute__((unused)),
+                   request_t *r __attribute__((unused)))
+{
+}
+
+#endif /* HAVE_CURL_WORKERS */
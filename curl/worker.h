@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2016 - 2017 Tarantool AUTHORS: please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef WORKER_H_INCLUDED
+#define WORKER_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "curl_wrapper.h"
+
+/* Workers need curl_multi_poll() and curl_multi_wakeup() */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#  define HAVE_CURL_WORKERS 1
+#endif
+
+/** A thread which runs its own multi handle
+ */
+typedef struct {
+  pthread_t      thread;
+  bool           started;
+
+  CURLM          *multi;
+
+  /* Requests which are submitted from TX */
+  mpsc_queue_t   submitted;
+
+  atomic_bool    stop;
+
+  struct worker_pool_s *pool;
+} worker_t;
+
+/** Workers of a curl_ctx_t, requests are configured and finished in TX,
+ *  only their transfers run in the worker threads
+ */
+struct worker_pool_s {
+  curl_ctx_t     *curl_ctx;
+
+  worker_t       *mem;
+  size_t         size;
+  size_t         next;
+
+  /* Requests which are finished by the workers */
+  mpsc_queue_t   completed;
+
+  /* TX is woken up through the pipe, 'notified' is set while
+   * there's a byte in it */
+  int            fds[2];
+  atomic_bool    notified;
+
+  /* TX fiber which dispatches the completed requests */
+  struct fiber   *fiber;
+  bool           done;
+};
+
+
+/* It starts a->threads workers, it returns NULL on error */
+worker_pool_t* worker_pool_new(curl_ctx_t *l, const curl_args_t *a);
+void worker_pool_free(worker_pool_t *p);
+
+void worker_pool_submit(worker_pool_t *p, request_t *r);
+
+#endif /* WORKER_H_INCLUDED */
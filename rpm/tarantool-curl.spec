@@ -10,12 +10,13 @@ BuildRequires: cmake >= 2.8
 BuildRequires: gcc >= 4.5
 BuildRequires: tarantool >= 1.7.2.0
 BuildRequires: tarantool-devel
-BuildRequires: libev, libev-devel
 BuildRequires: openssl, openssl-devel
 BuildRequires: c-ares, c-ares-devel
+BuildRequires: libnghttp2, libnghttp2-devel
+BuildRequires: zlib, zlib-devel
 BuildRequires: nodejs, libuv
 
-Requires: tarantool >= 1.7.2, libev, c-ares
+Requires: tarantool >= 1.7.2, c-ares, libnghttp2, zlib
 
 %description
 This package provides a Curl based HTTP client for Tarantool.
@@ -18,7 +18,7 @@ local os    = require('os')
 local headers   = { my_header = "1", my_header2 = "2" }
 local my_body   = { key="value" }
 
-local http = curl.http({pool_size = 2})
+local http = curl.http({pool_size = 3})
 
 print(http.VERSION)
 
@@ -76,6 +76,21 @@ local ok, msg = http:async_post('http://httpbin.org/post',
                     })
 assert(ok)
 
+-- GET, the body is collected by the driver
+contexts['BUFFERED'] = { done = false, response = '' }
+local ok, msg = http:async_get('http://httpbin.org/get',
+                    {headers = headers,
+                     buffer_response = true,
+                     read = function(cnt, ctx) return '' end,
+                     done = function(curl_code, http_code, error_msg, ctx,
+                                     body)
+                        done(curl_code, http_code, error_msg, ctx)
+                        ctx.response = body
+                     end,
+                     ctx = contexts['BUFFERED'],
+                    })
+assert(ok)
+
 -- Join & tests
 local ticks = 0
 while http:stat().active_requests ~= 0 do
@@ -97,13 +112,18 @@ while http:stat().active_requests ~= 0 do
     fiber.sleep(2)
 end
 
+local bctx = contexts['BUFFERED']
+assert(bctx.done and bctx.http_code == 200)
+assert(json.decode(bctx.response).headers['My-Header'] == headers.my_header)
+
 local st = http:stat()
 assert(st.sockets_added == st.sockets_deleted)
 assert(st.active_requests == 0)
 assert(st.loop_calls > 0)
 local pst = http:pool_stat()
-assert(pst.pool_size == 2)
+assert(pst.pool_size == 3)
 assert(pst.free == pst.pool_size)
+assert(pst.allocated <= pst.pool_size)
 
 http:free()
 
@@ -63,6 +63,558 @@ run(false, 'Issue timeout', function()
   return true
 end)
 
+run(false, 'HTTP/2 multiplexing', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({multiplex = true, max_concurrent_streams = 10})
+  local codes = {}
+  local cond = fiber.cond()
+  for i = 1, 5 do
+    fiber.create(function()
+      local res = http:get('https://httpbin.org/get', {http_version = '2tls'})
+      table.insert(codes, res.code)
+      cond:signal()
+    end)
+  end
+  while #codes < 5 do
+    cond:wait()
+  end
+  for _, code in ipairs(codes) do
+    assert(code == 200)
+  end
+  local ok = pcall(http.get, http, 'https://httpbin.org/get',
+                   {http_version = '3.0'})
+  assert(ok == false)
+  http:free()
+  return true
+end)
+
+run(false, 'Shared caches', function()
+  local curl = require('curl')
+  local share = curl.share()
+  local http1 = curl.http({share = share})
+  local http2 = curl.http({share = share})
+  -- Connections are kept alive by default, the second instance reuses one
+  assert(http1:get('https://httpbin.org/get').code == 200)
+  assert(http2:get('https://httpbin.org/get').code == 200)
+  local st = share:stat()
+  assert(st.instances == 2)
+  assert(st.dns_lock_calls > 0)
+  assert(st.connections_new == 1 and st.connections_reused == 1)
+  -- The share is in use
+  assert(pcall(share.free, share) == false)
+  http1:free()
+  http2:free()
+  share:free()
+  return true
+end)
+
+run(false, 'Transfers in threads', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({threads = 2})
+  local codes = {}
+  local cond = fiber.cond()
+  for i = 1, 4 do
+    fiber.create(function()
+      local res = http:post('https://httpbin.org/post', 'body' .. i)
+      table.insert(codes, res.code)
+      cond:signal()
+    end)
+  end
+  while #codes < 4 do
+    cond:wait()
+  end
+  for _, code in ipairs(codes) do
+    assert(code == 200)
+  end
+  -- Lua callbacks can't run in a thread
+  local ok = pcall(http.async_get, http, 'https://httpbin.org/get',
+                   {read = function() end, write = function() end,
+                    done = function() end})
+  assert(ok == false)
+  -- Streams are filled and drained by TX during the transfer
+  ok = pcall(http.stream, http, 'GET', 'https://httpbin.org/get',
+             {buffer_response = true})
+  assert(ok == false)
+  ok = pcall(http.stream, http, 'POST', 'https://httpbin.org/post',
+             {upload = true, buffer_response = true})
+  assert(ok == false)
+  local st = http:stat()
+  assert(st.active_requests == 0)
+  http:free()
+  return true
+end)
+
+run(false, 'Batch of requests', function()
+  local curl = require('curl')
+  local http = curl.http({pool_size = 2})
+  local requests = {}
+  for i = 1, 5 do
+    table.insert(requests, {'GET', 'https://httpbin.org/get?i=' .. i})
+  end
+  table.insert(requests, {'POST', 'https://httpbin.org/post', 'body'})
+  table.insert(requests, {'PATCH', 'https://httpbin.org/get'})
+  local res = http:request_many(requests, {concurrency = 3})
+  assert(#res == 7)
+  for i = 1, 6 do
+    assert(res[i].code == 200)
+  end
+  assert(res[7].error ~= nil)
+  -- The deadline aborts what is not done yet
+  res = http:request_many({{'GET', 'https://httpbin.org/delay/5'}},
+                          {timeout = 0.5})
+  assert(res[1].error == 'timeout')
+  assert(http:stat().active_requests == 0)
+  http:free()
+  return true
+end)
+
+run(false, 'Batch of requests in the admission queue', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({pool_size = 1, queue_size = 4, queue_timeout = 10})
+  local order = {}
+  fiber.create(function()
+    http:get('https://httpbin.org/delay/1')
+  end)
+  fiber.sleep(0.1)
+  -- A low request queues first, the high batch gets the pool before it
+  local ch = fiber.channel(2)
+  fiber.create(function()
+    http:get('https://httpbin.org/get', {priority = 'low'})
+    table.insert(order, 'low')
+    ch:put(true)
+  end)
+  fiber.create(function()
+    local res = http:request_many({{'GET', 'https://httpbin.org/get'}},
+                                  {priority = 'high'})
+    assert(res[1].code == 200)
+    table.insert(order, 'high')
+    ch:put(true)
+  end)
+  ch:get()
+  ch:get()
+  assert(order[1] == 'high' and order[2] == 'low')
+  -- The deadline expires in the queue
+  fiber.create(function()
+    ch:put(http:get('https://httpbin.org/delay/2').code)
+  end)
+  fiber.sleep(0.1)
+  local res = http:request_many({{'GET', 'https://httpbin.org/get'},
+                                 {'GET', 'https://httpbin.org/get'}},
+                                {timeout = 0.5})
+  assert(res[1].error == 'timeout' and res[2].error == 'timeout')
+  assert(not pcall(http.request_many, http, {}, {priority = 'urgent'}))
+  assert(ch:get() == 200)
+  http:free()
+  return true
+end)
+
+run(false, 'Streamed response', function()
+  local curl = require('curl')
+  local http = curl.http()
+  -- A small buffer makes the transfer pause between reads
+  local stream = http:stream('GET', 'https://httpbin.org/bytes/102400',
+                             {buffer_size = 4096})
+  local size = 0
+  while true do
+    local chunk = stream:read()
+    if chunk == nil then
+      break
+    end
+    assert(#chunk > 0)
+    size = size + #chunk
+  end
+  assert(size == 102400)
+  assert(stream:code() == 200)
+  stream:close()
+  assert(pcall(stream.read, stream) == false)
+  assert(http:stat().active_requests == 0)
+  http:free()
+  return true
+end)
+
+run(false, 'Streamed upload', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local json = require('json')
+  local http = curl.http()
+  -- A generator
+  local i = 0
+  local res = http:post('https://httpbin.org/post', function()
+    i = i + 1
+    if i <= 3 then
+      return 'chunk' .. i
+    end
+  end)
+  assert(res.code == 200)
+  assert(json.decode(res.body).data == 'chunk1chunk2chunk3')
+  -- A channel, the transfer waits for the producer
+  local ch = fiber.channel(1)
+  fiber.create(function()
+    for j = 1, 3 do
+      fiber.sleep(0.1)
+      ch:put('part' .. j)
+    end
+    ch:close()
+  end)
+  res = http:put('https://httpbin.org/put', ch, {body_size = 15})
+  assert(res.code == 200)
+  assert(json.decode(res.body).data == 'part1part2part3')
+  http:free()
+  return true
+end)
+
+run(false, 'Response cache', function()
+  local curl = require('curl')
+  local http = curl.http({cache_size = 1024 * 1024})
+  local url = 'https://httpbin.org/cache/60'
+  local r1 = http:get(url)
+  assert(r1.code == 200)
+  local r2 = http:get(url)
+  assert(r2.code == 200)
+  assert(r2.body == r1.body)
+  local st = http:stat()
+  assert(st.cache_hits == 1)
+  assert(st.cache_misses == 1)
+  assert(st.cache_entries == 1)
+  -- It's bypassed on demand
+  assert(http:get(url, {cache = false}).code == 200)
+  assert(http:stat().cache_hits == 1)
+  -- It's revalidated each time, a 304 is served from memory
+  url = 'https://httpbin.org/etag/abc'
+  assert(http:get(url).code == 200)
+  assert(http:get(url).code == 200)
+  assert(http:stat().cache_revalidations == 1)
+  -- Credentials bypass it, Accept is a part of the key
+  url = 'https://httpbin.org/cache/60'
+  local misses = http:stat().cache_misses
+  http:get(url, {headers = {Authorization = 'Bearer x'}})
+  assert(http:stat().cache_misses == misses)
+  assert(http:stat().cache_hits == 1)
+  http:get(url, {headers = {Accept = 'text/plain'}})
+  assert(http:stat().cache_misses == misses + 1)
+  http:free()
+  return true
+end)
+
+run(false, 'Coalesced requests', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({pool_size = 1})
+  local url = 'https://httpbin.org/delay/1'
+  local ch = fiber.channel(4)
+  for _ = 1, 4 do
+    fiber.create(function()
+      ch:put(http:get(url, {coalesce = true}))
+    end)
+  end
+  local body
+  for _ = 1, 4 do
+    local r = ch:get()
+    assert(r.code == 200)
+    assert(body == nil or r.body == body)
+    body = r.body
+  end
+  assert(http:stat().coalesced_requests == 3)
+  http:free()
+  return true
+end)
+
+run(false, 'Coalesced requests in the admission queue', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({pool_size = 1, queue_size = 8, queue_timeout = 10})
+  -- Another url takes the pool, the identical GETs have to queue
+  fiber.create(function()
+    http:get('https://httpbin.org/delay/2')
+  end)
+  fiber.sleep(0.1)
+  local url = 'https://httpbin.org/delay/1'
+  local ch = fiber.channel(4)
+  for _ = 1, 4 do
+    fiber.create(function()
+      ch:put(http:get(url, {coalesce = true}))
+    end)
+  end
+  for _ = 1, 4 do
+    assert(ch:get().code == 200)
+  end
+  -- Only the leader has waited for a request
+  assert(http:stat().coalesced_requests == 3)
+  assert(http:pool_stat().queue_waits == 1)
+  http:free()
+  return true
+end)
+
+run(false, 'Admission queue', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({pool_size = 1, queue_size = 2, queue_timeout = 10})
+  local url = 'https://httpbin.org/delay/1'
+  local ch = fiber.channel(4)
+  for i = 1, 4 do
+    fiber.create(function()
+      local ok, r = pcall(http.get, http, url,
+                          {priority = i % 2 == 0 and 'high' or 'low'})
+      ch:put(ok and r.code == 200)
+    end)
+  end
+  local ok = 0
+  for _ = 1, 4 do
+    if ch:get() then
+      ok = ok + 1
+    end
+  end
+  -- One runs, two wait, the last one finds the queue full
+  assert(ok == 3)
+  local st = http:pool_stat()
+  assert(st.queue_waits == 2)
+  assert(st.queue_rejections == 1)
+  assert(st.queue_size == 0)
+  -- A cancelled waiter isn't a timeout
+  fiber.create(function()
+    ch:put(http:get(url).code)
+  end)
+  local waiter = fiber.create(function()
+    http:get(url)
+  end)
+  fiber.sleep(0.1)
+  waiter:cancel()
+  assert(ch:get() == 200)
+  st = http:pool_stat()
+  assert(st.queue_cancellations == 1 and st.queue_timeouts == 0)
+  http:free()
+  return true
+end)
+
+run(false, 'Upstream limits', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http({host_limits = {max_requests = 1}})
+  local url = 'https://httpbin.org/get'
+  local ch = fiber.channel(3)
+  for _ = 1, 3 do
+    fiber.create(function()
+      ch:put(http:get(url).code)
+    end)
+  end
+  for _ = 1, 3 do
+    assert(ch:get() == 200)
+  end
+  local st = http:host_stat()['https://httpbin.org:443']
+  assert(st.delayed_requests == 2)
+  assert(st.running_requests == 0 and st.queued_requests == 0)
+  -- 1 request per second, the first one takes the only token
+  http:set_host_limit(url, {rate = 1, burst = 1})
+  local start = fiber.clock()
+  assert(http:get(url).code == 200)
+  assert(http:get(url).code == 200)
+  assert(fiber.clock() - start >= 0.9)
+  http:free()
+  return true
+end)
+
+run(false, 'Retries', function()
+  local curl = require('curl')
+  local http = curl.http()
+  local r = http:get('https://httpbin.org/status/503',
+                     {retry = {attempts = 3, base_delay = 0.01}})
+  assert(r.code == 503)
+  assert(r.attempts == 3)
+  assert(http:stat().retries == 2)
+  -- A POST isn't retried unless it's allowed
+  r = http:post('https://httpbin.org/status/503', 'x', {retry = true})
+  assert(r.code == 503)
+  assert(r.attempts == nil)
+  r = http:post('https://httpbin.org/status/503', 'x',
+                {retry = {attempts = 2, base_delay = 0.01,
+                          idempotent_only = false}})
+  assert(r.attempts == 2)
+  http:free()
+  return true
+end)
+
+run(false, 'Hedged requests', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http()
+  local start = fiber.clock()
+  local r = http:get('https://httpbin.org/delay/3',
+                     {hedge = {url = 'https://httpbin.org/get', delay = 0.2}})
+  assert(r.code == 200)
+  assert(fiber.clock() - start < 3)
+  local st = http:stat()
+  assert(st.hedges == 1 and st.hedges_won == 1)
+  -- The loser is back in the pool
+  assert(http:pool_stat().free == http:pool_stat().pool_size)
+  -- A POST isn't sent twice
+  r = http:post('https://httpbin.org/delay/1', 'x',
+                {hedge = {url = 'https://httpbin.org/post', delay = 0.1}})
+  assert(r.code == 200)
+  assert(http:stat().hedges == 1)
+  assert(http:host_stat()['https://httpbin.org:443'].requests == 3)
+  -- A HEAD is hedged and has no body
+  r = http:head('https://httpbin.org/delay/3',
+                {hedge = {url = 'https://httpbin.org/get', delay = 0.2}})
+  assert(r.code == 200 and r.body == '')
+  assert(http:stat().hedges == 2)
+  http:free()
+  return true
+end)
+
+run(false, 'Upstream groups', function()
+  local curl = require('curl')
+  local http = curl.http()
+  http:add_upstream('bin', {urls = {'https://httpbin.org/',
+                                    'http://httpbin.org'}})
+  assert(not pcall(http.add_upstream, http, 'bin', {urls = {'http://a'}}))
+  assert(http:get('upstream://bin/status/200').code == 200)
+  assert(not pcall(http.get, http, 'upstream://nope/'))
+  -- The first peer fails and is ejected, the other one gets requests
+  http:add_upstream('flaky', {urls = {'https://httpbin.org/status/503',
+                                      'https://httpbin.org/status/200'},
+                              max_errors = 1})
+  assert(http:get('upstream://flaky').code == 503)
+  assert(http:get('upstream://flaky').code == 200)
+  assert(http:get('upstream://flaky').code == 200)
+  local st = http:upstream_stat().flaky
+  assert(st[1].ejected and st[1].ejections == 1 and not st[2].ejected)
+  http:free()
+  return true
+end)
+
+run(false, 'Circuit breakers', function()
+  local curl = require('curl')
+  local fiber = require('fiber')
+  local http = curl.http()
+  local url = 'https://httpbin.org/status/503'
+  http:set_circuit_breaker(url, {error_rate = 0.5, min_requests = 2,
+                                 open_time = 1})
+  assert(http:get(url).code == 503)
+  assert(http:get(url).code == 503)
+  local ok, err = pcall(http.get, http, url)
+  assert(not ok and tostring(err):find('circuit breaker is open'))
+  local st = http:host_stat()['https://httpbin.org:443']
+  assert(st.breaker == 'open' and st.breaker_opened == 1)
+  assert(http:stat().breaker_rejections == 1)
+  -- A failed probe opens it again
+  fiber.sleep(1.1)
+  assert(http:get(url).code == 503)
+  st = http:host_stat()['https://httpbin.org:443']
+  assert(st.breaker == 'open' and st.breaker_half_opened == 1)
+  http:free()
+  return true
+end)
+
+run(false, 'Compression', function()
+  local curl = require('curl')
+  local json = require('json')
+  local http = curl.http()
+  local r = http:get('https://httpbin.org/gzip', {accept_encoding = true})
+  assert(r.code == 200)
+  assert(json.decode(r.body).gzipped == true)
+  r = http:post('https://httpbin.org/post', string.rep('x', 4096),
+                {compress_body = true})
+  assert(r.code == 200)
+  assert(json.decode(r.body).headers['Content-Encoding'] == 'gzip')
+  -- Nothing to compress
+  r = http:get('https://httpbin.org/anything', {compress_body = true})
+  assert(json.decode(r.body).headers['Content-Encoding'] == nil)
+  r = http:post('https://httpbin.org/anything', '', {compress_body = true})
+  assert(json.decode(r.body).headers['Content-Encoding'] == nil)
+  assert(json.decode(r.body).data == '')
+  assert(not pcall(http.post, http, 'https://httpbin.org/post', 'x',
+                   {compress_body = 'zip'}))
+  http:free()
+  return true
+end)
+
+run(false, 'Decoding', function()
+  local curl = require('curl')
+  local json = require('json')
+  local http = curl.http()
+  local r = http:get('https://httpbin.org/json', {decode = 'json'})
+  assert(r.code == 200 and type(r.body) == 'table')
+  assert(r.body.slideshow ~= nil and r.decode_error == nil)
+  r = http:get('https://httpbin.org/html', {decode = 'json'})
+  assert(type(r.body) == 'string' and r.decode_error:find('^json: '))
+  r = http:post('https://httpbin.org/anything', json.encode({a = 1}),
+                {decode = 'json'})
+  assert(r.body.json.a == 1 and r.body.json.b == nil)
+  assert(not pcall(http.get, http, 'https://httpbin.org/json',
+                   {decode = 'xml'}))
+  http:free()
+  return true
+end)
+
+run(false, 'Decoding MsgPack, big integers and deep nesting', function()
+  local curl = require('curl')
+  local msgpack = require('msgpack')
+  local digest = require('digest')
+  local http = curl.http()
+  -- httpbin returns the bytes of /base64/<data> as they are
+  local function echo(data, format)
+    local b64 = digest.base64_encode(data, {urlsafe = true, nowrap = true})
+    return http:get('https://httpbin.org/base64/' .. b64, {decode = format})
+  end
+  local r = echo(msgpack.encode({1, 'a', {b = true}}), 'msgpack')
+  assert(r.code == 200 and r.decode_error == nil)
+  assert(r.body[1] == 1 and r.body[2] == 'a' and r.body[3].b == true)
+  r = echo(msgpack.encode({1, 'a'}) .. '\0', 'msgpack')
+  assert(type(r.body) == 'string' and r.decode_error:find('^msgpack: '))
+  -- A tuple
+  r = echo(msgpack.encode({1, 'a', {2}}), 'tuple')
+  assert(box.tuple.is(r.body) and r.body[2] == 'a' and r.body[3][1] == 2)
+  r = echo(msgpack.encode({a = 1}), 'tuple')
+  assert(type(r.body) == 'string' and r.decode_error ~= nil)
+  -- Integers which a double can't hold
+  r = echo(msgpack.encode({9007199254740993ULL, -9007199254740993LL}),
+           'msgpack')
+  assert(r.body[1] == 9007199254740993ULL)
+  assert(r.body[2] == -9007199254740993LL)
+  r = echo('[9007199254740993, -9007199254740993, 18446744073709551615]',
+           'json')
+  assert(r.body[1] == 9007199254740993ULL)
+  assert(r.body[2] == -9007199254740993LL)
+  assert(r.body[3] == 18446744073709551615ULL)
+  r = echo('[9007199254740992]', 'json')
+  assert(type(r.body[1]) == 'number')
+  -- A surrogate pair is one UTF-8 character, a lone surrogate is kept
+  r = echo('["\\ud83d\\ude00", "\\ud83d"]', 'json')
+  assert(r.body[1] == '\xf0\x9f\x98\x80')
+  assert(r.body[2] == '\xed\xa0\xbd')
+  -- The depth limit
+  local depth = 128
+  r = echo(string.rep('[', depth) .. string.rep(']', depth), 'json')
+  assert(r.decode_error == nil and type(r.body) == 'table')
+  r = echo(string.rep('[', depth + 1) .. string.rep(']', depth + 1), 'json')
+  assert(type(r.body) == 'string' and r.decode_error:find('deep'))
+  r = echo(string.rep('\x91', depth + 1) .. '\x90', 'msgpack')
+  assert(type(r.body) == 'string' and r.decode_error:find('deep'))
+  r = echo(string.rep('\x91', depth + 1) .. '\x90', 'tuple')
+  assert(type(r.body) == 'string' and r.decode_error:find('deep'))
+  http:free()
+  return true
+end)
+
+run(false, 'Many fields with the same name', function()
+  local curl = require('curl')
+  local http = curl.http()
+  local args = {}
+  for i = 1, 100 do
+    table.insert(args, 'Set-Cookie=c' .. i)
+  end
+  local r = http:get('https://httpbin.org/response-headers?' ..
+                     table.concat(args, '&'), {response_headers = true})
+  assert(r.code == 200)
+  local v = r.headers['set-cookie']
+  assert(v:find('^c1, c2, ') and v:find(', c100$'))
+  http:free()
+  return true
+end)
+
 print('[+] bugs OK')
 
 os.exit(0)
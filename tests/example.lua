@@ -47,14 +47,48 @@ assert(obody.headers['My-Header'] == headers.my_header)
 assert(obody.headers['My-Header2'] == headers.my_header2)
 -- }}}
 
+-- Response headers {{{
+local r = http:get('http://httpbin.org/response-headers?ETag=abc',
+                   {response_headers = true})
+assert(r.code == 200)
+assert(r.headers['etag'] == 'abc')
+assert(r.headers['Content-Type'] == 'application/json')
+assert(r.headers()['content-type'] == 'application/json')
+local r = http:get('http://httpbin.org/response-headers?ETag=abc',
+                   {response_headers = {'ETag'}})
+assert(r.headers.etag == 'abc')
+assert(r.headers['content-type'] == nil)
+-- }}}
+
 local st = http:stat()
 assert(st.sockets_added == st.sockets_deleted)
 assert(st.active_requests == 0)
 assert(st.loop_calls > 0)
+assert(st.timing.total.count > 0)
+assert(st.timing.total.p50 > 0)
+assert(st.timing.total.p50 <= st.timing.total.p999)
+assert(st.timing.namelookup.p50 <= st.timing.total.p50)
+local hst = http:host_stat()['http://httpbin.org:80']
+assert(hst.requests > 0)
+assert(hst.active_requests == 0)
+assert(hst.bytes_in > 0)
+assert(hst.connections_new + hst.connections_reused + hst.errors ==
+       hst.requests)
 local pst = http:pool_stat()
 assert(pst.pool_size == 1)
 assert(pst.free == pst.pool_size)
 http:free()
 
+-- Pooled handles keep their default options {{{
+local http = curl.http({pool_size = 1, keep_options = true})
+local r = http:post('http://httpbin.org/post', json_body,
+                    {headers = headers})
+assert(r.code == 200)
+-- The handle was used for POST, it must be reverted to GET
+local r = http:get('http://httpbin.org/get')
+assert(r.code == 200)
+http:free()
+-- }}}
+
 print('[+] example OK')
 os.exit(0)